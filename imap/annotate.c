@@ -63,6 +63,7 @@
 
 #include "acl.h"
 #include "assert.h"
+#include "bsearch.h"
 #include "cyrusdb.h"
 #include "exitcodes.h"
 #include "glob.h"
@@ -156,6 +157,9 @@ struct annotate_state
     uint32_t lastuid;
     annotate_fetch_cb_t callback;
     void *callback_rock;
+    /* mailbox-scope db annotations prefetched by annotate_state_prefetch,
+     * keyed by internal mailbox name */
+    struct hash_table *prefetch;
 
     /*
      * Storing.
@@ -258,6 +262,7 @@ static int _annotate_may_store(annotate_state_t *state,
 static void annotate_begin(annotate_db_t *d);
 static void annotate_abort(annotate_db_t *d);
 static int annotate_commit(annotate_db_t *d);
+static void prefetch_free(annotate_state_t *state);
 
 /* String List Management */
 /*
@@ -1018,6 +1023,202 @@ out:
     return r;
 }
 
+/*************************  Batched Annotation Fetch  ***********************/
+
+struct prefetch_rec {
+    char *entry;
+    char *userid;
+    struct buf value;
+};
+
+struct prefetch_rock {
+    annotate_db_t *d;
+    struct hash_table *table;
+    ptrarray_t eglobs;
+};
+
+static void prefetch_free_recs(void *data)
+{
+    ptrarray_t *recs = (ptrarray_t *) data;
+    int i;
+
+    for (i = 0; i < recs->count; i++) {
+        struct prefetch_rec *rec = ptrarray_nth(recs, i);
+        free(rec->entry);
+        free(rec->userid);
+        buf_free(&rec->value);
+        free(rec);
+    }
+    ptrarray_free(recs);
+}
+
+static void prefetch_free(annotate_state_t *state)
+{
+    if (!state->prefetch) return;
+
+    free_hash_table(state->prefetch, prefetch_free_recs);
+    free(state->prefetch);
+    state->prefetch = NULL;
+}
+
+static int prefetch_p(void *rock, const char *key, size_t keylen,
+                      const char *data __attribute__((unused)),
+                      size_t datalen __attribute__((unused)))
+{
+    struct prefetch_rock *prock = (struct prefetch_rock *) rock;
+    const char *mboxname, *entry, *userid;
+    unsigned int uid;
+    int i;
+
+    if (split_key(prock->d, key, keylen, &mboxname, &uid, &entry, &userid))
+        return 0;
+
+    if (!hash_lookup(mboxname, prock->table))
+        return 0;
+
+    for (i = 0; i < prock->eglobs.count; i++) {
+        if (GLOB_MATCH((struct glob *) ptrarray_nth(&prock->eglobs, i), entry))
+            return 1;
+    }
+
+    return 0;
+}
+
+static int prefetch_cb(void *rock, const char *key, size_t keylen,
+                       const char *data, size_t datalen)
+{
+    struct prefetch_rock *prock = (struct prefetch_rock *) rock;
+    const char *mboxname, *entry, *userid;
+    struct prefetch_rec *rec;
+    struct buf value = BUF_INITIALIZER;
+    unsigned int uid;
+    int r;
+
+    r = split_key(prock->d, key, keylen, &mboxname, &uid, &entry, &userid);
+    if (r) return r;
+
+    r = split_attribs(data, datalen, &value);
+    if (r) return r;
+
+    rec = xzmalloc(sizeof(struct prefetch_rec));
+    rec->entry = xstrdup(entry);
+    rec->userid = xstrdupnull(userid);
+    buf_copy(&rec->value, &value);
+    ptrarray_append(hash_lookup(mboxname, prock->table), rec);
+
+    buf_free(&value);
+
+    return 0;
+}
+
+/* The part of the mailboxes db keyspace shared by mboxname and its
+ * neighbours: the owner's INBOX for user mailboxes, else the top level
+ * shared folder */
+static char *prefetch_prefix(const char *mboxname)
+{
+    char *userid = mboxname_to_userid(mboxname);
+    char *prefix;
+
+    if (userid) {
+        prefix = mboxname_user_mbox(userid, NULL);
+        free(userid);
+    }
+    else {
+        const char *p = strchr(mboxname, '!');
+        p = strchr(p ? p + 1 : mboxname, '.');
+        prefix = p ? xstrndup(mboxname, p - mboxname) : xstrdup(mboxname);
+    }
+
+    return prefix;
+}
+
+/*
+ * Load the mailbox-scope database annotations matching any of the
+ * entries for all of the given mailboxes, so that a following
+ * annotate_state_fetch() for each of them does not have to search the
+ * database again.  The mailboxes are grouped by owner, and each group
+ * is read with a single ordered prefix scan.
+ */
+EXPORTED int annotate_state_prefetch(annotate_state_t *state,
+                                     const strarray_t *mboxnames,
+                                     const strarray_t *entries)
+{
+    struct prefetch_rock prock;
+    strarray_t prefixes = STRARRAY_INITIALIZER;
+    const char *last = NULL;
+    int i, r;
+
+    prefetch_free(state);
+
+    if (!mboxnames->count || !entries->count) return 0;
+
+    memset(&prock, 0, sizeof(prock));
+    r = _annotate_getdb(NULL, 0, 0, &prock.d);
+    if (r) {
+        if (r == CYRUSDB_NOTFOUND) r = 0;
+        return r;
+    }
+
+    state->prefetch = xzmalloc(sizeof(struct hash_table));
+    construct_hash_table(state->prefetch, mboxnames->count + 1, 0);
+    prock.table = state->prefetch;
+
+    for (i = 0; i < mboxnames->count; i++) {
+        const char *mboxname = strarray_nth(mboxnames, i);
+
+        if (hash_lookup(mboxname, state->prefetch)) continue;
+        hash_insert(mboxname, ptrarray_new(), state->prefetch);
+        strarray_appendm(&prefixes, prefetch_prefix(mboxname));
+    }
+
+    for (i = 0; i < entries->count; i++)
+        ptrarray_append(&prock.eglobs, glob_init(strarray_nth(entries, i), '/'));
+
+    /* a prefix scan also covers every longer prefix starting with it */
+    strarray_sort(&prefixes, cmpstringp_raw);
+    for (i = 0; !r && i < prefixes.count; i++) {
+        const char *prefix = strarray_nth(&prefixes, i);
+
+        if (last && !strncmp(prefix, last, strlen(last))) continue;
+        last = prefix;
+
+        r = cyrusdb_foreach(prock.d->db, prefix, strlen(prefix),
+                            &prefetch_p, &prefetch_cb, &prock, tid(prock.d));
+    }
+
+    for (i = 0; i < prock.eglobs.count; i++) {
+        struct glob *g = ptrarray_nth(&prock.eglobs, i);
+        glob_free(&g);
+    }
+    ptrarray_fini(&prock.eglobs);
+    strarray_fini(&prefixes);
+    annotate_putdb(&prock.d);
+
+    if (r) prefetch_free(state);
+
+    return r;
+}
+
+/* Like annotatemore_findall() for a mailbox loaded by
+ * annotate_state_prefetch() */
+static void prefetch_findall(const ptrarray_t *recs, const char *mboxname,
+                             const char *entry,
+                             annotatemore_find_proc_t proc, void *rock)
+{
+    struct glob *eglob = glob_init(entry, '/');
+    int i;
+
+    for (i = 0; i < recs->count; i++) {
+        struct prefetch_rec *rec = ptrarray_nth(recs, i);
+
+        if (!GLOB_MATCH(eglob, rec->entry)) continue;
+        if (proc(mboxname, 0, rec->entry, rec->userid, &rec->value, rock))
+            break;
+    }
+
+    glob_free(&eglob);
+}
+
 /***************************  Annotate State Management  ***************************/
 
 EXPORTED annotate_state_t *annotate_state_new(void)
@@ -1063,6 +1264,7 @@ static void annotate_state_free(annotate_state_t **statep)
 
     annotate_state_finish(state);
     annotate_state_unset_scope(state);
+    prefetch_free(state);
     free(state);
     *statep = NULL;
 }
@@ -1706,9 +1908,16 @@ static void annotation_get_fromdb(annotate_state_t *state,
                                   struct annotate_entry_list *entry)
 {
     const char *mboxname = (state->mailbox ? state->mailbox->name : "");
+    const ptrarray_t *recs = NULL;
     state->found = 0;
 
-    annotatemore_findall(mboxname, state->uid, entry->name, &rw_cb, state);
+    if (state->prefetch && !state->uid)
+        recs = hash_lookup(mboxname, state->prefetch);
+
+    if (recs)
+        prefetch_findall(recs, mboxname, entry->name, &rw_cb, state);
+    else
+        annotatemore_findall(mboxname, state->uid, entry->name, &rw_cb, state);
 
     if (state->found != state->attribs &&
         (!strchr(entry->name, '%') && !strchr(entry->name, '*'))) {
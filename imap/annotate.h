@@ -153,6 +153,11 @@ typedef void (*annotate_fetch_cb_t)(const char *mboxname, /* internal */
 int annotate_state_fetch(annotate_state_t *state,
                          const strarray_t *entries, const strarray_t *attribs,
                          annotate_fetch_cb_t callback, void *rock);
+/* load db annotations matching entries for many mailboxes at once,
+ * to be used by subsequent annotate_state_fetch() calls */
+int annotate_state_prefetch(annotate_state_t *state,
+                            const strarray_t *mboxnames,
+                            const strarray_t *entries);
 
 /* write a single annotation, avoiding all ACL checks and etc */
 int annotatemore_write(const char *mboxname, const char *entry,
@@ -54,6 +54,7 @@
 #endif
 #include <signal.h>
 #include <fcntl.h>
+#include <sys/select.h>
 
 #include "global.h"
 #include "xmalloc.h"
@@ -97,6 +98,8 @@ int main(int argc, char **argv)
     char *alt_config = NULL;
     time_t runattime = 0;
     int upgrade = 0;
+    int sock, interval;
+    time_t reconcile = 0;
 
     if ((geteuid()) == 0 && (become_cyrus(/*is_master*/0) != 0)) {
         fatal("must run as the Cyrus user", EC_USAGE);
@@ -166,23 +169,45 @@ int main(int argc, char **argv)
     }
     /* child */
 
+    /* if we can't listen for changes, fall back to polling */
+    sock = caldav_alarm_schedule_listen();
+
+    interval = config_getint(IMAPOPT_CALALARMD_RECONCILE_INTERVAL);
+    if (interval < 10) interval = 10;
+    if (sock < 0) interval = 10;
+
     for (;;) {
-        struct timeval start, end;
-        double totaltime;
-        int tosleep;
+        struct timeval timeout;
+        fd_set rset;
+        time_t now, next;
 
         signals_poll();
 
-        gettimeofday(&start, 0);
-        caldav_alarm_process(0);
-        gettimeofday(&end, 0);
+        now = time(NULL);
+        if (now >= reconcile) {
+            /* full rescan, in case we missed a notification */
+            reconcile = now + interval;
+            caldav_alarm_schedule_load(reconcile);
+        }
 
-        signals_poll();
+        next = caldav_alarm_schedule_next();
+        if (next && next <= now) {
+            caldav_alarm_process(0);
+            continue;
+        }
+
+        /* sleep until the next alarm, the next rescan or a notification */
+        if (!next || next > reconcile) next = reconcile;
+        timeout.tv_sec = next - now;
+        timeout.tv_usec = 0;
 
-        totaltime = timesub(&start, &end);
-        tosleep = 10 - (int) (totaltime + 0.5); /* round to nearest int */
-        if (tosleep > 0)
-            sleep(tosleep);
+        FD_ZERO(&rset);
+        if (sock >= 0) FD_SET(sock, &rset);
+
+        if (signals_select(sock + 1, &rset, NULL, NULL, &timeout) > 0 &&
+            FD_ISSET(sock, &rset)) {
+            caldav_alarm_schedule_receive();
+        }
     }
 
     /* NOTREACHED */
@@ -43,11 +43,17 @@
 
 #include <config.h>
 
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <syslog.h>
 #include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #include <libical/ical.h>
 
+#include "assert.h"
 #include "caldav_alarm.h"
 #include "cyrusdb.h"
 #include "exitcodes.h"
@@ -59,6 +65,7 @@
 #include "mboxname.h"
 #include "util.h"
 #include "xstrlcat.h"
+#include "xstrlcpy.h"
 #include "xmalloc.h"
 
 /* generated headers are not necessarily in current directory */
@@ -405,6 +412,186 @@ static int process_alarm_cb(icalcomponent *comp, icaltimetype start,
     return 1; /* keep going */
 }
 
+/*
+ * In-memory schedule of upcoming check times, used by calalarmd to
+ * sleep exactly until the next alarm is due.  It is a binary min-heap
+ * of times only: the events table remains the authority on what needs
+ * processing, so a stale entry (a deleted or rescheduled alarm) just
+ * causes one cheap empty scan.
+ */
+static struct {
+    time_t *heap;
+    size_t count;
+    size_t alloc;
+} schedule;
+
+/* socket calalarmd receives new check times on, or -1 */
+static int schedule_sock = -1;
+
+static void schedule_push(time_t when)
+{
+    size_t i, parent;
+
+    if (schedule.count == schedule.alloc) {
+        schedule.alloc = schedule.alloc ? schedule.alloc * 2 : 64;
+        schedule.heap = xrealloc(schedule.heap,
+                                 schedule.alloc * sizeof(time_t));
+    }
+
+    for (i = schedule.count++; i; i = parent) {
+        parent = (i - 1) / 2;
+        if (schedule.heap[parent] <= when) break;
+        schedule.heap[i] = schedule.heap[parent];
+    }
+    schedule.heap[i] = when;
+}
+
+static void schedule_pop(void)
+{
+    size_t i, child;
+    time_t last;
+
+    if (!schedule.count) return;
+
+    last = schedule.heap[--schedule.count];
+    for (i = 0; (child = 2 * i + 1) < schedule.count; i = child) {
+        if (child + 1 < schedule.count &&
+            schedule.heap[child + 1] < schedule.heap[child])
+            child++;
+        if (last <= schedule.heap[child]) break;
+        schedule.heap[i] = schedule.heap[child];
+    }
+    schedule.heap[i] = last;
+}
+
+static void schedule_address(struct sockaddr_un *sun_data)
+{
+    memset(sun_data, 0, sizeof(struct sockaddr_un));
+    sun_data->sun_family = AF_UNIX;
+    strlcpy(sun_data->sun_path, config_getstring(IMAPOPT_CALALARMD_SOCKET),
+            sizeof(sun_data->sun_path));
+}
+
+/* tell calalarmd about a new check time.  Best effort: if calalarmd
+ * isn't running or the message is dropped, the periodic rescan will
+ * pick the alarm up */
+static void schedule_notify(time_t nextcheck)
+{
+    static int notify_sock = -1;
+    struct sockaddr_un sun_data;
+    char msg[32];
+    int flags = 0;
+
+    /* we are calalarmd */
+    if (schedule_sock >= 0) {
+        schedule_push(nextcheck);
+        return;
+    }
+
+    if (notify_sock < 0) {
+        notify_sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+        if (notify_sock < 0) return;
+    }
+
+#ifdef MSG_DONTWAIT
+    flags |= MSG_DONTWAIT;
+#endif
+
+    schedule_address(&sun_data);
+    snprintf(msg, sizeof(msg), "%ld", (long) nextcheck);
+    sendto(notify_sock, msg, strlen(msg), flags,
+           (struct sockaddr *) &sun_data, sizeof(sun_data));
+}
+
+#define CMD_SELECT_SCHEDULE                      \
+    "SELECT DISTINCT nextcheck FROM events"      \
+    " WHERE nextcheck < :horizon"                \
+    ";"
+
+static int schedule_read_cb(sqlite3_stmt *stmt,
+                            void *rock __attribute__((unused)))
+{
+    schedule_push(sqlite3_column_int(stmt, 0));
+    return 0;
+}
+
+/* start listening for check time notifications.
+ * Returns the socket to wait on, or -1 on error */
+EXPORTED int caldav_alarm_schedule_listen(void)
+{
+    struct sockaddr_un sun_data;
+    int s;
+
+    assert(schedule_sock == -1);
+
+    schedule_address(&sun_data);
+
+    if ((s = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1) {
+        syslog(LOG_ERR, "calalarmd: socket: %m");
+        return -1;
+    }
+
+    unlink(sun_data.sun_path);
+    if (bind(s, (struct sockaddr *) &sun_data, sizeof(sun_data)) == -1) {
+        syslog(LOG_ERR, "calalarmd: bind %s: %m", sun_data.sun_path);
+        close(s);
+        return -1;
+    }
+
+    schedule_sock = s;
+    return s;
+}
+
+/* rebuild the schedule from the database, keeping only check times
+ * before horizon.  Later ones will be seen by the next reload */
+EXPORTED int caldav_alarm_schedule_load(time_t horizon)
+{
+    struct sqldb_bindval bval[] = {
+        { ":horizon",   SQLITE_INTEGER, { .i = horizon  } },
+        { NULL,         SQLITE_NULL,    { .s = NULL     } }
+    };
+
+    sqldb_t *alarmdb = caldav_alarm_open();
+    if (!alarmdb)
+        return HTTP_SERVER_ERROR;
+
+    schedule.count = 0;
+    int rc = sqldb_exec(alarmdb, CMD_SELECT_SCHEDULE, bval,
+                        &schedule_read_cb, NULL);
+
+    caldav_alarm_close(alarmdb);
+
+    return rc;
+}
+
+/* read any pending check time notifications into the schedule */
+EXPORTED void caldav_alarm_schedule_receive(void)
+{
+    char msg[32];
+    ssize_t n;
+
+    if (schedule_sock < 0) return;
+
+    while ((n = recv(schedule_sock, msg, sizeof(msg) - 1, MSG_DONTWAIT)) > 0) {
+        char *end;
+        long when;
+
+        msg[n] = '\0';
+        when = strtol(msg, &end, 10);
+        if (*end || when <= 0) {
+            syslog(LOG_ERR, "calalarmd: invalid notification received");
+            continue;
+        }
+        schedule_push(when);
+    }
+}
+
+/* the earliest scheduled check time, or 0 if nothing is scheduled */
+EXPORTED time_t caldav_alarm_schedule_next(void)
+{
+    return schedule.count ? schedule.heap[0] : 0;
+}
+
 #define CMD_REPLACE                              \
     "REPLACE INTO events"                        \
     " ( mboxname, imap_uid, nextcheck )"         \
@@ -438,7 +625,10 @@ static int update_alarmdb(const char *mboxname, uint32_t imap_uid, time_t nextch
 
     caldav_alarm_close(alarmdb);
 
-    if (rc == SQLITE_OK) return 0;
+    if (rc == SQLITE_OK) {
+        if (nextcheck) schedule_notify(nextcheck);
+        return 0;
+    }
 
     /* failed? */
     return -1;
@@ -729,8 +919,9 @@ EXPORTED int caldav_alarm_process(time_t runtime)
     syslog(LOG_DEBUG, "processing alarms");
 
     if (!runtime) {
-        /* check 10s into the future - we run every 10, so that guarantees we will
-         * deliver on or before the target time */
+        /* check 10s into the future - this batches alarms that fall close
+         * together, and guarantees delivery on or before the target time
+         * even when calalarmd is only polling */
         runtime = time(NULL) + 10;
     }
 
@@ -751,6 +942,11 @@ EXPORTED int caldav_alarm_process(time_t runtime)
 
     process_records(&list, runtime);
 
+    /* everything scheduled before runtime has now been looked at;
+     * rescheduled alarms come back in via schedule_notify() */
+    while (schedule.count && schedule.heap[0] < runtime)
+        schedule_pop();
+
     int i;
     for (i = 0; i < list.count; i++) {
         struct caldav_alarm_data *data = ptrarray_nth(&list, i);
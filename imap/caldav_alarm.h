@@ -75,6 +75,18 @@ int caldav_alarm_delete_user(const char *userid);
 /* distribute alarms with triggers in the next minute */
 int caldav_alarm_process(time_t runtime);
 
+/* calalarmd: listen for new alarm check times, returns the socket */
+int caldav_alarm_schedule_listen(void);
+
+/* calalarmd: reload all check times before horizon from the database */
+int caldav_alarm_schedule_load(time_t horizon);
+
+/* calalarmd: read pending check time notifications from the socket */
+void caldav_alarm_schedule_receive(void);
+
+/* calalarmd: earliest scheduled check time, or 0 if none */
+time_t caldav_alarm_schedule_next(void);
+
 /* upgrade old databases */
 int caldav_alarm_upgrade();
 
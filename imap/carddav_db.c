@@ -515,6 +515,121 @@ EXPORTED strarray_t *carddav_getgroup(struct carddav_db *carddavdb, const char *
 }
 
 
+/* vCard properties whose values are kept in vcard_props for searching */
+static const char *indexed_props[] = { "EMAIL", "TEL", "ORG", "TITLE", NULL };
+
+static const char *indexed_propname(const char *name)
+{
+    const char **p;
+
+    for (p = indexed_props; *p; p++) {
+        if (!strcasecmp(name, *p)) return *p;
+    }
+
+    return NULL;
+}
+
+#define CMD_GETPROPS                                                    \
+    "SELECT P.propvalue FROM vcard_objs CO"                             \
+    " LEFT JOIN vcard_props P"                                          \
+    " ON P.objid = CO.rowid AND P.propname = :propname"                 \
+    " WHERE CO.rowid = :rowid AND CO.propsindexed = 1;"
+
+static int getprops_cb(sqlite3_stmt *stmt, void *rock)
+{
+    strarray_t **values = (strarray_t **) rock;
+    const char *value = (const char *) sqlite3_column_text(stmt, 0);
+
+    /* a row (even with a NULL value) means the card is indexed */
+    if (!*values) *values = strarray_new();
+    if (value) strarray_append(*values, value);
+    return 0;
+}
+
+EXPORTED strarray_t *carddav_getprops(struct carddav_db *carddavdb,
+                                      unsigned rowid, const char *propname)
+{
+    struct sqldb_bindval bval[] = {
+        { ":rowid",    SQLITE_INTEGER, { .i = rowid    } },
+        { ":propname", SQLITE_TEXT,    { .s = propname } },
+        { NULL,        SQLITE_NULL,    { .s = NULL     } }
+    };
+    strarray_t *values = NULL;
+    int r;
+
+    /* stored under the canonical (upper case) name */
+    bval[1].val.s = propname = indexed_propname(propname);
+    if (!propname) return NULL;
+
+    r = sqldb_exec(carddavdb->db, CMD_GETPROPS, bval, &getprops_cb, &values);
+    if (r) {
+        syslog(LOG_ERR, "carddav error %s", error_message(r));
+        strarray_free(values);
+        return NULL;
+    }
+
+    return values;
+}
+
+#define CMD_SEARCHPROPS                                                 \
+    "SELECT P.objid FROM vcard_props P JOIN vcard_objs CO"              \
+    " WHERE P.objid = CO.rowid AND P.propname = :propname"              \
+    " AND P.propvalue LIKE :pattern ESCAPE '\\'"
+
+#define CMD_SEARCHPROPS_UNINDEXED                                       \
+    " UNION SELECT rowid FROM vcard_objs CO WHERE propsindexed = 0"
+
+static int searchprops_cb(sqlite3_stmt *stmt, void *rock)
+{
+    bitvector_t *rowids = (bitvector_t *) rock;
+
+    bv_set(rowids, sqlite3_column_int(stmt, 0));
+    return 0;
+}
+
+EXPORTED int carddav_search_props(struct carddav_db *carddavdb,
+                                  const char *mailbox, const char *propname,
+                                  const char *text, int prefix,
+                                  bitvector_t *rowids)
+{
+    struct sqldb_bindval bval[] = {
+        { ":mailbox",  SQLITE_TEXT, { .s = mailbox  } },
+        { ":propname", SQLITE_TEXT, { .s = propname } },
+        { ":pattern",  SQLITE_TEXT, { .s = NULL     } },
+        { NULL,        SQLITE_NULL, { .s = NULL     } }
+    };
+    struct buf sqlbuf = BUF_INITIALIZER;
+    struct buf pattern = BUF_INITIALIZER;
+    const char *p;
+    int r;
+
+    /* LIKE is ASCII case-insensitive, just like the text matches it replaces.
+       Leading '%' is omitted for prefix searches, so the index can be used */
+    if (!prefix) buf_putc(&pattern, '%');
+    for (p = text; *p; p++) {
+        if (*p == '%' || *p == '_' || *p == '\\') buf_putc(&pattern, '\\');
+        buf_putc(&pattern, *p);
+    }
+    buf_putc(&pattern, '%');
+    bval[2].val.s = buf_cstring(&pattern);
+
+    buf_setcstr(&sqlbuf, CMD_SEARCHPROPS);
+    if (mailbox) buf_appendcstr(&sqlbuf, " AND CO.mailbox = :mailbox");
+    buf_appendcstr(&sqlbuf, CMD_SEARCHPROPS_UNINDEXED);
+    if (mailbox) buf_appendcstr(&sqlbuf, " AND mailbox = :mailbox");
+    buf_appendcstr(&sqlbuf, ";");
+
+    r = sqldb_exec(carddavdb->db, buf_cstring(&sqlbuf), bval,
+                   &searchprops_cb, rowids);
+    if (r) syslog(LOG_ERR, "carddav error %s", error_message(r));
+
+    buf_free(&sqlbuf);
+    buf_free(&pattern);
+
+    return r;
+}
+
+
 #define CMD_DELETE_EMAIL "DELETE FROM vcard_emails WHERE objid = :objid"
 #define CMD_INSERT_EMAIL                                                \
     "INSERT INTO vcard_emails ( objid, pos, email, ispref )"            \
@@ -576,6 +691,59 @@ static int carddav_write_groups(struct carddav_db *carddavdb, int rowid, const s
     return 0;
 }
 
+#define CMD_DELETE_PROPS "DELETE FROM vcard_props WHERE objid = :objid"
+#define CMD_INSERT_PROP                                                 \
+    "INSERT INTO vcard_props ( objid, propname, propvalue )"            \
+    " VALUES ( :objid, :propname, :propvalue );"
+#define CMD_SET_PROPSINDEXED                                            \
+    "UPDATE vcard_objs SET propsindexed = 1 WHERE rowid = :objid;"
+
+static int carddav_write_props(struct carddav_db *carddavdb, int rowid, const strarray_t *props)
+{
+    struct sqldb_bindval bval[] = {
+        { ":objid",        SQLITE_INTEGER, { .i = rowid  } },
+        { ":propname",     SQLITE_TEXT,    { .s = NULL   } },
+        { ":propvalue",    SQLITE_TEXT,    { .s = NULL   } },
+        { NULL,            SQLITE_NULL,    { .s = NULL   } } };
+    int r;
+    int i;
+
+    /* clean up existing records if any */
+    r = sqldb_exec(carddavdb->db, CMD_DELETE_PROPS, bval, NULL, NULL);
+    if (r) return r;
+    for (i = 0; i < strarray_size(props)/2; i++) {
+        bval[1].val.s = strarray_nth(props, i*2);
+        bval[2].val.s = strarray_nth(props, i*2+1);
+        r = sqldb_exec(carddavdb->db, CMD_INSERT_PROP, bval, NULL, NULL);
+        if (r) return r;
+    }
+
+    return sqldb_exec(carddavdb->db, CMD_SET_PROPSINDEXED, bval, NULL, NULL);
+}
+
+static void carddav_index_prop(strarray_t *props, struct vparse_entry *ventry)
+{
+    const char *name = indexed_propname(ventry->name);
+    struct vparse_param *param;
+
+    if (!name) return;
+
+    strarray_append(props, name);
+    if (ventry->multivaluesep) {
+        char sep[2] = { CARDDAV_PROPS_VALUESEP, '\0' };
+        strarray_appendm(props, strarray_join(ventry->v.values, sep));
+    }
+    else strarray_append(props, ventry->v.value);
+
+    /* JMAP exposes the LABEL parameter alongside the value */
+    param = vparse_get_param(ventry, "label");
+    if (param && param->value) {
+        strarray_appendm(props, strconcat(name, ";LABEL", (char *)NULL));
+        strarray_append(props, param->value);
+    }
+}
+
+
 #define CMD_INSERT                                                      \
     "INSERT INTO vcard_objs ("                                          \
     "  alive, creationdate, mailbox, resource, imap_uid, modseq,"       \
@@ -748,6 +916,7 @@ EXPORTED int carddav_writecard(struct carddav_db *carddavdb, struct carddav_data
 
     strarray_t emails = STRARRAY_INITIALIZER;
     strarray_t member_uids = STRARRAY_INITIALIZER;
+    strarray_t props = STRARRAY_INITIALIZER;
 
     for (ventry = vcard->properties; ventry; ventry = ventry->next) {
         const char *name = ventry->name;
@@ -756,6 +925,8 @@ EXPORTED int carddav_writecard(struct carddav_db *carddavdb, struct carddav_data
         if (!name) continue;
         if (!propval) continue;
 
+        carddav_index_prop(&props, ventry);
+
         if (!strcasecmp(name, "uid")) {
             cdata->vcard_uid = propval;
         }
@@ -804,9 +975,11 @@ EXPORTED int carddav_writecard(struct carddav_db *carddavdb, struct carddav_data
     int r = carddav_write(carddavdb, cdata);
     if (!r) r = carddav_write_emails(carddavdb, cdata->dav.rowid, &emails);
     if (!r) r = carddav_write_groups(carddavdb, cdata->dav.rowid, &member_uids);
+    if (!r) r = carddav_write_props(carddavdb, cdata->dav.rowid, &props);
 
     strarray_fini(&emails);
     strarray_fini(&member_uids);
+    strarray_fini(&props);
 
     return r;
 }
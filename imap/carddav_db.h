@@ -47,6 +47,7 @@
 #include <config.h>
 
 #include "auth.h"
+#include "bitvector.h"
 #include "dav_db.h"
 #include "strarray.h"
 #include "util.h"
@@ -111,6 +112,23 @@ strarray_t *carddav_getgroup(struct carddav_db *carddavdb, const char *mailbox,
 /* get a list of groups the given uid is a member of */
 strarray_t *carddav_getuid_groups(struct carddav_db *carddavdb, const char *uid);
 
+/* the components of a multi-valued property (ORG) are indexed as one
+   value, separated by this character, which doesn't occur in vCard text */
+#define CARDDAV_PROPS_VALUESEP '\x1f'
+
+/* get the indexed values of vCard property 'propname' on card 'rowid'.
+   returns NULL if the property isn't indexed or the card hasn't been yet */
+strarray_t *carddav_getprops(struct carddav_db *carddavdb,
+                             unsigned rowid, const char *propname);
+
+/* set the rowid of each card (in 'mailbox', if given) having an indexed
+   value of 'propname' (e.g. "EMAIL" or "EMAIL;LABEL") that contains (or, if 'prefix' is set,
+   starts with) 'text', ignoring ASCII case.  Cards that have not been
+   indexed yet are always included */
+int carddav_search_props(struct carddav_db *carddavdb,
+                         const char *mailbox, const char *propname,
+                         const char *text, int prefix, bitvector_t *rowids);
+
 /* process each entry of type 'kind' for 'mailbox' in 'carddavdb' with cb() */
 int carddav_get_cards(struct carddav_db *carddavdb,
                       const char *mailbox, const char *vcard_uid, int kind,
@@ -48,14 +48,18 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <syslog.h>
 #include <signal.h>
 
 #include <sasl/sasl.h>
 
 #include "annotate.h"
+#include "bsearch.h"
 #include "duplicate.h"
 #include "exitcodes.h"
 #include "global.h"
@@ -64,6 +68,8 @@
 #include "mboxevent.h"
 #include "mboxlist.h"
 #include "conversations.h"
+#include "retry.h"
+#include "strhash.h"
 #include "util.h"
 #include "xmalloc.h"
 #include "strarray.h"
@@ -76,16 +82,47 @@ static volatile sig_atomic_t sigquit = 0;
 static int verbose = 0;
 static int keep_flagged = 1;
 
+/* parallel mode: number of worker processes, 0 to run inline */
+static int jobs = 0;
+static int worker = 0;
+static int shard_by_partition = 0;
+static pid_t *worker_pids = NULL;
+
+/* the options a checkpoint is only good for */
+static struct buf checkpoint_params = BUF_INITIALIZER;
+
+/* how long a checkpoint is good for: about one run interval */
+static int checkpoint_seconds = 86400;
+
+/* I/O budget, in index records per second per process (0 = unlimited) */
+static struct {
+    double rate;
+    double tokens;
+    struct timeval last;
+} budget;
+
+/* index records touched by the current mailbox callback */
+static unsigned long io_cost = 0;
+
+#define FNAME_CHECKPOINT "/expire/checkpoint."
+#define CHECKPOINT_INTERVAL 100
+
 /* current namespace */
 static struct namespace expire_namespace;
 
 static void usage(void)
 {
     fprintf(stderr,
-            "cyr_expire [-C <altconfig>] [-E <expire-duration>] [-D <delete-duration] [-X <expunge-duration>] [-p prefix] [-a] [-v] [-x]\n");
+            "cyr_expire [-C <altconfig>] [-E <expire-duration>] [-D <delete-duration] [-X <expunge-duration>] [-p prefix] [-a] [-v] [-x]\n"
+            "           [-j <jobs> [-P]] [-B <records-per-second>] [-R <resume-duration>]\n");
     exit(-1);
 }
 
+struct archive_rock {
+    time_t archive_mark;
+    unsigned long mailboxes_seen;
+};
+
 struct expire_rock {
     struct hash_table table;
     time_t expire_mark;
@@ -111,6 +148,42 @@ struct conversations_rock {
 struct delete_rock {
     time_t delete_mark;
     strarray_t to_delete;
+    unsigned long mailboxes_removed;
+};
+
+#define EXPIRE_NCOUNTERS 5
+
+/*
+ * One pass over the mailbox list.  In parallel mode each worker runs
+ * the pass over its own shard of mailboxes and hands the counters (and
+ * the expire table, if any) back to the parent over a pipe.
+ */
+struct expire_phase {
+    const char *name;
+    mboxlist_cb *proc;
+    mboxlist_cb *resumed;       /* called instead of proc for mailboxes
+                                   finished by an interrupted run */
+    void (*finish)(void *rock); /* called once all mailboxes are seen */
+    void *rock;
+    int resumable;              /* safe to restart part way through */
+    struct hash_table *table;
+    unsigned long *counters[EXPIRE_NCOUNTERS];
+};
+
+enum {
+    PHASE_ARCHIVE = 1,
+    PHASE_EXPIRE,
+    PHASE_CONVERSATIONS,
+    PHASE_DELETE
+};
+
+struct shard_rock {
+    struct expire_phase *phase;
+    int id;
+    int skip_all;               /* whole phase done by an earlier run */
+    const char *resume_after;
+    unsigned long count;
+    struct buf last;
 };
 
 /*
@@ -223,6 +296,7 @@ static unsigned userflag_cb(struct mailbox *mailbox __attribute__((unused)),
 
 static int archive(const mbentry_t *mbentry, void *rock)
 {
+    struct archive_rock *arock = (struct archive_rock *) rock;
     struct mailbox *mailbox = NULL;
 
     if (sigquit)
@@ -240,7 +314,10 @@ static int archive(const mbentry_t *mbentry, void *rock)
     if (verbose)
         fprintf(stderr, "archiving mailbox %s\n", mbentry->name);
 
-    mailbox_archive(mailbox, NULL, rock, ITER_SKIP_EXPUNGED);
+    mailbox_archive(mailbox, NULL, &arock->archive_mark, ITER_SKIP_EXPUNGED);
+
+    arock->mailboxes_seen++;
+    io_cost += mailbox->i.num_records;
 
 done:
     mailbox_close(&mailbox);
@@ -249,6 +326,56 @@ done:
     return 0;
 }
 
+/*
+ * Find the expire annotation that applies to mboxname.
+ * Returns 1 and fills in *secondsp if there is one.
+ */
+static int expire_lookup(const char *mboxname, struct expire_rock *erock,
+                         int *secondsp)
+{
+    struct buf attrib = BUF_INITIALIZER;
+    char *buf;
+    int found = 0;
+    int r;
+
+    if (erock->skip_annotate)
+        return 0;
+
+    buf = xstrdup(mboxname);
+
+    /* since mailboxes inherit /vendor/cmu/cyrus-imapd/expire,
+     * we need to iterate all the way up to "" (server entry)
+     */
+    do {
+        buf_free(&attrib);
+        r = annotatemore_lookup(buf, IMAP_ANNOT_NS "expire", "",
+                                &attrib);
+
+        if (r ||                            /* error */
+            attrib.s)                       /* found an entry */
+            break;
+
+    } while (mboxname_make_parent(buf));
+    free(buf);
+
+    if (attrib.s && parse_duration(attrib.s, secondsp))
+        found = 1;
+    buf_free(&attrib);
+
+    return found;
+}
+
+/* add mailbox to table */
+static void expire_remember(const char *mboxname, struct expire_rock *erock,
+                            int expire_seconds)
+{
+    erock->expire_mark = expire_seconds ?
+                         time(0) - expire_seconds : 0 /* never */ ;
+    hash_insert(mboxname,
+                xmemdup(&erock->expire_mark, sizeof(erock->expire_mark)),
+                &erock->table);
+}
+
 /*
  * callback function to:
  * - expire messages from mailboxes,
@@ -258,12 +385,11 @@ done:
 static int expire(const mbentry_t *mbentry, void *rock)
 {
     struct expire_rock *erock = (struct expire_rock *) rock;
-    char *buf;
-    struct buf attrib = BUF_INITIALIZER;
     int r;
     struct mailbox *mailbox = NULL;
     unsigned numexpunged = 0;
     int expire_seconds = 0;
+    int has_expire;
     int did_expunge = 0;
 
     if (sigquit) {
@@ -286,25 +412,8 @@ static int expire(const mbentry_t *mbentry, void *rock)
         goto done;
     }
 
-    buf = xstrdup(mbentry->name);
-
-    /* see if we need to expire messages.
-     * since mailboxes inherit /vendor/cmu/cyrus-imapd/expire,
-     * we need to iterate all the way up to "" (server entry)
-     */
-    if (!erock->skip_annotate) {
-        do {
-            buf_free(&attrib);
-            r = annotatemore_lookup(buf, IMAP_ANNOT_NS "expire", "",
-                                    &attrib);
-
-            if (r ||                            /* error */
-                attrib.s)                       /* found an entry */
-                break;
-
-        } while (mboxname_make_parent(buf));
-    }
-    free(buf);
+    /* see if we need to expire messages */
+    has_expire = expire_lookup(mbentry->name, erock, &expire_seconds);
 
     memset(erock->userflags, 0, sizeof(erock->userflags));
 
@@ -316,13 +425,8 @@ static int expire(const mbentry_t *mbentry, void *rock)
         goto done;
     }
 
-    if (attrib.s && parse_duration(attrib.s, &expire_seconds)) {
-        /* add mailbox to table */
-        erock->expire_mark = expire_seconds ?
-                             time(0) - expire_seconds : 0 /* never */ ;
-        hash_insert(mbentry->name,
-                    xmemdup(&erock->expire_mark, sizeof(erock->expire_mark)),
-                    &erock->table);
+    if (has_expire) {
+        expire_remember(mbentry->name, erock, expire_seconds);
 
         if (expire_seconds) {
             if (verbose) {
@@ -338,7 +442,6 @@ static int expire(const mbentry_t *mbentry, void *rock)
             did_expunge = 1;
         }
     }
-    buf_free(&attrib);
 
     if (!did_expunge && erock->do_userflags) {
         r = mailbox_expunge(mailbox, userflag_cb, erock, NULL,
@@ -349,6 +452,7 @@ static int expire(const mbentry_t *mbentry, void *rock)
     }
 
     erock->messages_seen += mailbox->i.num_records;
+    io_cost += mailbox->i.num_records;
 
     if (erock->do_userflags)
         expunge_userflags(mailbox, erock);
@@ -372,6 +476,27 @@ done:
     return 0;
 }
 
+/*
+ * callback function for mailboxes already expired by an interrupted
+ * run: only rebuild their duplicate database expire time
+ */
+static int expire_resumed(const mbentry_t *mbentry, void *rock)
+{
+    struct expire_rock *erock = (struct expire_rock *) rock;
+    int expire_seconds = 0;
+
+    if (sigquit)
+        return 1;
+
+    if (mbentry->mbtype & (MBTYPE_REMOTE | MBTYPE_DELETED))
+        return 0;
+
+    if (expire_lookup(mbentry->name, erock, &expire_seconds))
+        expire_remember(mbentry->name, erock, expire_seconds);
+
+    return 0;
+}
+
 static int delete(const mbentry_t *mbentry, void *rock)
 {
     struct delete_rock *drock = (struct delete_rock *) rock;
@@ -404,6 +529,24 @@ done:
     return 0;
 }
 
+static void delete_mailboxes(void *rock)
+{
+    struct delete_rock *drock = (struct delete_rock *) rock;
+    int i;
+
+    for (i = 0 ; i < drock->to_delete.count ; i++) {
+        char *name = drock->to_delete.data[i];
+
+        if (sigquit)
+            return;
+        if (verbose) {
+            fprintf(stderr, "Removing: %s\n", name);
+        }
+        mboxlist_deletemailbox(name, 1, NULL, NULL, NULL, 0, 0, 0);
+        drock->mailboxes_removed++;
+    }
+}
+
 static int expire_conversations(const mbentry_t *mbentry, void *rock)
 {
     struct conversations_rock *crock = (struct conversations_rock *)rock;
@@ -439,6 +582,7 @@ static int expire_conversations(const mbentry_t *mbentry, void *rock)
 
     crock->databases_seen++;
     crock->msgids_seen += nseen;
+    io_cost += nseen;
     crock->msgids_expired += ndeleted;
 
 done:
@@ -446,9 +590,423 @@ done:
     return 0;
 }
 
-static void sighandler (int sig __attribute((unused)))
+/*
+ * Charge cost against the I/O budget, sleeping until the bucket
+ * refills if we have overspent.
+ */
+static void budget_spend(unsigned long cost)
+{
+    struct timeval now;
+    double wait;
+
+    if (!budget.rate)
+        return;
+
+    gettimeofday(&now, NULL);
+    if (budget.last.tv_sec)
+        budget.tokens += timesub(&budget.last, &now) * budget.rate;
+    else
+        budget.tokens = budget.rate;
+    budget.last = now;
+
+    /* allow at most one second's worth of burst */
+    if (budget.tokens > budget.rate)
+        budget.tokens = budget.rate;
+
+    budget.tokens -= cost;
+    if (budget.tokens >= 0)
+        return;
+
+    for (wait = -budget.tokens / budget.rate; wait > 0 && !sigquit; wait -= 0.5)
+        usleep((wait < 0.5 ? wait : 0.5) * 1000000);
+}
+
+/* which worker owns this mailbox in phase 'id' */
+static int shard_of(const mbentry_t *mbentry, int id)
+{
+    mbname_t *mbname;
+    const char *key;
+    unsigned hash;
+
+    /* a conversations db is per user, whatever partitions it spans */
+    if (shard_by_partition && id != PHASE_CONVERSATIONS)
+        return strhash(mbentry->partition ? mbentry->partition : "") % jobs;
+
+    /* keep all of a user's mailboxes (and conversations db) together */
+    mbname = mbname_from_intname(mbentry->name);
+    key = mbname_userid(mbname);
+    if (!key) key = strarray_nth(mbname_boxes(mbname), 0);
+    hash = strhash(key ? key : "");
+    mbname_free(&mbname);
+
+    return hash % jobs;
+}
+
+static char *checkpoint_fname(int w)
+{
+    struct buf buf = BUF_INITIALIZER;
+
+    buf_printf(&buf, "%s%s%d", config_dir, FNAME_CHECKPOINT, w);
+
+    return buf_release(&buf);
+}
+
+/*
+ * Checkpoint files record, per worker, the options of the run on the
+ * first line (see checkpoint_params) and when they were written and the
+ * last phase and mailbox completed as "<time> <phase> <D|P> <mailbox>"
+ * on the second.  A checkpoint written by a run with different options,
+ * or longer ago than checkpoint_seconds, is ignored: by then a later
+ * run has been due, which would have to start from the beginning.
+ */
+static void checkpoint_read(int *phasep, int *donep, struct buf *mboxname)
+{
+    char *fname = checkpoint_fname(worker);
+    struct buf line = BUF_INITIALIZER;
+    int phase, n = 0;
+    long written;
+    char state;
+    FILE *f;
+
+    *phasep = *donep = 0;
+    buf_reset(mboxname);
+
+    f = fopen(fname, "r");
+    if (!f) goto done;
+
+    if (buf_getline(&line, f) &&
+        !strcmp(buf_cstring(&line), buf_cstring(&checkpoint_params)) &&
+        buf_getline(&line, f) &&
+        sscanf(buf_cstring(&line), "%ld %d %c%n",
+               &written, &phase, &state, &n) == 3 &&
+        time(NULL) - written <= checkpoint_seconds) {
+        *phasep = phase;
+        *donep = (state == 'D');
+        if (line.s[n] == ' ') n++;
+        buf_setcstr(mboxname, line.s + n);
+    }
+    fclose(f);
+
+done:
+    buf_free(&line);
+    free(fname);
+}
+
+static void checkpoint_write(int phase, int done, const char *mboxname)
+{
+    char *fname = checkpoint_fname(worker);
+    char *newfname = strconcat(fname, ".NEW", (char *)NULL);
+    FILE *f;
+
+    cyrus_mkdir(fname, 0755);
+
+    f = fopen(newfname, "w");
+    if (!f) {
+        syslog(LOG_ERR, "IOERROR: creating %s: %m", newfname);
+        goto done;
+    }
+
+    fprintf(f, "%s\n%ld %d %c %s\n", buf_cstring(&checkpoint_params),
+            (long) time(NULL), phase, done ? 'D' : 'P', mboxname);
+
+    if (fclose(f) == EOF || rename(newfname, fname) < 0)
+        syslog(LOG_ERR, "IOERROR: writing %s: %m", fname);
+
+done:
+    free(newfname);
+    free(fname);
+}
+
+static void checkpoint_remove(void)
+{
+    int w;
+
+    for (w = 0; w < jobs; w++) {
+        char *fname = checkpoint_fname(w);
+        unlink(fname);
+        free(fname);
+    }
+}
+
+static int shard_cb(const mbentry_t *mbentry, void *rock)
+{
+    struct shard_rock *srock = (struct shard_rock *) rock;
+    struct expire_phase *phase = srock->phase;
+    int r;
+
+    if (sigquit)
+        return 1;
+
+    if (jobs && shard_of(mbentry, srock->id) != worker)
+        return 0;
+
+    if (srock->skip_all ||
+        (srock->resume_after &&
+         bsearch_compare_mbox(mbentry->name, srock->resume_after) <= 0)) {
+        /* already done by the interrupted run */
+        return phase->resumed ? phase->resumed(mbentry, phase->rock) : 0;
+    }
+
+    io_cost = 0;
+    r = phase->proc(mbentry, phase->rock);
+    if (r) return r;
+
+    budget_spend(io_cost + 1);
+
+    if (jobs && phase->resumable) {
+        buf_setcstr(&srock->last, mbentry->name);
+        if (++srock->count % CHECKPOINT_INTERVAL == 0)
+            checkpoint_write(srock->id, 0, mbentry->name);
+    }
+
+    return 0;
+}
+
+static void report_table_entry(const char *mboxname, void *data, void *rock)
+{
+    struct buf buf = BUF_INITIALIZER;
+    int fd = *((int *) rock);
+
+    /* one write per line so lines from different workers don't mix */
+    buf_printf(&buf, "T %lld %s\n", (long long) *((time_t *) data), mboxname);
+    retry_write(fd, buf.s, buf.len);
+    buf_free(&buf);
+}
+
+/* send this worker's results for the phase to the parent */
+static void phase_report(struct expire_phase *phase, int fd)
+{
+    struct buf buf = BUF_INITIALIZER;
+    int i;
+
+    buf_putc(&buf, 'S');
+    for (i = 0; i < EXPIRE_NCOUNTERS; i++)
+        buf_printf(&buf, " %lu", phase->counters[i] ? *phase->counters[i] : 0);
+    buf_putc(&buf, '\n');
+    retry_write(fd, buf.s, buf.len);
+    buf_free(&buf);
+
+    if (phase->table)
+        hash_enumerate(phase->table, report_table_entry, &fd);
+}
+
+/* merge one line of worker results */
+static void phase_collect(struct expire_phase *phase, const char *line)
+{
+    const char *p;
+    char *end;
+    int i;
+
+    if (line[0] == 'S') {
+        for (p = line + 1, i = 0; i < EXPIRE_NCOUNTERS; p = end, i++) {
+            unsigned long n = strtoul(p, &end, 10);
+            if (end == p) break;
+            if (phase->counters[i]) *phase->counters[i] += n;
+        }
+    }
+    else if (line[0] == 'T' && phase->table) {
+        long long mark;
+        int n = 0;
+
+        if (sscanf(line, "T %lld%n", &mark, &n) == 1 && line[n] == ' ') {
+            time_t t = mark;
+            hash_insert(line + n + 1, xmemdup(&t, sizeof(t)), phase->table);
+        }
+    }
+}
+
+static void open_databases(void)
+{
+    annotatemore_open();
+
+    mboxlist_init(0);
+    mboxlist_open(NULL);
+
+    /* open the quota db, we'll need it for expunge */
+    quotadb_init(0);
+    quotadb_open(NULL);
+}
+
+static void close_databases(void)
+{
+    quotadb_close();
+    quotadb_done();
+    mboxlist_close();
+    mboxlist_done();
+    annotatemore_close();
+}
+
+static int run_worker(struct expire_phase *phase, int id,
+                      const char *find_prefix, int fd)
+{
+    struct shard_rock srock;
+    struct buf ckname = BUF_INITIALIZER;
+    int ckphase, ckdone;
+
+    memset(&srock, 0, sizeof(srock));
+    srock.phase = phase;
+    srock.id = id;
+
+    open_databases();
+
+    checkpoint_read(&ckphase, &ckdone, &ckname);
+    if (id < ckphase || (id == ckphase && ckdone))
+        srock.skip_all = 1;
+    else if (id == ckphase && phase->resumable && ckname.len)
+        srock.resume_after = buf_cstring(&ckname);
+
+    if (srock.skip_all || srock.resume_after) {
+        syslog(LOG_NOTICE, "%s worker %d resuming after %s",
+               phase->name, worker,
+               srock.skip_all ? "end of phase" : srock.resume_after);
+    }
+
+    if (!srock.skip_all || phase->resumed)
+        mboxlist_allmbox(find_prefix, shard_cb, &srock, 0);
+    if (phase->finish)
+        phase->finish(phase->rock);
+
+    /* never move a checkpoint from a later phase backwards */
+    if (!srock.skip_all) {
+        if (!sigquit)
+            checkpoint_write(id, 1, "");
+        else if (phase->resumable && srock.last.len)
+            checkpoint_write(id, 0, buf_cstring(&srock.last));
+    }
+
+    phase_report(phase, fd);
+    close(fd);
+
+    close_databases();
+    buf_free(&srock.last);
+    buf_free(&ckname);
+
+    return sigquit ? 1 : 0;
+}
+
+/*
+ * Fork a worker for each shard and collect their results.
+ * Returns non-zero if any worker did not finish its shard.
+ */
+static int run_workers(struct expire_phase *phase, int id,
+                       const char *find_prefix)
 {
+    struct buf line = BUF_INITIALIZER;
+    int fds[2];
+    int i, c, r = 0;
+    FILE *f;
+
+    if (pipe(fds) < 0)
+        fatal("unable to create pipe for workers", EC_OSERR);
+
+    for (i = 0; i < jobs; i++) {
+        pid_t pid = fork();
+
+        if (pid < 0)
+            fatal("unable to fork worker", EC_OSERR);
+
+        if (!pid) {
+            close(fds[0]);
+            worker_pids = NULL;
+            worker = i;
+            exit(run_worker(phase, id, find_prefix, fds[1]));
+        }
+
+        worker_pids[i] = pid;
+    }
+    close(fds[1]);
+
+    f = fdopen(fds[0], "r");
+    if (!f)
+        fatal("unable to read from workers", EC_OSERR);
+
+    for (;;) {
+        c = fgetc(f);
+        if (c == EOF) {
+            if (ferror(f) && errno == EINTR) {
+                clearerr(f);
+                continue;
+            }
+            break;
+        }
+        if (c == '\n') {
+            phase_collect(phase, buf_cstring(&line));
+            buf_reset(&line);
+        }
+        else {
+            buf_putc(&line, c);
+        }
+    }
+    fclose(f);
+    buf_free(&line);
+
+    for (i = 0; i < jobs; i++) {
+        int status = 0;
+
+        while (waitpid(worker_pids[i], &status, 0) < 0 && errno == EINTR);
+        worker_pids[i] = 0;
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+            syslog(LOG_WARNING, "%s worker %d did not finish", phase->name, i);
+            r = 1;
+        }
+    }
+
+    return r;
+}
+
+/*
+ * Run one phase over every mailbox (or the mailboxes of one user),
+ * either inline or split across the workers.
+ */
+static int run_phase(struct expire_phase *phase, int id,
+                     const char *find_prefix, const char *do_user)
+{
+    struct timeval start, end;
+    int r = 0;
+
+    gettimeofday(&start, NULL);
+
+    if (jobs) {
+        r = run_workers(phase, id, find_prefix);
+    }
+    else {
+        struct shard_rock srock;
+
+        memset(&srock, 0, sizeof(srock));
+        srock.phase = phase;
+        srock.id = id;
+
+        if (do_user)
+            mboxlist_usermboxtree(do_user, shard_cb, &srock, MBOXTREE_DELETED);
+        else
+            mboxlist_allmbox(find_prefix, shard_cb, &srock, 0);
+        if (phase->finish)
+            phase->finish(phase->rock);
+    }
+
+    gettimeofday(&end, NULL);
+
+    syslog(LOG_NOTICE, "%s phase took %0.3f seconds",
+           phase->name, timesub(&start, &end));
+    if (verbose)
+        fprintf(stderr, "%s phase took %0.3f seconds\n",
+                phase->name, timesub(&start, &end));
+
+    return r;
+}
+
+static void sighandler (int sig)
+{
+    int i;
+
     sigquit = 1;
+
+    /* pass it on to any workers */
+    for (i = 0; worker_pids && i < jobs; i++) {
+        if (worker_pids[i] > 0)
+            kill(worker_pids[i], sig);
+    }
     return;
 }
 
@@ -466,9 +1024,30 @@ int main(int argc, char *argv[])
     char *alt_config = NULL;
     const char *find_prefix = NULL;
     const char *do_user = NULL;
+    double io_budget = 0;
+    int incomplete = 0;
+    struct archive_rock arock;
     struct expire_rock erock;
     struct delete_rock drock;
     struct conversations_rock crock;
+    struct expire_phase archive_phase = {
+        "archive", archive, NULL, NULL, &arock, 1, NULL,
+        { &arock.mailboxes_seen }
+    };
+    struct expire_phase expire_phase = {
+        "expire", expire, expire_resumed, NULL, &erock, 1, &erock.table,
+        { &erock.mailboxes_seen, &erock.messages_seen,
+          &erock.messages_expired, &erock.messages_expunged,
+          &erock.userflags_expunged }
+    };
+    struct expire_phase conversations_phase = {
+        "conversations", expire_conversations, NULL, NULL, &crock, 1, NULL,
+        { &crock.databases_seen, &crock.msgids_seen, &crock.msgids_expired }
+    };
+    struct expire_phase delete_phase = {
+        "delete", delete, NULL, delete_mailboxes, &drock, 0, NULL,
+        { &drock.mailboxes_removed }
+    };
     struct sigaction action;
 
     if ((geteuid()) == 0 && (become_cyrus(/*is_master*/0) != 0)) {
@@ -476,6 +1055,7 @@ int main(int argc, char *argv[])
     }
 
     /* zero the expire_rock & delete_rock */
+    memset(&arock, 0, sizeof(arock));
     memset(&erock, 0, sizeof(erock));
     construct_hash_table(&erock.table, 10000, 1);
     memset(&drock, 0, sizeof(drock));
@@ -483,7 +1063,7 @@ int main(int argc, char *argv[])
     memset(&crock, 0, sizeof(crock));
     construct_hash_table(&crock.seen, 100, 1);
 
-    while ((opt = getopt(argc, argv, "C:D:E:X:A:p:u:vaxtcFS:")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:D:E:X:A:p:u:vaxtcFS:j:PB:R:")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -543,6 +1123,24 @@ int main(int argc, char *argv[])
             do_cid_expire = 0;
             break;
 
+        case 'j':
+            jobs = atoi(optarg);
+            if (jobs <= 0) usage();
+            break;
+
+        case 'P':
+            shard_by_partition = 1;
+            break;
+
+        case 'B':
+            io_budget = atof(optarg);
+            if (io_budget <= 0) usage();
+            break;
+
+        case 'R':
+            if (!parse_duration(optarg, &checkpoint_seconds)) usage();
+            break;
+
         default:
             usage();
             break;
@@ -556,6 +1154,23 @@ int main(int argc, char *argv[])
         !erock.do_userflags)
         usage();
 
+    /* one user's mailboxes all land on one worker anyway */
+    if ((do_user && jobs) || (shard_by_partition && !jobs))
+        usage();
+
+    if (jobs)
+        worker_pids = xzmalloc(jobs * sizeof(pid_t));
+
+    /* a checkpoint from a run over other mailboxes or with other
+     * cutoffs would make us skip work this run needs doing */
+    buf_printf(&checkpoint_params, "%d %d %d %d %d %d %d %s",
+               jobs, shard_by_partition, archive_seconds, expire_seconds,
+               expunge_seconds, delete_seconds, do_expunge,
+               find_prefix ? find_prefix : "");
+
+    /* the budget is for the whole run, split it between the workers */
+    budget.rate = io_budget / (jobs ? jobs : 1);
+
     sigemptyset(&action.sa_mask);
     action.sa_flags = 0;
     action.sa_handler = sighandler;
@@ -573,14 +1188,10 @@ int main(int argc, char *argv[])
         do_cid_expire = config_getswitch(IMAPOPT_CONVERSATIONS);
 
     annotate_init(NULL, NULL);
-    annotatemore_open();
-
-    mboxlist_init(0);
-    mboxlist_open(NULL);
 
-    /* open the quota db, we'll need it for expunge */
-    quotadb_init(0);
-    quotadb_open(NULL);
+    /* in parallel mode each worker opens its own */
+    if (!jobs)
+        open_databases();
 
     /* setup for mailbox event notifications */
     mboxevent_init();
@@ -600,12 +1211,10 @@ int main(int argc, char *argv[])
     }
 
     if (archive_seconds >= 0) {
-        time_t archive_mark = time(0) - archive_seconds;
+        arock.archive_mark = time(0) - archive_seconds;
         /* XXX - add syslog? */
-        if (do_user)
-            mboxlist_usermboxtree(do_user, archive, &archive_mark, MBOXTREE_DELETED);
-        else
-            mboxlist_allmbox(find_prefix, archive, &archive_mark, 0);
+        incomplete |= run_phase(&archive_phase, PHASE_ARCHIVE,
+                                find_prefix, do_user);
     }
 
     if (do_expunge && (expunge_seconds >= 0 || expire_seconds || erock.do_userflags)) {
@@ -627,10 +1236,8 @@ int main(int argc, char *argv[])
             }
         }
 
-        if (do_user)
-            mboxlist_usermboxtree(do_user, expire, &erock, MBOXTREE_DELETED);
-        else
-            mboxlist_allmbox(find_prefix, expire, &erock, 0);
+        incomplete |= run_phase(&expire_phase, PHASE_EXPIRE,
+                                find_prefix, do_user);
 
         syslog(LOG_NOTICE, "Expired %lu and expunged %lu out of %lu "
                             "messages from %lu mailboxes",
@@ -666,10 +1273,8 @@ int main(int argc, char *argv[])
                     "Removing conversation entries older than %0.2f days\n",
                     (double)(cid_expire_seconds/86400));
 
-        if (do_user)
-            mboxlist_usermboxtree(do_user, expire_conversations, &crock, MBOXTREE_DELETED);
-        else
-            mboxlist_allmbox(find_prefix, expire_conversations, &crock, 0);
+        incomplete |= run_phase(&conversations_phase, PHASE_CONVERSATIONS,
+                                find_prefix, do_user);
 
         syslog(LOG_NOTICE, "Expired %lu entries of %lu entries seen "
                             "in %lu conversation databases",
@@ -690,8 +1295,7 @@ int main(int argc, char *argv[])
 
     if ((delete_seconds >= 0) && mboxlist_delayed_delete_isenabled() &&
         config_getstring(IMAPOPT_DELETEDPREFIX)) {
-        int count = 0;
-        int i;
+        unsigned long count;
 
         if (verbose) {
             fprintf(stderr,
@@ -701,32 +1305,22 @@ int main(int argc, char *argv[])
 
         drock.delete_mark = time(0) - delete_seconds;
 
-        if (do_user)
-            mboxlist_usermboxtree(do_user, delete, &drock, MBOXTREE_DELETED);
-        else
-            mboxlist_allmbox(find_prefix, delete, &drock, 0);
-
-        for (i = 0 ; i < drock.to_delete.count ; i++) {
-            char *name = drock.to_delete.data[i];
+        incomplete |= run_phase(&delete_phase, PHASE_DELETE,
+                                find_prefix, do_user);
 
-            if (sigquit) {
-                goto finish;
-            }
-            if (verbose) {
-                fprintf(stderr, "Removing: %s\n", name);
-            }
-            r = mboxlist_deletemailbox(name, 1, NULL, NULL, NULL, 0, 0, 0);
-            count++;
+        if (sigquit) {
+            goto finish;
         }
 
+        count = drock.mailboxes_removed;
         if (verbose) {
             if (count != 1) {
-                fprintf(stderr, "Removed %d deleted mailboxes\n", count);
+                fprintf(stderr, "Removed %lu deleted mailboxes\n", count);
             } else {
                 fprintf(stderr, "Removed 1 deleted mailbox\n");
             }
         }
-        syslog(LOG_NOTICE, "Removed %d deleted mailboxes", count);
+        syslog(LOG_NOTICE, "Removed %lu deleted mailboxes", count);
     }
     if (sigquit) {
         goto finish;
@@ -736,16 +1330,20 @@ int main(int argc, char *argv[])
     if (expire_seconds > 0)
         r = duplicate_prune(expire_seconds, &erock.table);
 
+    /* a complete run starts the next one from scratch */
+    if (jobs && !incomplete)
+        checkpoint_remove();
+
 finish:
     free_hash_table(&erock.table, free);
     free_hash_table(&crock.seen, NULL);
     strarray_fini(&drock.to_delete);
 
-    quotadb_close();
-    quotadb_done();
-    mboxlist_close();
-    mboxlist_done();
-    annotatemore_close();
+    free(worker_pids);
+    buf_free(&checkpoint_params);
+
+    if (!jobs)
+        close_databases();
     annotate_done();
     duplicate_done();
     sasl_done();
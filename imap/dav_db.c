@@ -104,6 +104,7 @@
     " name TEXT,"                                                       \
     " nickname TEXT,"                                                   \
     " alive INTEGER,"                                                   \
+    " propsindexed INTEGER NOT NULL DEFAULT 0,"                         \
     " UNIQUE( mailbox, resource ) );"                                   \
     "CREATE INDEX IF NOT EXISTS idx_vcard_fn ON vcard_objs ( fullname );" \
     "CREATE INDEX IF NOT EXISTS idx_vcard_uid ON vcard_objs ( vcard_uid );"
@@ -127,6 +128,16 @@
     " otheruser TEXT NOT NULL DEFAULT \"\","                            \
     " FOREIGN KEY (objid) REFERENCES vcard_objs (rowid) ON DELETE CASCADE );"
 
+#define CMD_CREATE_PROPS                                                \
+    "CREATE TABLE IF NOT EXISTS vcard_props ("                          \
+    " rowid INTEGER PRIMARY KEY,"                                       \
+    " objid INTEGER,"                                                   \
+    " propname TEXT NOT NULL,"                                          \
+    " propvalue TEXT NOT NULL COLLATE NOCASE,"                          \
+    " FOREIGN KEY (objid) REFERENCES vcard_objs (rowid) ON DELETE CASCADE );" \
+    "CREATE INDEX IF NOT EXISTS idx_vcard_props ON vcard_props ( propname, propvalue COLLATE NOCASE );" \
+    "CREATE INDEX IF NOT EXISTS idx_vcard_props_objid ON vcard_props ( objid );"
+
 #define CMD_CREATE_OBJS                                                 \
     "CREATE TABLE IF NOT EXISTS dav_objs ("                             \
     " rowid INTEGER PRIMARY KEY,"                                       \
@@ -150,7 +161,7 @@
 
 
 #define CMD_CREATE CMD_CREATE_CAL CMD_CREATE_CARD CMD_CREATE_EM CMD_CREATE_GR \
-                   CMD_CREATE_OBJS
+                   CMD_CREATE_PROPS CMD_CREATE_OBJS
 
 /* leaves these unused columns around, but that's life.  A dav_reconstruct
  * will fix them */
@@ -176,16 +187,23 @@
 
 #define CMD_DBUPGRADEv6 CMD_CREATE_OBJS
 
+/* existing cards are left unindexed (and searched the slow way)
+   until they are next written or the DAV DB is reconstructed */
+#define CMD_DBUPGRADEv7                                         \
+    "ALTER TABLE vcard_objs ADD COLUMN propsindexed INTEGER NOT NULL DEFAULT 0;" \
+    CMD_CREATE_PROPS
+
 struct sqldb_upgrade davdb_upgrade[] = {
   { 2, CMD_DBUPGRADEv2, NULL },
   { 3, CMD_DBUPGRADEv3, NULL },
   { 4, CMD_DBUPGRADEv4, NULL },
   { 5, CMD_DBUPGRADEv5, NULL },
   { 6, CMD_DBUPGRADEv6, NULL },
+  { 7, CMD_DBUPGRADEv7, NULL },
   { 0, NULL, NULL }
 };
 
-#define DB_VERSION 6
+#define DB_VERSION 7
 
 static int in_reconstruct = 0;
 
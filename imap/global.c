@@ -337,6 +337,16 @@ EXPORTED int cyrus_init(const char *alt_config, const char *ident, unsigned flag
                                   config_getswitch(IMAPOPT_SQL_USESSL));
         libcyrus_config_setswitch(CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
                                   config_getswitch(IMAPOPT_SKIPLIST_ALWAYS_CHECKPOINT));
+        libcyrus_config_setstring(CYRUSOPT_SQLDB_JOURNAL_MODE,
+                                  config_getstring(IMAPOPT_SQLDB_JOURNAL_MODE));
+        libcyrus_config_setstring(CYRUSOPT_SQLDB_SYNCHRONOUS,
+                                  config_getstring(IMAPOPT_SQLDB_SYNCHRONOUS));
+        libcyrus_config_setint(CYRUSOPT_PTSCACHE_SHM_SLOTS,
+                               config_getint(IMAPOPT_PTSCACHE_SHM_SLOTS));
+        libcyrus_config_setint(CYRUSOPT_PTSCACHE_REFRESH,
+                               config_getint(IMAPOPT_PTSCACHE_REFRESH));
+        libcyrus_config_setint(CYRUSOPT_PTSCACHE_NEGATIVE_TIMEOUT,
+                               config_getint(IMAPOPT_PTSCACHE_NEGATIVE_TIMEOUT));
 
         /* Not until all configuration parameters are set! */
         libcyrus_init();
@@ -261,6 +261,7 @@ static int propfind_sharingmodes(const xmlChar *name, xmlNsPtr ns,
                                  struct propstat propstat[], void *rock);
 
 static void strip_vtimezones(icalcomponent *ical);
+static void busytime_cache_reset(void);
 
 static int report_cal_query(struct transaction_t *txn,
                             struct meth_params *rparams,
@@ -858,6 +859,8 @@ static void my_caldav_shutdown(void)
     freestrlist(cua_domains);
     cua_domains = NULL;
 
+    busytime_cache_reset();
+
     my_caldav_reset();
     webdav_done();
     caldav_done();
@@ -6870,6 +6873,124 @@ static int busytime_by_resource(void *rock, void *data)
 }
 
 
+/* Per-process cache of busytime periods found in a calendar collection
+ * for a given time-range.  Entries are keyed by mailbox uniqueid and
+ * time-range and are only valid while the mailbox highestmodseq matches,
+ * so any change to a resource in the collection invalidates its entries.
+ */
+struct busytime_cache_entry {
+    modseq_t modseq;                    /* highestmodseq of the collection */
+    struct freebusy_array freebusy;     /* busytime found in the collection */
+};
+
+static struct hash_table busytime_cache = HASH_TABLE_INITIALIZER;
+static int busytime_cache_count = 0;
+
+static void busytime_cache_entry_free(void *data)
+{
+    struct busytime_cache_entry *entry = (struct busytime_cache_entry *) data;
+
+    free(entry->freebusy.fb);
+    free(entry);
+}
+
+static void busytime_cache_reset(void)
+{
+    if (busytime_cache.size) {
+        free_hash_table(&busytime_cache, &busytime_cache_entry_free);
+    }
+    busytime_cache_count = 0;
+}
+
+static void busytime_cache_key(struct mailbox *mailbox,
+                               struct freebusy_filter *fbfilter,
+                               struct buf *buf)
+{
+    buf_reset(buf);
+    buf_printf(buf, "%s/", mailbox->uniqueid);
+    buf_appendcstr(buf, icaltime_as_ical_string(fbfilter->start));
+    buf_putc(buf, '/');
+    buf_appendcstr(buf, icaltime_as_ical_string(fbfilter->end));
+}
+
+/* caldav_foreach() wrapper to use/populate the busytime cache */
+static int busytime_foreach(void *davdb, const char *mboxname,
+                            int (*cb)(void *rock, void *data), void *rock)
+{
+    struct propfind_ctx *fctx = (struct propfind_ctx *) rock;
+    struct freebusy_filter *fbfilter =
+        (struct freebusy_filter *) fctx->filter_crit;
+    struct freebusy_array *freebusy = &fbfilter->freebusy;
+    struct busytime_cache_entry *entry;
+    int max = config_getint(IMAPOPT_CALDAV_BUSYTIME_CACHE_SIZE);
+    unsigned fblen = freebusy->len, vavlen = fbfilter->vavail.len;
+    struct buf key = BUF_INITIALIZER;
+    int r = 0;
+
+    if (max <= 0 || !fctx->mailbox) {
+        return caldav_foreach(davdb, mboxname, cb, rock);
+    }
+
+    if (!busytime_cache.size) {
+        construct_hash_table(&busytime_cache, max, 0);
+    }
+
+    busytime_cache_key(fctx->mailbox, fbfilter, &key);
+    entry = hash_lookup(buf_cstring(&key), &busytime_cache);
+
+    if (entry && entry->modseq == fctx->mailbox->i.highestmodseq) {
+        /* Cache hit - append the cached periods to the busytime array */
+        if (freebusy->len + entry->freebusy.len > freebusy->alloc) {
+            freebusy->alloc = freebusy->len + entry->freebusy.len;
+            freebusy->fb = xrealloc(freebusy->fb,
+                                    freebusy->alloc * sizeof(struct freebusy));
+        }
+        if (entry->freebusy.len) {
+            memcpy(freebusy->fb + freebusy->len, entry->freebusy.fb,
+                   entry->freebusy.len * sizeof(struct freebusy));
+        }
+        freebusy->len += entry->freebusy.len;
+
+        goto done;
+    }
+
+    r = caldav_foreach(davdb, mboxname, cb, rock);
+
+    /* Don't cache failures or collections containing VAVAILABILITY,
+       since those components are combined after all busytime is found */
+    if (r || *fctx->ret || fbfilter->vavail.len != vavlen) goto done;
+
+    if (!entry) {
+        if (busytime_cache_count >= max) {
+            /* Cache is full - start over rather than tracking usage */
+            busytime_cache_reset();
+            construct_hash_table(&busytime_cache, max, 0);
+        }
+
+        entry = xzmalloc(sizeof(struct busytime_cache_entry));
+        hash_insert(buf_cstring(&key), entry, &busytime_cache);
+        busytime_cache_count++;
+    }
+
+    entry->modseq = fctx->mailbox->i.highestmodseq;
+    free(entry->freebusy.fb);
+    memset(&entry->freebusy, 0, sizeof(struct freebusy_array));
+
+    if (freebusy->len > fblen) {
+        entry->freebusy.len = entry->freebusy.alloc = freebusy->len - fblen;
+        entry->freebusy.fb = xmalloc(entry->freebusy.len *
+                                     sizeof(struct freebusy));
+        memcpy(entry->freebusy.fb, freebusy->fb + fblen,
+               entry->freebusy.len * sizeof(struct freebusy));
+    }
+
+  done:
+    buf_free(&key);
+
+    return r;
+}
+
+
 /* mboxlist_findall() callback to find busytime of a collection */
 static int busytime_by_collection(const mbentry_t *mbentry, void *rock)
 {
@@ -7101,7 +7222,7 @@ icalcomponent *busytime_query_local(struct transaction_t *txn,
     fctx->open_db = (db_open_proc_t) &caldav_open_mailbox;
     fctx->close_db = (db_close_proc_t) &caldav_close;
     fctx->lookup_resource = (db_lookup_proc_t) &caldav_lookup_resource;
-    fctx->foreach_resource = (db_foreach_proc_t) &caldav_foreach;
+    fctx->foreach_resource = &busytime_foreach;
     fctx->proc_by_resource = &busytime_by_resource;
 
     /* Gather up all of the busytime and VAVAILABILITY periods */
@@ -1459,13 +1459,30 @@ static int apply_paramfilter(struct param_filter *paramfilter,
     return dav_apply_textmatch(BAD_CAST param->value, paramfilter->match);
 }
 
+/* Split an indexed value back into the components of a multi-valued
+   property, keeping empty ones as the vCard parser does */
+static strarray_t *split_indexed_value(const char *value)
+{
+    strarray_t *values = strarray_new();
+    const char *p;
+
+    while ((p = strchr(value, CARDDAV_PROPS_VALUESEP))) {
+        strarray_appendm(values, xstrndup(value, p - value));
+        value = p + 1;
+    }
+    strarray_append(values, value);
+
+    return values;
+}
+
 static int apply_propfilter(struct prop_filter *propfilter,
                             struct carddav_data *cdata,
                             struct propfind_ctx *fctx)
 {
     int pass = 1;
     struct vparse_card *vcard = fctx->obj;
-    struct vparse_entry myprop, *prop = NULL;
+    struct vparse_entry myprop, *prop = NULL, *indexed_props = NULL;
+    strarray_t *indexed = NULL;
 
     memset(&myprop, 0, sizeof(struct vparse_entry));
 
@@ -1501,7 +1518,39 @@ static int apply_propfilter(struct prop_filter *propfilter,
         if (myprop.v.value) prop = &myprop;
     }
 
-    if (propfilter->param || (propfilter->kind == VCARD_ANY_PROPERTY)) {
+    if (!propfilter->param && (propfilter->kind == VCARD_ANY_PROPERTY) &&
+        !vcard && fctx->davdb) {
+        /* Try the values indexed in the DAV DB before parsing the vCard */
+        indexed = carddav_getprops(fctx->davdb, cdata->dav.rowid,
+                                   (const char *) propfilter->name);
+        if (indexed) {
+            int i, n = strarray_size(indexed);
+
+            if (!n) {
+                strarray_free(indexed);
+                return propfilter->not_defined;
+            }
+
+            /* One entry per property instance, with the components
+               of a multi-valued one (ORG) tested separately */
+            indexed_props = xzmalloc(n * sizeof(struct vparse_entry));
+            for (i = 0; i < n; i++) {
+                const char *value = strarray_nth(indexed, i);
+
+                indexed_props[i].name = (char *) propfilter->name;
+                if (strchr(value, CARDDAV_PROPS_VALUESEP)) {
+                    indexed_props[i].multivaluesep = ';';
+                    indexed_props[i].v.values = split_indexed_value(value);
+                }
+                else indexed_props[i].v.value = (char *) value;
+                if (i + 1 < n) indexed_props[i].next = &indexed_props[i+1];
+            }
+            prop = indexed_props;
+        }
+    }
+
+    if (!prop && (propfilter->param ||
+                  (propfilter->kind == VCARD_ANY_PROPERTY))) {
         /* Load message containing the resource and parse vcard data */
         if (!vcard) {
             if (!fctx->msg_buf.len) {
@@ -1519,8 +1568,10 @@ static int apply_propfilter(struct prop_filter *propfilter,
     }
 
     if (!prop) return propfilter->not_defined;
-    if (propfilter->not_defined) return 0;
-    if (!(propfilter->match || propfilter->param)) return 1;
+    if (propfilter->not_defined || !(propfilter->match || propfilter->param)) {
+        pass = !propfilter->not_defined;
+        goto done;
+    }
 
     /* Test each instance of this property (logical OR) */
     do {
@@ -1561,7 +1612,18 @@ static int apply_propfilter(struct prop_filter *propfilter,
 
     } while (!pass && (prop = prop->next));  /* XXX  No API to fetch next prop */
 
+  done:
     if (myprop.multivaluesep) strarray_free(myprop.v.values);
+    if (indexed) {
+        int i;
+
+        for (i = 0; i < strarray_size(indexed); i++) {
+            if (indexed_props[i].multivaluesep)
+                strarray_free(indexed_props[i].v.values);
+        }
+        free(indexed_props);
+        strarray_free(indexed);
+    }
 
     return pass;
 }
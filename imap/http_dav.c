@@ -91,6 +91,7 @@
 #include "imap/imap_err.h"
 
 #include <libxml/uri.h>
+#include <libxml/xmlwriter.h>
 
 static const struct dav_namespace_t {
     const char *href;
@@ -1309,6 +1310,163 @@ struct allprop_rock {
     struct propstat *propstat;
 };
 
+/*
+ * Streamed output of a DAV:multistatus response.
+ *
+ * Responses are built in the XML tree under 'root' as usual.  Once
+ * 'threshold' of them have accumulated, the response header and the
+ * multistatus start tag are sent (chunked), and from then on each
+ * completed child of 'root' is serialized to the body and freed,
+ * so that memory use no longer grows with the number of resources.
+ */
+struct multistatus_stream {
+    struct transaction_t *txn;
+    xmlNodePtr root;                    /* DAV:multistatus element */
+    xmlNsPtr ns_last;                   /* Last namespace declared on root */
+    xmlTextWriterPtr writer;            /* NULL until output has started */
+    xmlBufferPtr buf;                   /* Serialized child of root */
+    unsigned threshold;                 /* # of responses before streaming */
+    unsigned count;                     /* # of responses added */
+    unsigned started : 1;               /* Response header has been sent */
+};
+
+static void multistatus_stream_init(struct multistatus_stream *stream,
+                                    struct propfind_ctx *fctx)
+{
+    memset(stream, 0, sizeof(struct multistatus_stream));
+
+    stream->threshold = config_getint(IMAPOPT_DAVSTREAMTHRESHOLD);
+    if (!stream->threshold) return;
+
+    stream->txn = fctx->txn;
+    stream->root = fctx->root;
+    fctx->stream = stream;
+}
+
+static int multistatus_stream_write(void *context, const char *buf, int len)
+{
+    struct multistatus_stream *stream = (struct multistatus_stream *) context;
+
+    /* First write outputs the response header */
+    write_body(stream->started ? 0 : HTTP_MULTI_STATUS, stream->txn, buf, len);
+    stream->started = 1;
+
+    return len;
+}
+
+static void multistatus_stream_start(struct multistatus_stream *stream)
+{
+    struct transaction_t *txn = stream->txn;
+    xmlNodePtr root = stream->root;
+    xmlOutputBufferPtr out;
+    xmlNsPtr ns;
+
+    txn->resp_body.type = "application/xml; charset=utf-8";
+    txn->flags.te |= TE_CHUNKED;
+
+    /* We can't know in advance whether iCalendar data will be returned */
+    txn->flags.cc |= CC_NOTRANSFORM;
+
+    out = xmlOutputBufferCreateIO(&multistatus_stream_write, NULL, stream, NULL);
+    stream->writer = xmlNewTextWriter(out);
+    stream->buf = xmlBufferCreate();
+
+    xmlTextWriterStartDocument(stream->writer, NULL, "utf-8", NULL);
+    if (root->ns && root->ns->prefix) {
+        xmlTextWriterStartElementNS(stream->writer,
+                                    root->ns->prefix, root->name, NULL);
+    }
+    else xmlTextWriterStartElement(stream->writer, root->name);
+
+    /* Declare the namespaces we know about so far on the root element */
+    for (ns = root->nsDef; ns; ns = ns->next) {
+        struct buf attr = BUF_INITIALIZER;
+
+        buf_setcstr(&attr, "xmlns");
+        if (ns->prefix) buf_printf(&attr, ":%s", (const char *) ns->prefix);
+        xmlTextWriterWriteAttribute(stream->writer,
+                                    BAD_CAST buf_cstring(&attr), ns->href);
+        buf_free(&attr);
+
+        stream->ns_last = ns;
+    }
+}
+
+static void multistatus_stream_flush(struct multistatus_stream *stream)
+{
+    xmlNodePtr root = stream->root, node, next;
+
+    for (node = root->children; node; node = next) {
+        xmlNsPtr ns = stream->ns_last ? stream->ns_last->next : root->nsDef;
+
+        next = node->next;
+
+        /* Namespaces added to root after its start tag was sent
+           need to be declared on each element that we output */
+        for (; ns; ns = ns->next) xmlNewNs(node, ns->href, ns->prefix);
+
+        xmlBufferEmpty(stream->buf);
+        xmlNodeDump(stream->buf, root->doc, node, 1,
+                    config_httpprettytelemetry);
+        xmlTextWriterWriteRaw(stream->writer, xmlBufferContent(stream->buf));
+
+        xmlUnlinkNode(node);
+        xmlFreeNode(node);
+    }
+
+    xmlTextWriterFlush(stream->writer);
+}
+
+/* Called after each response is added to 'root' */
+static void multistatus_stream_add(struct propfind_ctx *fctx)
+{
+    struct multistatus_stream *stream = fctx->stream;
+
+    /* Only stream top-level responses (not DAV:expand-property) */
+    if (!stream || fctx->root != stream->root) return;
+
+    if (!stream->writer) {
+        if (++stream->count < stream->threshold) return;
+
+        multistatus_stream_start(stream);
+    }
+
+    multistatus_stream_flush(stream);
+}
+
+/* Finish a streamed response.
+   Returns 0 if streaming never started and the caller must output the tree */
+static int multistatus_stream_end(struct multistatus_stream *stream, int ret)
+{
+    if (!stream->writer) return 0;
+
+    multistatus_stream_flush(stream);
+
+    xmlTextWriterEndElement(stream->writer);
+    xmlTextWriterEndDocument(stream->writer);
+    xmlFreeTextWriter(stream->writer);
+    xmlBufferFree(stream->buf);
+    stream->writer = NULL;
+
+    /* Output the last chunk */
+    write_body(0, stream->txn, NULL, 0);
+
+    switch (ret) {
+    case 0:
+    case HTTP_OK:
+    case HTTP_MULTI_STATUS:
+        break;
+
+    default:
+        syslog(LOG_ERR, "error %d (%s) after streaming multistatus for %s",
+               ret, stream->txn->error.desc ? stream->txn->error.desc : "",
+               stream->txn->req_line.uri);
+        break;
+    }
+
+    return 1;
+}
+
 /* Add a response tree to 'root' for the specified href and
    either error code or property list */
 int xml_add_response(struct propfind_ctx *fctx, long code, unsigned precond)
@@ -1436,6 +1594,8 @@ int xml_add_response(struct propfind_ctx *fctx, long code, unsigned precond)
 
     fctx->record = NULL;
 
+    multistatus_stream_add(fctx);
+
     return 0;
 }
 
@@ -5479,11 +5639,13 @@ EXPORTED int meth_propfind(struct transaction_t *txn, void *params)
     xmlDocPtr indoc = NULL, outdoc = NULL;
     xmlNodePtr root, cur = NULL, props = NULL;
     xmlNsPtr ns[NUM_NAMESPACE];
-    struct hash_table ns_table = { 0, NULL, NULL };
+    struct hash_table ns_table = HASH_TABLE_INITIALIZER;
     struct propfind_ctx fctx;
+    struct multistatus_stream stream;
     struct propfind_entry_list *elist = NULL;
 
     memset(&fctx, 0, sizeof(struct propfind_ctx));
+    buf_init_pool(&fctx.buf);
 
     /* Parse the path */
     if (fparams->parse_path) {
@@ -5647,6 +5809,7 @@ EXPORTED int meth_propfind(struct transaction_t *txn, void *params)
     fctx.ns = ns;
     fctx.ns_table = &ns_table;
     fctx.ret = &ret;
+    multistatus_stream_init(&stream, &fctx);
 
     /* Parse the list of properties and build a list of callbacks */
     preload_proplist(props, &fctx);
@@ -5772,7 +5935,11 @@ EXPORTED int meth_propfind(struct transaction_t *txn, void *params)
     if (fctx.davdb) fctx.close_db(fctx.davdb);
 
     /* Output the XML response */
-    if (!ret) {
+    if (multistatus_stream_end(&stream, ret)) {
+        /* Response has already been sent */
+        ret = 0;
+    }
+    else if (!ret) {
         /* iCalendar data in response should not be transformed */
         if (fctx.flags.fetcheddata) txn->flags.cc |= CC_NOTRANSFORM;
 
@@ -7872,11 +8039,13 @@ int meth_report(struct transaction_t *txn, void *params)
     xmlNodePtr inroot = NULL, outroot = NULL, cur, prop = NULL, props = NULL;
     const struct report_type_t *report = NULL;
     xmlNsPtr ns[NUM_NAMESPACE];
-    struct hash_table ns_table = { 0, NULL, NULL };
+    struct hash_table ns_table = HASH_TABLE_INITIALIZER;
     struct propfind_ctx fctx;
+    struct multistatus_stream stream;
     struct propfind_entry_list *elist = NULL;
 
     memset(&fctx, 0, sizeof(struct propfind_ctx));
+    buf_init_pool(&fctx.buf);
 
     /* Parse the path */
     if ((r = rparams->parse_path(txn->req_uri->path,
@@ -8026,6 +8195,9 @@ int meth_report(struct transaction_t *txn, void *params)
     fctx.ns = ns;
     fctx.ns_table = &ns_table;
     fctx.ret = &ret;
+    if (outroot && !strcmp(report->resp_root, "multistatus")) {
+        multistatus_stream_init(&stream, &fctx);
+    }
 
     /* Parse the list of properties and build a list of callbacks */
     if (fctx.mode) {
@@ -8037,7 +8209,11 @@ int meth_report(struct transaction_t *txn, void *params)
     if (!ret) ret = (*report->proc)(txn, rparams, inroot, &fctx);
 
     /* Output the XML response */
-    if (outroot) {
+    if (fctx.stream && multistatus_stream_end(&stream, ret)) {
+        /* Response has already been sent */
+        ret = 0;
+    }
+    else if (outroot) {
         switch (ret) {
         case HTTP_OK:
         case HTTP_MULTI_STATUS:
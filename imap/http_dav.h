@@ -343,6 +343,7 @@ struct propfind_ctx {
     int *ret;                           /* Return code to pass up to caller */
     struct fctx_flags_t flags;          /* Return flags for this propfind */
     struct buf buf;                     /* Working buffer */
+    struct multistatus_stream *stream;  /* Streamed output of 'root' */
 };
 
 
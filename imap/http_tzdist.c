@@ -87,6 +87,8 @@ static ptrarray_t *leap_seconds = NULL;
 static int geo_enabled = 0;
 static void tzdist_init(struct buf *serverinfo);
 static void tzdist_shutdown(void);
+static void tzdist_cache_init(void);
+static void tzdist_cache_done(void);
 static int meth_get(struct transaction_t *txn, void *params);
 static int action_capa(struct transaction_t *txn);
 static int action_leap(struct transaction_t *txn);
@@ -656,6 +658,8 @@ static void tzdist_init(struct buf *serverinfo __attribute__((unused)))
 
     initialize_tz_error_table();
 
+    tzdist_cache_init();
+
     open_shape_file(serverinfo);
 
     read_leap_seconds();
@@ -679,6 +683,8 @@ static void tzdist_shutdown(void)
 
     zoneinfo_close(NULL);
 
+    tzdist_cache_done();
+
     close_shape_file();
 
     if (!leap_seconds) return;
@@ -1737,6 +1743,176 @@ static void truncate_vtimezone(icalcomponent *vtz,
     if (proleptic) *proleptic = &tombstone;
 }
 
+/*
+ * Per-process caches.
+ *
+ * Parsed zoneinfo files are kept (keyed by tzid and validated against the
+ * dtstamp of the zoneinfo record) so that each request only has to clone
+ * the component rather than read and parse the file.
+ *
+ * Complete response bodies for get and expand actions are kept in an LRU
+ * keyed by the ETag plus everything else that the body depends on.
+ */
+struct zone_cache_entry {
+    time_t dtstamp;
+    icalcomponent *ical;
+};
+
+static struct hash_table zone_cache = HASH_TABLE_INITIALIZER;
+
+struct resp_cache_entry {
+    char *key;
+    char *data;
+    size_t len;
+    struct resp_cache_entry *prev, *next;
+};
+
+static struct hash_table resp_cache = HASH_TABLE_INITIALIZER;
+static struct resp_cache_entry *resp_cache_head = NULL;  /* most recent */
+static struct resp_cache_entry *resp_cache_tail = NULL;  /* least recent */
+static unsigned resp_cache_count = 0;
+static unsigned resp_cache_size = 0;
+
+static void zone_cache_entry_free(void *data)
+{
+    struct zone_cache_entry *zce = (struct zone_cache_entry *) data;
+
+    icalcomponent_free(zce->ical);
+    free(zce);
+}
+
+/* Return a (caller-owned) parsed copy of the zoneinfo file for 'tzid' */
+static icalcomponent *zone_cache_get(const char *tzid, time_t dtstamp)
+{
+    struct zone_cache_entry *zce = hash_lookup(tzid, &zone_cache);
+
+    if (!zce || zce->dtstamp != dtstamp) {
+        static struct buf pathbuf = BUF_INITIALIZER;
+        const char *path, *msg_base = NULL;
+        size_t msg_size = 0;
+        icalcomponent *ical;
+        int fd;
+
+        /* Open, mmap, and parse the file */
+        buf_reset(&pathbuf);
+        buf_printf(&pathbuf, "%s%s/%s.ics",
+                   config_dir, FNAME_ZONEINFODIR, tzid);
+        path = buf_cstring(&pathbuf);
+        if ((fd = open(path, O_RDONLY)) == -1) return NULL;
+
+        map_refresh(fd, 1, &msg_base, &msg_size, MAP_UNKNOWN_LEN, path, NULL);
+        if (!msg_base) {
+            close(fd);
+            return NULL;
+        }
+
+        ical = icalparser_parse_string(msg_base);
+        map_free(&msg_base, &msg_size);
+        close(fd);
+
+        if (!ical) return NULL;
+
+        if (!zce) {
+            zce = xzmalloc(sizeof(struct zone_cache_entry));
+            hash_insert(tzid, zce, &zone_cache);
+        }
+        else icalcomponent_free(zce->ical);
+
+        zce->dtstamp = dtstamp;
+        zce->ical = ical;
+    }
+
+    return icalcomponent_new_clone(zce->ical);
+}
+
+static void resp_cache_unlink(struct resp_cache_entry *rce)
+{
+    if (rce->prev) rce->prev->next = rce->next;
+    else resp_cache_head = rce->next;
+
+    if (rce->next) rce->next->prev = rce->prev;
+    else resp_cache_tail = rce->prev;
+
+    rce->prev = rce->next = NULL;
+}
+
+static void resp_cache_entry_free(void *data)
+{
+    struct resp_cache_entry *rce = (struct resp_cache_entry *) data;
+
+    free(rce->key);
+    free(rce->data);
+    free(rce);
+}
+
+static struct resp_cache_entry *resp_cache_lookup(const char *key)
+{
+    struct resp_cache_entry *rce;
+
+    if (!resp_cache_size) return NULL;
+
+    rce = hash_lookup(key, &resp_cache);
+    if (rce && rce != resp_cache_head) {
+        /* Move to front */
+        resp_cache_unlink(rce);
+        rce->next = resp_cache_head;
+        resp_cache_head->prev = rce;
+        resp_cache_head = rce;
+    }
+
+    return rce;
+}
+
+/* Add a response body to the cache, taking ownership of 'data' */
+static void resp_cache_insert(const char *key, char *data, size_t len)
+{
+    struct resp_cache_entry *rce;
+
+    if (!resp_cache_size || hash_lookup(key, &resp_cache)) {
+        free(data);
+        return;
+    }
+
+    if (resp_cache_count >= resp_cache_size) {
+        /* Evict least recently used */
+        rce = resp_cache_tail;
+        resp_cache_unlink(rce);
+        hash_del(rce->key, &resp_cache);
+        resp_cache_entry_free(rce);
+        resp_cache_count--;
+    }
+
+    rce = xzmalloc(sizeof(struct resp_cache_entry));
+    rce->key = xstrdup(key);
+    rce->data = data;
+    rce->len = len;
+
+    rce->next = resp_cache_head;
+    if (resp_cache_head) resp_cache_head->prev = rce;
+    else resp_cache_tail = rce;
+    resp_cache_head = rce;
+
+    hash_insert(key, rce, &resp_cache);
+    resp_cache_count++;
+}
+
+static void tzdist_cache_init(void)
+{
+    resp_cache_size = config_getint(IMAPOPT_TZDIST_CACHE_SIZE);
+
+    construct_hash_table(&zone_cache, 1024, 0);
+    if (resp_cache_size) construct_hash_table(&resp_cache, resp_cache_size, 0);
+}
+
+static void tzdist_cache_done(void)
+{
+    free_hash_table(&zone_cache, &zone_cache_entry_free);
+
+    if (resp_cache_size) free_hash_table(&resp_cache, &resp_cache_entry_free);
+    resp_cache_head = resp_cache_tail = NULL;
+    resp_cache_count = 0;
+}
+
 /* Perform a get action */
 static int action_get(struct transaction_t *txn)
 {
@@ -1750,6 +1926,7 @@ static int action_get(struct transaction_t *txn)
     unsigned long datalen = 0;
     struct resp_body_t *resp_body = &txn->resp_body;
     struct mime_type_t *mime = NULL;
+    struct buf key = BUF_INITIALIZER;
     const char **hdr;
 
     /* Check/find requested MIME type:
@@ -1822,26 +1999,41 @@ static int action_get(struct transaction_t *txn)
 
     if (txn->meth != METH_HEAD) {
         static struct buf pathbuf = BUF_INITIALIZER;
-        const char *p, *path, *proto, *host, *msg_base = NULL;
-        size_t msg_size = 0;
+        static struct buf fnamebuf = BUF_INITIALIZER;
+        const char *p, *proto, *host;
+        struct resp_cache_entry *rce;
         icalcomponent *ical, *vtz;
         icalproperty *prop;
         struct buf *buf;
-        int fd;
+        int truncate = (!icaltime_is_null_time(start) ||
+                        !icaltime_is_null_time(end));
 
-        /* Open, mmap, and parse the file */
-        buf_reset(&pathbuf);
-        buf_printf(&pathbuf, "%s%s/%s.ics",
-                   config_dir, FNAME_ZONEINFODIR, tzid);
-        path = buf_cstring(&pathbuf);
-        if ((fd = open(path, O_RDONLY)) == -1) return HTTP_SERVER_ERROR;
+        /* Set Content-Disposition filename */
+        buf_reset(&fnamebuf);
+        buf_printf(&fnamebuf, "%s.%s", tzid, mime->file_ext);
+        resp_body->fname = buf_cstring(&fnamebuf);
 
-        map_refresh(fd, 1, &msg_base, &msg_size, MAP_UNKNOWN_LEN, path, NULL);
-        if (!msg_base) return HTTP_SERVER_ERROR;
+        txn->flags.vary |= VARY_ACCEPT;
 
-        ical = icalparser_parse_string(msg_base);
-        map_free(&msg_base, &msg_size);
-        close(fd);
+        /* The body depends on the zone data, format, TZURL and truncation.
+           The ETag only has a hash of the tzid, so use the tzid itself */
+        http_proto_host(txn->req_hdrs, &proto, &host);
+        buf_printf(&key, "get|%s|%ld|%s|%s://%s|%s",
+                   tzid, (long) lastmod, mime->content_type, proto, host,
+                   truncate ? URI_QUERY(txn->req_uri) : "");
+
+        if ((rce = resp_cache_lookup(buf_cstring(&key)))) {
+            write_body(precond, txn, rce->data, rce->len);
+            buf_free(&key);
+            return 0;
+        }
+
+        /* Get a private copy of the parsed zoneinfo file */
+        ical = zone_cache_get(tzid, lastmod);
+        if (!ical) {
+            buf_free(&key);
+            return HTTP_SERVER_ERROR;
+        }
 
         vtz = icalcomponent_get_first_component(ical, ICAL_VTIMEZONE_COMPONENT);
         prop = icalcomponent_get_first_property(vtz, ICAL_TZID_PROPERTY);
@@ -1859,7 +2051,6 @@ static int action_get(struct transaction_t *txn)
 
         /* Start constructing TZURL */
         buf_reset(&pathbuf);
-        http_proto_host(txn->req_hdrs, &proto, &host);
         buf_printf(&pathbuf, "%s://%s%s/zones/",
                    proto, host, namespace_tzdist.prefix);
 
@@ -1877,7 +2068,7 @@ static int action_get(struct transaction_t *txn)
             }
         }
 
-        if (!icaltime_is_null_time(start) || !icaltime_is_null_time(end)) {
+        if (truncate) {
 
             if (!icaltime_is_null_time(end)) {
                 /* Add TZUNTIL to VTIMEZONE */
@@ -1902,19 +2093,14 @@ static int action_get(struct transaction_t *txn)
         data = buf_release(buf);
         buf_destroy(buf);
 
-        /* Set Content-Disposition filename */
-        buf_reset(&pathbuf);
-        buf_printf(&pathbuf, "%s.%s", tzid, mime->file_ext);
-        resp_body->fname = buf_cstring(&pathbuf);
-
-        txn->flags.vary |= VARY_ACCEPT;
-
         icalcomponent_free(ical);
     }
 
     write_body(precond, txn, data, datalen);
 
-    if (data) free(data);
+    /* The cache takes ownership of the body */
+    if (data) resp_cache_insert(buf_cstring(&key), data, datalen);
+    buf_free(&key);
 
     return 0;
 }
@@ -1940,6 +2126,8 @@ static int action_expand(struct transaction_t *txn)
     time_t lastmod;
     icaltimetype start, end;
     struct resp_body_t *resp_body = &txn->resp_body;
+    struct resp_cache_entry *rce;
+    struct buf key = BUF_INITIALIZER;
     json_t *root = NULL;
 
     /* Sanity check the parameters */
@@ -2017,30 +2205,30 @@ static int action_expand(struct transaction_t *txn)
 
 
     if (txn->meth != METH_HEAD) {
-        static struct buf pathbuf = BUF_INITIALIZER;
-        const char *path, *msg_base = NULL;
-        size_t msg_size = 0;
         icalcomponent *ical, *vtz;
         struct observance *proleptic;
         icalarray *obsarray;
         json_t *jobsarray;
         unsigned n;
-        int fd;
 
-        /* Open, mmap, and parse the file */
-        buf_reset(&pathbuf);
-        buf_printf(&pathbuf, "%s%s/%s.ics",
-                   config_dir, FNAME_ZONEINFODIR, tzid);
-        path = buf_cstring(&pathbuf);
-        if ((fd = open(path, O_RDONLY)) == -1) return HTTP_SERVER_ERROR;
-
-        map_refresh(fd, 1, &msg_base, &msg_size, MAP_UNKNOWN_LEN, path, NULL);
-        if (!msg_base) return HTTP_SERVER_ERROR;
+        if (!zdump) {
+            /* The body depends on the zone data and the expansion range */
+            buf_printf(&key, "expand|%s|%ld|%s|", tzid, (long) lastmod,
+                       icaltime_as_ical_string(start));
+            buf_appendcstr(&key, icaltime_as_ical_string(end));
 
-        ical = icalparser_parse_string(msg_base);
-        map_free(&msg_base, &msg_size);
-        close(fd);
+            if ((rce = resp_cache_lookup(buf_cstring(&key)))) {
+                buf_free(&key);
+                return json_response(precond, txn, NULL, &rce->data);
+            }
+        }
 
+        /* Get a private copy of the parsed zoneinfo file */
+        ical = zone_cache_get(tzid, lastmod);
+        if (!ical) {
+            buf_free(&key);
+            return HTTP_SERVER_ERROR;
+        }
 
         /* Create an array of observances */
         obsarray = icalarray_new(sizeof(struct observance), 20);
@@ -2136,6 +2324,16 @@ static int action_expand(struct transaction_t *txn)
 
         return 0;
     }
+    else if (buf_len(&key)) {
+        char *resp = NULL;
+
+        /* Output the JSON object and cache its text */
+        r = json_response(precond, txn, root, &resp);
+        if (resp) resp_cache_insert(buf_cstring(&key), resp, strlen(resp));
+        buf_free(&key);
+
+        return r;
+    }
     else {
         /* Output the JSON object */
         return json_response(precond, txn, root, NULL);
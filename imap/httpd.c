@@ -94,6 +94,7 @@
 #include "tok.h"
 #include "wildmat.h"
 #include "md5.h"
+#include "sqldb.h"
 
 /* generated headers are not necessarily in current directory */
 #include "imap/http_err.h"
@@ -869,6 +870,7 @@ int service_init(int argc __attribute__((unused)),
     /* open the mboxevent system */
     events = mboxevent_init();
     apns_enabled = (events & EVENT_APPLEPUSHSERVICE_DAV);
+    mboxevent_defer(1);
 
     mboxevent_setnamespace(&httpd_namespace);
 
@@ -960,6 +962,9 @@ int service_init(int argc __attribute__((unused)),
         if (namespaces[i]->init) namespaces[i]->init(&serverinfo);
     }
 
+    /* Reuse DAV database connections across requests */
+    sqldb_keepopen(config_getint(IMAPOPT_HTTPDBKEEPOPEN));
+
     compile_time = calc_compile_time(__TIME__, __DATE__);
 
     return 0;
@@ -1930,6 +1935,9 @@ static void cmdloop(struct http_connection *conn)
         /* Reset txn state */
         transaction_reset(&txn);
 
+        /* Drop anything the last request allocated from the command pool */
+        cmdpool_reset();
+
         /* Check for input from client */
         do {
             /* Flush any buffered output */
@@ -1951,6 +1959,9 @@ static void cmdloop(struct http_connection *conn)
             prot_flush(httpd_out);
             if (backend_current) prot_flush(backend_current->out);
 
+            /* Send event notifications once the client has its answer */
+            mboxevent_flush();
+
             /* Check for shutdown file */
             if (shutdown_file(txn.buf.s, txn.buf.alloc) ||
                 (httpd_userid &&
@@ -3247,6 +3258,150 @@ static void multipart_byteranges(struct transaction_t *txn,
 }
 
 
+/*
+ * Cache of compressed static response bodies.
+ *
+ * Keyed by scheme, Host, request path and query, Content-Type, ETag,
+ * Content-Encoding and uncompressed length, plus the value of every
+ * other request header named in the response's Vary header, so only
+ * responses that carry an ETag (and are therefore stable for a given
+ * representation) are cached, and never across virtual hosts.
+ */
+#define ZCACHE_MAX_LEN  (256 * 1024)   /* largest compressed body to cache */
+
+struct zcache_entry {
+    char *key;
+    struct buf data;
+    struct zcache_entry *prev, *next;
+};
+
+static struct hash_table zcache = HASH_TABLE_INITIALIZER;
+static struct zcache_entry *zcache_head = NULL;  /* most recent */
+static struct zcache_entry *zcache_tail = NULL;  /* least recent */
+static unsigned zcache_count = 0;
+static int zcache_size = -1;
+
+static void zcache_unlink(struct zcache_entry *zce)
+{
+    if (zce->prev) zce->prev->next = zce->next;
+    else zcache_head = zce->next;
+
+    if (zce->next) zce->next->prev = zce->prev;
+    else zcache_tail = zce->prev;
+
+    zce->prev = zce->next = NULL;
+}
+
+static void zcache_entry_free(struct zcache_entry *zce)
+{
+    free(zce->key);
+    buf_free(&zce->data);
+    free(zce);
+}
+
+/* Build the cache key for the current response, or return NULL if the
+ * response is not cacheable */
+static const char *zcache_key(long code, struct transaction_t *txn,
+                              unsigned len)
+{
+    static struct buf key = BUF_INITIALIZER;
+    const char **hdr;
+
+    if (zcache_size < 0) {
+        zcache_size = config_getint(IMAPOPT_HTTPCOMPRESSCACHE);
+        if (zcache_size > 0) construct_hash_table(&zcache, zcache_size, 0);
+    }
+
+    if (zcache_size <= 0 || !txn->resp_body.etag) return NULL;
+    if (code != HTTP_OK && code != HTTP_PARTIAL) return NULL;
+    if (txn->resp_body.enc != CE_GZIP && txn->resp_body.enc != CE_BR) {
+        return NULL;
+    }
+
+    buf_reset(&key);
+    buf_printf(&key, "%u|%u|%s|%s|", txn->resp_body.enc, len,
+               txn->resp_body.etag,
+               txn->resp_body.type ? txn->resp_body.type : "");
+
+    /* Accept-Encoding is already covered by the encoding */
+    if (txn->flags.vary & ~VARY_AE) {
+        static const struct {
+            unsigned flag;
+            const char *name;
+        } vary_hdrs[] = {
+            { VARY_ACCEPT, "Accept" },
+            { VARY_BRIEF,  "Brief" },
+            { VARY_PREFER, "Prefer" },
+            { 0, NULL }
+        };
+        int i;
+
+        for (i = 0; vary_hdrs[i].name; i++) {
+            if (!(txn->flags.vary & vary_hdrs[i].flag)) continue;
+
+            buf_printf(&key, "%s:", vary_hdrs[i].name);
+            if ((hdr = spool_getheader(txn->req_hdrs, vary_hdrs[i].name))) {
+                int j;
+
+                for (j = 0; hdr[j]; j++) buf_printf(&key, "%s,", hdr[j]);
+            }
+            buf_putc(&key, '|');
+        }
+    }
+
+    hdr = spool_getheader(txn->req_hdrs, "Host");
+    buf_printf(&key, "%s://%s%s?%s", https ? "https" : "http",
+               hdr ? hdr[0] : "",
+               txn->req_uri->path,
+               txn->req_uri->query ? txn->req_uri->query : "");
+
+    return buf_cstring(&key);
+}
+
+static struct zcache_entry *zcache_lookup(const char *key)
+{
+    struct zcache_entry *zce = hash_lookup(key, &zcache);
+
+    if (zce && zce != zcache_head) {
+        /* Move to front */
+        zcache_unlink(zce);
+        zce->next = zcache_head;
+        zcache_head->prev = zce;
+        zcache_head = zce;
+    }
+
+    return zce;
+}
+
+static void zcache_insert(const char *key, const char *data, size_t len)
+{
+    struct zcache_entry *zce;
+
+    if (len > ZCACHE_MAX_LEN || hash_lookup(key, &zcache)) return;
+
+    if (zcache_count >= (unsigned) zcache_size) {
+        /* Evict least recently used */
+        zce = zcache_tail;
+        zcache_unlink(zce);
+        hash_del(zce->key, &zcache);
+        zcache_entry_free(zce);
+        zcache_count--;
+    }
+
+    zce = xzmalloc(sizeof(struct zcache_entry));
+    zce->key = xstrdup(key);
+    buf_setmap(&zce->data, data, len);
+
+    zce->next = zcache_head;
+    if (zcache_head) zcache_head->prev = zce;
+    else zcache_tail = zce;
+    zcache_head = zce;
+
+    hash_insert(key, zce, &zcache);
+    zcache_count++;
+}
+
+
 /*
  * Output an HTTP response with body data, compressed as necessary.
  *
@@ -3262,6 +3417,8 @@ EXPORTED void write_body(long code, struct transaction_t *txn,
                          const char *buf, unsigned len)
 {
     unsigned outlen = len, offset = 0, last_chunk;
+    const char *zkey = NULL;
+    struct zcache_entry *zce = NULL;
     int do_md5 = (txn->meth == METH_HEAD) ? 0 :
         config_getswitch(IMAPOPT_HTTPCONTENTMD5);
     static MD5_CTX ctx;
@@ -3280,10 +3437,18 @@ EXPORTED void write_body(long code, struct transaction_t *txn,
             txn->resp_body.enc = CE_IDENTITY;
             txn->flags.te = TE_NONE;
         }
+        else if ((zkey = zcache_key(code, txn, len))) {
+            /* Reuse a previously compressed copy of this body */
+            zce = zcache_lookup(zkey);
+        }
     }
 
     /* Compress data */
-    if (txn->resp_body.enc == CE_BR) {
+    if (zce) {
+        buf = zce->data.s;
+        outlen = zce->data.len;
+    }
+    else if (txn->resp_body.enc == CE_BR) {
 #ifdef HAVE_BROTLI
         /* Only flush for static content or on last (zero-length) chunk */
         unsigned op = last_chunk ?
@@ -3373,6 +3538,8 @@ EXPORTED void write_body(long code, struct transaction_t *txn,
 #endif /* HAVE_ZLIB */
     }
 
+    if (zkey && !zce) zcache_insert(zkey, buf, outlen);
+
     if (code) {
         /* Initial call - prepare response header based on CE, TE and version */
         if (do_md5) MD5Init(&ctx);
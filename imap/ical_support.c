@@ -46,9 +46,13 @@
 #include <string.h>
 
 #include "caldav_db.h"
+#include "hash.h"
 #include "ical_support.h"
+#include "libconfig.h"
 #include "message.h"
 #include "util.h"
+#include "xmalloc.h"
+#include "xstrlcpy.h"
 
 #ifdef HAVE_ICAL
 
@@ -410,13 +414,116 @@ struct buf *my_icalcomponent_as_ical_string(icalcomponent* comp)
     return ret;
 }
 
+/*
+ * Cache of parsed resources, keyed by message GUID.
+ *
+ * Resources are immutable and content-addressed, so a cached entry never
+ * needs invalidating; the least recently used entry is simply discarded
+ * when the cache is full.  Callers always get their own clone.
+ */
+struct ical_cache_entry {
+    char *guid;
+    icalcomponent *ical;
+    char *schedule_userid;
+    struct ical_cache_entry *prev, *next;
+};
+
+static struct hash_table ical_cache = HASH_TABLE_INITIALIZER;
+static struct ical_cache_entry *ical_cache_head = NULL;  /* most recent */
+static struct ical_cache_entry *ical_cache_tail = NULL;  /* least recent */
+static int ical_cache_count = 0;
+static int ical_cache_size = -1;
+
+static void ical_cache_unlink(struct ical_cache_entry *ice)
+{
+    if (ice->prev) ice->prev->next = ice->next;
+    else ical_cache_head = ice->next;
+
+    if (ice->next) ice->next->prev = ice->prev;
+    else ical_cache_tail = ice->prev;
+
+    ice->prev = ice->next = NULL;
+}
+
+static void ical_cache_push(struct ical_cache_entry *ice)
+{
+    ice->next = ical_cache_head;
+    if (ical_cache_head) ical_cache_head->prev = ice;
+    else ical_cache_tail = ice;
+    ical_cache_head = ice;
+}
+
+static struct ical_cache_entry *ical_cache_lookup(const char *guid)
+{
+    struct ical_cache_entry *ice;
+
+    if (ical_cache_size < 0) {
+        /* anything below 1 disables the cache */
+        int size = config_getint(IMAPOPT_CALDAV_ICALCACHE_SIZE);
+
+        ical_cache_size = size > 0 ? size : 0;
+        if (ical_cache_size)
+            construct_hash_table(&ical_cache, ical_cache_size, 0);
+    }
+    if (!ical_cache_size) return NULL;
+
+    ice = hash_lookup(guid, &ical_cache);
+    if (ice && ice != ical_cache_head) {
+        ical_cache_unlink(ice);
+        ical_cache_push(ice);
+    }
+
+    return ice;
+}
+
+static void ical_cache_insert(const char *guid, icalcomponent *ical,
+                              const char *schedule_userid)
+{
+    struct ical_cache_entry *ice;
+
+    if (ical_cache_count >= ical_cache_size) {
+        /* Evict least recently used */
+        ice = ical_cache_tail;
+        ical_cache_unlink(ice);
+        hash_del(ice->guid, &ical_cache);
+        icalcomponent_free(ice->ical);
+        free(ice->schedule_userid);
+        free(ice->guid);
+        free(ice);
+        ical_cache_count--;
+    }
+
+    ice = xzmalloc(sizeof(struct ical_cache_entry));
+    ice->guid = xstrdup(guid);
+    ice->ical = icalcomponent_new_clone(ical);
+    ice->schedule_userid = xstrdupnull(schedule_userid);
+    ical_cache_push(ice);
+
+    hash_insert(guid, ice, &ical_cache);
+    ical_cache_count++;
+}
+
 icalcomponent *record_to_ical(struct mailbox *mailbox,
                               const struct index_record *record,
                               char **schedule_userid)
 {
     icalcomponent *ical = NULL;
-    message_t *m = message_new_from_record(mailbox, record);
+    message_t *m;
     struct buf buf = BUF_INITIALIZER;
+    struct ical_cache_entry *ice;
+    char guid[2*MESSAGE_GUID_SIZE+1] = "";
+
+    if (!message_guid_isnull(&record->guid)) {
+        strlcpy(guid, message_guid_encode(&record->guid), sizeof(guid));
+
+        if ((ice = ical_cache_lookup(guid))) {
+            if (schedule_userid && ice->schedule_userid)
+                *schedule_userid = xstrdup(ice->schedule_userid);
+            return icalcomponent_new_clone(ice->ical);
+        }
+    }
+
+    m = message_new_from_record(mailbox, record);
 
     /* Load message containing the resource and parse iCal data */
     if (!message_get_field(m, "rawbody", MESSAGE_RAW, &buf)) {
@@ -424,14 +531,18 @@ icalcomponent *record_to_ical(struct mailbox *mailbox,
     }
 
     /* extract the schedule user header */
-    if (schedule_userid) {
+    buf_reset(&buf);
+    if (message_get_field(m, "x-schedule-user-address",
+                          MESSAGE_DECODED|MESSAGE_TRIM, &buf)) {
         buf_reset(&buf);
-        if (!message_get_field(m, "x-schedule-user-address",
-                               MESSAGE_DECODED|MESSAGE_TRIM, &buf)) {
-            if (buf.len) *schedule_userid = buf_release(&buf);
-        }
     }
 
+    if (ical && *guid && ical_cache_size > 0) {
+        ical_cache_insert(guid, ical, buf.len ? buf_cstring(&buf) : NULL);
+    }
+
+    if (schedule_userid && buf.len) *schedule_userid = buf_release(&buf);
+
     buf_free(&buf);
     message_unref(&m);
     return ical;
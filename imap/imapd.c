@@ -864,6 +864,7 @@ int service_init(int argc, char **argv, char **envp)
     events = mboxevent_init();
     apns_enabled =
       (events & EVENT_APPLEPUSHSERVICE) && config_getstring(IMAPOPT_APS_TOPIC);
+    mboxevent_defer(1);
 
     search_attr_init();
 
@@ -1255,6 +1256,12 @@ static void cmdloop(void)
         prot_flush(imapd_out);
         if (backend_current) prot_flush(backend_current->out);
 
+        /* Send event notifications once the client has its answer */
+        mboxevent_flush();
+
+        /* Drop anything the last command allocated from the command pool */
+        cmdpool_reset();
+
         /* command no longer running */
         proc_register(config_ident, imapd_clienthost, imapd_userid, index_mboxname(imapd_index), NULL);
 
@@ -9588,6 +9595,7 @@ struct apply_rock {
     void *data;
     char lastname[MAX_MAILBOX_PATH+1];
     unsigned int nseen;
+    ptrarray_t *batch;  /* collect mbentries rather than applying proc */
 };
 
 static int apply_cb(struct findall_data *data, void* rock)
@@ -9611,6 +9619,12 @@ static int apply_cb(struct findall_data *data, void* rock)
     backdoor->ext_name = xmalloc(strlen(extname)+1);
     strcpy(backdoor->ext_name, extname);
 
+    if (arock->batch) {
+        ptrarray_append(arock->batch, mboxlist_entry_copy(data->mbentry));
+        arock->nseen++;
+        return 0;
+    }
+
     r = annotate_state_set_mailbox_mbe(state, data->mbentry);
     if (r) return r;
 
@@ -9620,18 +9634,65 @@ static int apply_cb(struct findall_data *data, void* rock)
     return r;
 }
 
+/*
+ * Apply proc to each of a batch of mailboxes, after fetching their
+ * database annotations matching the prefetch entries in one go.
+ */
+static int apply_mailbox_batch(annotate_state_t *state,
+                               ptrarray_t *mbentries,
+                               const strarray_t *prefetch,
+                               int (*proc)(annotate_state_t *, void *),
+                               void *rock)
+{
+    strarray_t mboxnames = STRARRAY_INITIALIZER;
+    int i, r = 0;
+
+    for (i = 0 ; i < mbentries->count ; i++) {
+        const mbentry_t *mbentry = ptrarray_nth(mbentries, i);
+        strarray_append(&mboxnames, mbentry->name);
+    }
+
+    /* a failed prefetch just means looking each mailbox up on its own */
+    if (annotate_state_prefetch(state, &mboxnames, prefetch))
+        syslog(LOG_WARNING, "annotate: prefetch of %d mailboxes failed",
+               mboxnames.count);
+
+    for (i = 0 ; !r && i < mbentries->count ; i++) {
+        r = annotate_state_set_mailbox_mbe(state, ptrarray_nth(mbentries, i));
+        if (!r) r = proc(state, rock);
+    }
+
+    strarray_fini(&mboxnames);
+
+    return r;
+}
+
+static void free_mbentries(ptrarray_t *mbentries)
+{
+    int i;
+
+    for (i = 0 ; i < mbentries->count ; i++) {
+        mbentry_t *mbentry = ptrarray_nth(mbentries, i);
+        mboxlist_entry_free(&mbentry);
+    }
+    ptrarray_fini(mbentries);
+}
+
 static int apply_mailbox_pattern(annotate_state_t *state,
                                  const char *pattern,
                                  int (*proc)(annotate_state_t *, void *),
-                                 void *data)
+                                 void *data,
+                                 const strarray_t *prefetch)
 {
     struct apply_rock arock;
+    ptrarray_t batch = PTRARRAY_INITIALIZER;
     int r = 0;
 
     memset(&arock, 0, sizeof(arock));
     arock.state = state;
     arock.proc = proc;
     arock.data = data;
+    if (prefetch) arock.batch = &batch;
 
     r = mboxlist_findall(&imapd_namespace,
                          pattern,
@@ -9640,19 +9701,26 @@ static int apply_mailbox_pattern(annotate_state_t *state,
                          imapd_authstate,
                          apply_cb, &arock);
 
+    if (!r && prefetch)
+        r = apply_mailbox_batch(state, &batch, prefetch, proc, data);
+
     if (!r && !arock.nseen)
         r = IMAP_MAILBOX_NONEXISTENT;
 
+    free_mbentries(&batch);
+
     return r;
 }
 
 static int apply_mailbox_array(annotate_state_t *state,
                                const strarray_t *mboxes,
                                int (*proc)(annotate_state_t *, void *),
-                               void *rock)
+                               void *rock,
+                               const strarray_t *prefetch)
 {
     int i;
     mbentry_t *mbentry = NULL;
+    ptrarray_t batch = PTRARRAY_INITIALIZER;
     char *intname = NULL;
     int r = 0;
 
@@ -9663,6 +9731,14 @@ static int apply_mailbox_array(annotate_state_t *state,
         if (r)
             break;
 
+        if (prefetch) {
+            ptrarray_append(&batch, mbentry);
+            mbentry = NULL;
+            free(intname);
+            intname = NULL;
+            continue;
+        }
+
         r = annotate_state_set_mailbox_mbe(state, mbentry);
         if (r)
             break;
@@ -9676,6 +9752,10 @@ static int apply_mailbox_array(annotate_state_t *state,
         intname = NULL;
     }
 
+    if (!r && prefetch)
+        r = apply_mailbox_batch(state, &batch, prefetch, proc, rock);
+
+    free_mbentries(&batch);
     mboxlist_entry_free(&mbentry);
     free(intname);
 
@@ -9727,7 +9807,8 @@ static void cmd_getannotation(const char *tag, char *mboxpat)
         arock.attribs = &attribs;
         arock.callback = getannotation_response;
         arock.cbrock = NULL;
-        r = apply_mailbox_pattern(astate, mboxpat, annot_fetch_cb, &arock);
+        r = apply_mailbox_pattern(astate, mboxpat, annot_fetch_cb, &arock,
+                                  &entries);
     }
     /* we didn't write anything */
     annotate_state_abort(&astate);
@@ -10036,9 +10117,11 @@ static void cmd_getmetadata(const char *tag)
         arock.callback = getmetadata_response;
         arock.cbrock = &opts;
         if (mbox_is_pattern)
-            r = apply_mailbox_pattern(astate, mboxes->data[0], annot_fetch_cb, &arock);
+            r = apply_mailbox_pattern(astate, mboxes->data[0], annot_fetch_cb,
+                                      &arock, &newe);
         else
-            r = apply_mailbox_array(astate, mboxes, annot_fetch_cb, &arock);
+            r = apply_mailbox_array(astate, mboxes, annot_fetch_cb, &arock,
+                                    &newe);
     }
     /* we didn't write anything */
     annotate_state_abort(&astate);
@@ -10111,7 +10194,8 @@ static void cmd_setannotation(const char *tag, char *mboxpat)
         else {
             struct annot_store_rock arock;
             arock.entryatts = entryatts;
-            r = apply_mailbox_pattern(astate, mboxpat, annot_store_cb, &arock);
+            r = apply_mailbox_pattern(astate, mboxpat, annot_store_cb, &arock,
+                                      NULL);
         }
     }
     if (!r)
@@ -10171,7 +10255,8 @@ static void cmd_setmetadata(const char *tag, char *mboxpat)
         else {
             struct annot_store_rock arock;
             arock.entryatts = entryatts;
-            r = apply_mailbox_pattern(astate, mboxpat, annot_store_cb, &arock);
+            r = apply_mailbox_pattern(astate, mboxpat, annot_store_cb, &arock,
+                                      NULL);
         }
     }
     if (!r)
@@ -13036,6 +13121,9 @@ static void list_data(struct listargs *listargs)
 {
     canonical_list_patterns(listargs->ref, &listargs->pat);
 
+    if (listargs->ret & LIST_RET_STATUS)
+        statuscache_prefetch(imapd_userid);
+
     /* Check to see if we should only list the personal namespace */
     if (!(listargs->cmd == LIST_CMD_EXTENDED)
             && !strcmp(listargs->pat.data[0], "*")
@@ -13082,6 +13170,8 @@ static void list_data(struct listargs *listargs)
 
         if (rock.last_name) free(rock.last_name);
     }
+
+    statuscache_prefetch_done();
 }
 
 /*
@@ -463,6 +463,20 @@ EXPORTED int index_expunge(struct index_state *state, char *sequence,
     return r;
 }
 
+/* a seqset of every UID from 'low' to 'high' */
+static struct seqset *_uid_range(unsigned low, unsigned high)
+{
+    struct seqset *seq = seqset_init(0, SEQ_MERGE);
+
+    if (low <= high) {
+        seqset_add(seq, low, 1);
+        if (high > low)
+            seqset_add(seq, high, 1);
+    }
+
+    return seq;
+}
+
 static char *index_buildseen(struct index_state *state, const char *oldseenuids)
 {
     struct seqset *outlist;
@@ -483,12 +497,14 @@ static char *index_buildseen(struct index_state *state, const char *oldseenuids)
     oldmax = seq_lastnum(oldseenuids, NULL);
     if (oldmax > state->last_uid) {
         struct seqset *seq = seqset_parse(oldseenuids, NULL, oldmax);
-        uint32_t uid;
+        struct seqset *known = _uid_range(1, state->last_uid);
+        struct seqset *future = seqset_diff(seq, known);
 
-        /* for each future UID, copy the state in the old seenuids */
-        for (uid = state->last_uid + 1; uid <= oldmax; uid++)
-            seqset_add(outlist, uid, seqset_ismember(seq, uid));
+        /* keep the old seen state of the future UIDs */
+        seqset_join(outlist, future);
 
+        seqset_free(future);
+        seqset_free(known);
         seqset_free(seq);
     }
 
@@ -933,13 +949,13 @@ struct seqset *index_vanished(struct index_state *state,
     /* No recently expunged messages */
     if (params->modseq >= state->highestmodseq) return NULL;
 
-    outlist = seqset_init(0, SEQ_SPARSE);
     seq = _parse_sequence(state, params->sequence, 1);
 
     /* XXX - use match_seq and match_uid */
 
     if (params->modseq >= mailbox->i.deletedmodseq) {
         const message_t *msg;
+        outlist = seqset_init(0, SEQ_SPARSE);
         /* all records are significant */
         /* List only expunged UIDs with MODSEQ > requested */
         struct mailbox_iter *iter = mailbox_iter_init(mailbox, params->modseq, 0);
@@ -956,6 +972,8 @@ struct seqset *index_vanished(struct index_state *state,
         unsigned prevuid = 0;
         struct seqset *msgnolist;
         struct seqset *uidlist;
+        struct seqset *present;
+        struct seqset *range;
         uint32_t msgno;
         unsigned uid;
 
@@ -985,29 +1003,28 @@ struct seqset *index_vanished(struct index_state *state,
         struct mailbox_iter *iter = mailbox_iter_init(mailbox, params->modseq, ITER_SKIP_EXPUNGED);
         mailbox_iter_startuid(iter, prevuid);
 
-        /* possible efficiency improvement - use "seq_getnext" on seq
-         * to avoid incrementing through every single number for prevuid.
-         * Only really an issue if there's a giant block of thousands of
-         * expunged messages.  Only likely to be seen in the wild if
-         * last_uid winds up being bumped up a few million by a bug... */
-
         /* for the rest of the mailbox, we're just going to have to assume
-         * every record in the requested range which DOESN'T exist has been
-         * expunged, so build a complete sequence */
+         * every UID up to last_uid which DOESN'T exist has been expunged,
+         * so take the ones which do away from the whole range.  Working
+         * a range at a time keeps a giant block of expunged UIDs (say
+         * last_uid bumped up a few million by a bug) cheap */
+        present = seqset_init(0, SEQ_SPARSE);
         while ((msg = mailbox_iter_step(iter))) {
             const struct index_record *record = msg_record(msg);
-            while (++prevuid < record->uid) {
-                if (!params->sequence || seqset_ismember(seq, prevuid))
-                    seqset_add(outlist, prevuid, 1);
-            }
-            prevuid = record->uid;
+            if (record->uid > prevuid)
+                seqset_add(present, record->uid, 1);
         }
         mailbox_iter_done(&iter);
 
-        /* include the space past the final record up to last_uid as well */
-        while (++prevuid <= mailbox->i.last_uid) {
-            if (!params->sequence || seqset_ismember(seq, prevuid))
-                seqset_add(outlist, prevuid, 1);
+        range = _uid_range(prevuid + 1, mailbox->i.last_uid);
+        outlist = seqset_diff(range, present);
+        seqset_free(range);
+        seqset_free(present);
+
+        if (params->sequence) {
+            range = outlist;
+            outlist = seqset_intersect(range, seq);
+            seqset_free(range);
         }
     }
 
@@ -3944,24 +3961,19 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
     }
     if ((fetchitems & FETCH_CID) &&
         config_getswitch(IMAPOPT_CONVERSATIONS)) {
-        struct buf buf = BUF_INITIALIZER;
         if (!record.cid)
-            buf_appendcstr(&buf, "NIL");
+            prot_printf(state->out, "%cCID NIL", sepchar);
         else
-            buf_printf(&buf, CONV_FMT, record.cid);
-        prot_printf(state->out, "%cCID %s", sepchar, buf_cstring(&buf));
-        buf_free(&buf);
+            prot_printf(state->out, "%cCID " CONV_FMT, sepchar, record.cid);
         sepchar = ' ';
     }
     if ((fetchitems & FETCH_BASECID) &&
         config_getswitch(IMAPOPT_CONVERSATIONS)) {
-        struct buf buf = BUF_INITIALIZER;
         if (!record.basecid)
-            buf_appendcstr(&buf, "NIL");
+            prot_printf(state->out, "%cBASECID NIL", sepchar);
         else
-            buf_printf(&buf, CONV_FMT, record.basecid);
-        prot_printf(state->out, "%cBASECID %s", sepchar, buf_cstring(&buf));
-        buf_free(&buf);
+            prot_printf(state->out, "%cBASECID " CONV_FMT,
+                        sepchar, record.basecid);
         sepchar = ' ';
     }
     if ((fetchitems & FETCH_FOLDER)) {
@@ -1812,6 +1812,13 @@ typedef struct contact_filter {
     const char *online;
     const char *address;
     const char *notes;
+
+    /* Cards that may match email, phone, company and department
+       according to the DAV DB search index (NULL if not searched) */
+    bitvector_t *maybe_email;
+    bitvector_t *maybe_phone;
+    bitvector_t *maybe_company;
+    bitvector_t *maybe_department;
 } contact_filter;
 
 typedef struct contact_filter_rock {
@@ -1946,6 +1953,127 @@ static int contact_filter_match(void *vf, void *rock)
     return 1;
 }
 
+static const char *email_types[] = { "personal", "work", "other", NULL };
+static const char *phone_types[] =
+    { "home", "work", "mobile", "fax", "pager", "other", NULL };
+
+/* Look up the cards that may match text in the vCard properties 'propname'
+   (and their LABEL parameters, if 'types' is set) using the search index.
+   Returns NULL if the index can't rule out any cards. */
+static bitvector_t *contact_filter_search(struct carddav_db *db,
+                                          const char *propname,
+                                          const char **types,
+                                          const char *text)
+{
+    bitvector_t *rowids;
+    const char **type;
+    int r;
+
+    if (types) {
+        /* Text matching a JMAP type matches any card having the property */
+        for (type = types; *type; type++) {
+            if (stristr(*type, text)) return NULL;
+        }
+    }
+    else if (strpbrk(text, ",;\\")) {
+        /* Text may span components of a structured value */
+        return NULL;
+    }
+
+    rowids = xzmalloc(sizeof(bitvector_t));
+    r = carddav_search_props(db, NULL, propname, text, 0, rowids);
+    if (!r && types) {
+        char *label = strconcat(propname, ";LABEL", (char *)NULL);
+        r = carddav_search_props(db, NULL, label, text, 0, rowids);
+        free(label);
+    }
+    if (r) {
+        bv_free(rowids);
+        free(rowids);
+        return NULL;
+    }
+
+    return rowids;
+}
+
+/* Search the index once for each condition in filter f that it covers. */
+static void contact_filter_prepare(jmap_filter *f, struct carddav_db *db)
+{
+    size_t i;
+
+    for (i = 0; i < f->n_conditions; i++) {
+        contact_filter_prepare(f->conditions[i], db);
+    }
+
+    if (f->kind == JMAP_FILTER_KIND_COND) {
+        contact_filter *cf = (contact_filter *) f->cond;
+
+        if (cf->email)
+            cf->maybe_email = contact_filter_search(db, "EMAIL",
+                                                    email_types, cf->email);
+        if (cf->phone)
+            cf->maybe_phone = contact_filter_search(db, "TEL",
+                                                    phone_types, cf->phone);
+        if (cf->company)
+            cf->maybe_company = contact_filter_search(db, "ORG",
+                                                      NULL, cf->company);
+        if (cf->department)
+            cf->maybe_department = contact_filter_search(db, "ORG",
+                                                         NULL, cf->department);
+    }
+}
+
+/* Return false if the card with rowid can't match filter f according to
+ * the search index, so that it doesn't need to be loaded and converted.
+ * Only rules out cards: anything that can't be decided is a maybe. */
+static int contact_filter_prematch(jmap_filter *f, unsigned rowid)
+{
+    size_t i;
+
+    if (f->kind == JMAP_FILTER_KIND_OPER) {
+        switch (f->op) {
+        case JMAP_FILTER_OP_AND:
+            for (i = 0; i < f->n_conditions; i++) {
+                if (!contact_filter_prematch(f->conditions[i], rowid))
+                    return 0;
+            }
+            return 1;
+
+        case JMAP_FILTER_OP_OR:
+            for (i = 0; i < f->n_conditions; i++) {
+                if (contact_filter_prematch(f->conditions[i], rowid))
+                    return 1;
+            }
+            return 0;
+
+        default:
+            return 1;
+        }
+    }
+    else {
+        contact_filter *cf = (contact_filter *) f->cond;
+
+        if (cf->maybe_email && !bv_isset(cf->maybe_email, rowid))
+            return 0;
+        if (cf->maybe_phone && !bv_isset(cf->maybe_phone, rowid))
+            return 0;
+        if (cf->maybe_company && !bv_isset(cf->maybe_company, rowid))
+            return 0;
+        if (cf->maybe_department && !bv_isset(cf->maybe_department, rowid))
+            return 0;
+
+        return 1;
+    }
+}
+
+static void contact_filter_free_maybe(bitvector_t *rowids)
+{
+    if (rowids) {
+        bv_free(rowids);
+        free(rowids);
+    }
+}
+
 /* Free the memory allocated by this contact filter. */
 static void contact_filter_free(void *vf)
 {
@@ -1954,6 +2082,10 @@ static void contact_filter_free(void *vf)
         free_hash_table(f->inContactGroup, NULL);
         free(f->inContactGroup);
     }
+    contact_filter_free_maybe(f->maybe_email);
+    contact_filter_free_maybe(f->maybe_phone);
+    contact_filter_free_maybe(f->maybe_company);
+    contact_filter_free_maybe(f->maybe_department);
     free(f);
 }
 
@@ -2081,6 +2213,10 @@ static int getcontactlist_cb(void *rock, struct carddav_data *cdata) {
         return 0;
     }
 
+    /* Skip contacts that the search index rules out. */
+    if (crock->filter && !contact_filter_prematch(crock->filter, cdata->dav.rowid)) {
+        return 0;
+    }
 
     /* Open mailbox. */
     if (!crock->mailbox || strcmp(crock->mailbox->name, cdata->dav.mailbox)) {
@@ -2197,6 +2333,7 @@ static int getContactList(struct jmap_req *req)
     /* Inspect every entry in this accounts addressbok mailboxes. */
     rock.contacts = json_pack("[]");
     rock.carddavdb = db;
+    if (rock.filter) contact_filter_prepare(rock.filter, db);
     r = carddav_foreach(db, NULL, getcontactlist_cb, &rock);
     if (rock.mailbox) mailbox_close(&rock.mailbox);
     if (r) goto done;
@@ -1669,7 +1669,7 @@ done:
 static json_t *emailer_from_addr(const struct address *a)
 {
     json_t *emailers = json_pack("[]");
-    struct buf buf = BUF_INITIALIZER;
+    struct buf buf = BUF_POOL_INITIALIZER;
 
     while (a) {
         json_t *e = json_pack("{}");
@@ -2169,7 +2169,7 @@ static int jmapmsg_from_body(jmap_req_t *req, hash_table *props,
     }
     else {
         json_t *wantheaders = json_pack("{}");
-        struct buf buf = BUF_INITIALIZER;
+        struct buf buf = BUF_POOL_INITIALIZER;
         buf_setcstr(&buf, "headers.");
         const char *key;
         json_t *val;
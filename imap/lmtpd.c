@@ -255,6 +255,7 @@ int service_init(int argc __attribute__((unused)),
 
         /* setup for mailbox event notifications */
         mboxevent_init();
+        mboxevent_defer(1);
     }
 
     /* Set namespace */
@@ -883,6 +884,9 @@ int deliver(message_data_t *msgdata, char *authuser,
     stage = NULL;
     if (notifyheader) free(notifyheader);
 
+    /* send this message's event notifications as one batch */
+    mboxevent_flush();
+
     return 0;
 }
 
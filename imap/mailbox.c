@@ -56,6 +56,7 @@
 #include <string.h>
 #include <syslog.h>
 #include <utime.h>
+#include <sys/wait.h>
 
 #ifdef HAVE_DIRENT_H
 # include <dirent.h>
@@ -5765,11 +5766,292 @@ static int records_match(const char *mboxname,
     return match;
 }
 
+/*
+ * Parse-ahead for reconstruct.  Message files which are going to need
+ * parsing are dealt out round-robin to worker processes, each of which
+ * parses its share in UID order and streams the results back down its
+ * own pipe.  The reconstruct still makes every change itself, in UID
+ * order - it just picks up the parsed record from a worker instead of
+ * calling message_parse() inline.
+ */
+
+static int reconstruct_workers = 0;
+
+EXPORTED void mailbox_reconstruct_set_workers(int nworkers)
+{
+    reconstruct_workers = nworkers;
+}
+
+struct parse_item {
+    uint32_t uid;
+    char *fname;
+};
+
+struct parse_ahead {
+    int nworkers;
+    pid_t *pids;
+    int *fds;
+    struct parse_item *items;
+    unsigned nitems;
+    unsigned pos;
+    struct buf cache;
+};
+
+/* the fields message_parse() fills in, as sent down the pipe */
+struct parse_result {
+    int r;
+    uint32_t uid;
+    time_t internaldate;
+    time_t sentdate;
+    time_t gmtime;
+    uint32_t size;
+    uint32_t header_size;
+    uint32_t content_lines;
+    uint32_t cache_version;
+    bit32 cache_crc;
+    struct message_guid guid;
+    struct cacheitem item[NUM_CACHE_FIELDS];
+    uint32_t cache_len;
+};
+
+static void parse_ahead_worker(struct parse_ahead *pa, int w, int fd)
+{
+    unsigned i;
+
+    for (i = w; i < pa->nitems; i += pa->nworkers) {
+        struct index_record record;
+        struct parse_result res;
+
+        memset(&record, 0, sizeof(struct index_record));
+        memset(&res, 0, sizeof(struct parse_result));
+
+        res.uid = pa->items[i].uid;
+        res.r = message_parse(pa->items[i].fname, &record);
+        if (!res.r) {
+            res.internaldate = record.internaldate;
+            res.sentdate = record.sentdate;
+            res.gmtime = record.gmtime;
+            res.size = record.size;
+            res.header_size = record.header_size;
+            res.content_lines = record.content_lines;
+            res.cache_version = record.cache_version;
+            res.cache_crc = record.cache_crc;
+            message_guid_copy(&res.guid, &record.guid);
+            memcpy(res.item, record.crec.item, sizeof(res.item));
+            res.cache_len = record.crec.len;
+        }
+
+        /* reconstruct has gone away, nothing more to do */
+        if (retry_write(fd, &res, sizeof(struct parse_result)) < 0)
+            break;
+        if (res.cache_len &&
+            retry_write(fd, buf_base(record.crec.buf) + record.crec.offset,
+                        res.cache_len) < 0)
+            break;
+    }
+
+    /* don't run the parent's exit handlers or flush its stdio */
+    _exit(0);
+}
+
+static void parse_ahead_done(struct parse_ahead **pap)
+{
+    struct parse_ahead *pa = *pap;
+    unsigned i;
+    int w;
+
+    if (!pa) return;
+
+    /* closing the pipes stops any worker which is still going */
+    for (w = 0; w < pa->nworkers; w++) {
+        if (pa->fds[w] >= 0)
+            close(pa->fds[w]);
+    }
+    for (w = 0; w < pa->nworkers; w++) {
+        if (pa->pids[w] > 0) {
+            while (waitpid(pa->pids[w], NULL, 0) < 0 && errno == EINTR);
+        }
+    }
+
+    for (i = 0; i < pa->nitems; i++)
+        free(pa->items[i].fname);
+    free(pa->items);
+    free(pa->pids);
+    free(pa->fds);
+    buf_free(&pa->cache);
+    free(pa);
+
+    *pap = NULL;
+}
+
+/*
+ * Start workers parsing the files which reconstruct will need to parse:
+ * everything with RECONSTRUCT_ALWAYS_PARSE, otherwise just the files
+ * past last_uid which are going to be appended.
+ */
+static struct parse_ahead *parse_ahead_start(struct mailbox *mailbox,
+                                             const struct found_uids *files,
+                                             int flags)
+{
+    struct parse_ahead *pa;
+    unsigned i;
+    int w;
+
+    if (reconstruct_workers <= 0)
+        return NULL;
+
+#if defined ENABLE_OBJECTSTORE
+    /* archived files are fetched from the object store one at a time */
+    if (config_getswitch(IMAPOPT_OBJECT_STORAGE_ENABLED))
+        return NULL;
+#endif
+
+    pa = xzmalloc(sizeof(struct parse_ahead));
+    pa->items = xmalloc(files->nused * sizeof(struct parse_item));
+
+    for (i = 0; i < files->nused; i++) {
+        const struct found_uid *found = &files->found[i];
+        const char *fname;
+
+        /* reconstruct only ever uses the first copy of a UID */
+        if (!found->uid || (i && found->uid == files->found[i-1].uid))
+            continue;
+        if (!(flags & RECONSTRUCT_ALWAYS_PARSE) &&
+            found->uid <= mailbox->i.last_uid)
+            continue;
+
+        if (found->isarchive)
+            fname = mboxname_archivepath(mailbox->part, mailbox->name,
+                                         mailbox->uniqueid, found->uid);
+        else
+            fname = mboxname_datapath(mailbox->part, mailbox->name,
+                                      mailbox->uniqueid, found->uid);
+
+        pa->items[pa->nitems].uid = found->uid;
+        pa->items[pa->nitems].fname = xstrdup(fname);
+        pa->nitems++;
+    }
+
+    if (!pa->nitems) {
+        parse_ahead_done(&pa);
+        return NULL;
+    }
+
+    pa->nworkers = reconstruct_workers;
+    if ((unsigned) pa->nworkers > pa->nitems)
+        pa->nworkers = pa->nitems;
+    pa->pids = xzmalloc(pa->nworkers * sizeof(pid_t));
+    pa->fds = xmalloc(pa->nworkers * sizeof(int));
+    for (w = 0; w < pa->nworkers; w++)
+        pa->fds[w] = -1;
+
+    for (w = 0; w < pa->nworkers; w++) {
+        int pipefd[2];
+
+        if (pipe(pipefd) < 0) {
+            syslog(LOG_ERR, "IOERROR: pipe for reconstruct worker: %m");
+            goto fail;
+        }
+
+        pa->pids[w] = fork();
+        if (pa->pids[w] < 0) {
+            syslog(LOG_ERR, "IOERROR: fork for reconstruct worker: %m");
+            close(pipefd[0]);
+            close(pipefd[1]);
+            goto fail;
+        }
+
+        if (!pa->pids[w]) {
+            int other;
+
+            for (other = 0; other < w; other++)
+                close(pa->fds[other]);
+            close(pipefd[0]);
+            parse_ahead_worker(pa, w, pipefd[1]);
+        }
+
+        close(pipefd[1]);
+        pa->fds[w] = pipefd[0];
+    }
+
+    return pa;
+
+fail:
+    /* fall back to parsing inline */
+    parse_ahead_done(&pa);
+    return NULL;
+}
+
+/*
+ * Get the parsed record for fname from the workers.  Results for files
+ * the reconstruct turned out not to need are skipped.  Returns 1 with
+ * *rp set as message_parse() would, or 0 if the caller must parse the
+ * file itself.
+ */
+static int parse_ahead_get(struct parse_ahead *pa, uint32_t uid,
+                           const char *fname, struct index_record *record,
+                           int *rp)
+{
+    if (!pa) return 0;
+
+    while (pa->pos < pa->nitems && pa->items[pa->pos].uid <= uid) {
+        struct parse_item *item = &pa->items[pa->pos];
+        int fd = pa->fds[pa->pos % pa->nworkers];
+        struct parse_result res;
+
+        pa->pos++;
+
+        buf_reset(&pa->cache);
+        if (retry_read(fd, &res, sizeof(struct parse_result)) < 0 ||
+            res.uid != item->uid) {
+            goto broken;
+        }
+        if (res.cache_len) {
+            buf_ensure(&pa->cache, res.cache_len);
+            if (retry_read(fd, pa->cache.s, res.cache_len) < 0)
+                goto broken;
+            pa->cache.len = res.cache_len;
+        }
+
+        if (item->uid != uid || strcmp(item->fname, fname))
+            continue;
+
+        *rp = res.r;
+        if (res.r) return 1;
+
+        if (!record->internaldate)
+            record->internaldate = res.internaldate;
+        record->sentdate = res.sentdate;
+        record->gmtime = res.gmtime;
+        record->size = res.size;
+        record->header_size = res.header_size;
+        record->content_lines = res.content_lines;
+        record->cache_version = res.cache_version;
+        record->cache_crc = res.cache_crc;
+        message_guid_copy(&record->guid, &res.guid);
+        memcpy(record->crec.item, res.item, sizeof(res.item));
+        record->crec.buf = &pa->cache;
+        record->crec.offset = 0;
+        record->crec.len = res.cache_len;
+
+        return 1;
+    }
+
+    return 0;
+
+broken:
+    syslog(LOG_ERR, "reconstruct worker for uid %u went away, "
+                    "parsing inline", pa->items[pa->pos-1].uid);
+    pa->pos = pa->nitems;
+    return 0;
+}
+
 static int mailbox_reconstruct_compare_update(struct mailbox *mailbox,
                                               struct index_record *record,
                                               bit32 *valid_user_flags,
                                               int flags, int have_file,
-                                              struct found_uids *discovered)
+                                              struct found_uids *discovered,
+                                              struct parse_ahead *pa)
 {
     const char *fname = mailbox_record_fname(mailbox, record);
     int r = 0;
@@ -5843,7 +6125,8 @@ static int mailbox_reconstruct_compare_update(struct mailbox *mailbox,
         /* set NULL in case parse finds a new value */
         record->internaldate = 0;
 
-        r = message_parse(fname, record);
+        if (!parse_ahead_get(pa, record->uid, fname, record, &r))
+            r = message_parse(fname, record);
         if (r) goto out;
 
         /* unchanged, keep the old value */
@@ -5991,7 +6274,7 @@ out:
 
 
 static int mailbox_reconstruct_append(struct mailbox *mailbox, uint32_t uid, int isarchive,
-                                      int flags)
+                                      int flags, struct parse_ahead *pa)
 {
     /* XXX - support archived */
     const char *fname;
@@ -6057,7 +6340,8 @@ static int mailbox_reconstruct_append(struct mailbox *mailbox, uint32_t uid, int
         goto out;
     }
 
-    r = message_parse(fname, &record);
+    if (!parse_ahead_get(pa, uid, fname, &record, &r))
+        r = message_parse(fname, &record);
     if (r) goto out;
 
     if (isarchive)
@@ -6300,6 +6584,7 @@ EXPORTED int mailbox_reconstruct(const char *name, int flags)
     struct found_uids discovered = FOUND_UIDS_INITIALIZER;
     struct found_uids annots = FOUND_UIDS_INITIALIZER;
     struct found_uids delannots = FOUND_UIDS_INITIALIZER;
+    struct parse_ahead *pa = NULL;
     struct index_header old_header;
     int have_file;
     uint32_t last_seen_uid = 0;
@@ -6353,6 +6638,8 @@ EXPORTED int mailbox_reconstruct(const char *name, int flags)
     r = find_annots(mailbox, &annots);
     if (r) goto close;
 
+    pa = parse_ahead_start(mailbox, &files, flags);
+
     uint32_t recno;
     struct index_record record;
     for (recno = 1; recno <= mailbox->i.num_records; recno++) {
@@ -6422,7 +6709,7 @@ EXPORTED int mailbox_reconstruct(const char *name, int flags)
         r = mailbox_reconstruct_compare_update(mailbox, &record,
                                                valid_user_flags,
                                                flags, have_file,
-                                               &discovered);
+                                               &discovered, pa);
         if (r) goto close;
     }
 
@@ -6437,7 +6724,7 @@ EXPORTED int mailbox_reconstruct(const char *name, int flags)
     while (files.pos < files.nused) {
         uint32_t uid = files.found[files.pos].uid;
         r = mailbox_reconstruct_append(mailbox, files.found[files.pos].uid,
-                                       files.found[files.pos].isarchive, flags);
+                                       files.found[files.pos].isarchive, flags, pa);
         if (r) goto close;
         files.pos++;
 
@@ -6464,7 +6751,7 @@ EXPORTED int mailbox_reconstruct(const char *name, int flags)
     /* handle new list - note, we don't copy annotations for these */
     while (discovered.pos < discovered.nused) {
         r = mailbox_reconstruct_append(mailbox, discovered.found[discovered.pos].uid,
-                                       discovered.found[discovered.pos].isarchive, flags);
+                                       discovered.found[discovered.pos].isarchive, flags, pa);
         if (r) goto close;
         discovered.pos++;
     }
@@ -6510,6 +6797,7 @@ EXPORTED int mailbox_reconstruct(const char *name, int flags)
     }
 
 close:
+    parse_ahead_done(&pa);
     mailbox_iter_done(&iter);
     free_found(&files);
     free_found(&discovered);
@@ -599,6 +599,7 @@ extern int mailbox_rename_cleanup(struct mailbox **mailboxptr, int isinbox);
 extern int mailbox_copyfile(const char *from, const char *to, int nolink);
 
 extern int mailbox_reconstruct(const char *name, int flags);
+extern void mailbox_reconstruct_set_workers(int nworkers);
 extern void mailbox_make_uniqueid(struct mailbox *mailbox);
 
 extern int mailbox_setversion(struct mailbox *mailbox, int version);
@@ -103,6 +103,32 @@ static int enable_subfolder = 1;
 static int enabled_events = 0;
 static unsigned long extra_params;
 
+/* formatted notifications waiting to be flushed to the sink */
+struct evqueue_entry {
+    enum event_type type;
+    json_t *msg;
+};
+
+static struct evqueue {
+    struct evqueue_entry *ring;
+    unsigned size;              /* capacity of the ring, 0 = unbuffered */
+    unsigned head;              /* oldest pending entry */
+    unsigned count;             /* number of pending entries */
+    unsigned batch;             /* max entries per sink call */
+    int coalesce;
+    int defer;                  /* flush only on mboxevent_flush() */
+    unsigned long sent;
+    unsigned long coalesced;
+    unsigned long dropped;
+    unsigned long logged_dropped;
+} evqueue;
+
+static mboxevent_sink_t *evsink = NULL;
+static void *evsink_rock = NULL;
+
+static void evqueue_flush(int nonblock);
+static void evqueue_atexit(void);
+
 static struct mboxevent event_template =
 { 0,
   /* ordered to optimize the parsing of the notification message */
@@ -184,7 +210,7 @@ static struct mboxevent event_template =
   STRARRAY_INITIALIZER, { 0, 0 }, NULL, STRARRAY_INITIALIZER, NULL, NULL, NULL
 };
 
-static char *json_formatter(enum event_type type, struct event_parameter params[]);
+static json_t *json_formatter(enum event_type type, struct event_parameter params[]);
 static int filled_params(enum event_type type, struct mboxevent *mboxevent);
 static int mboxevent_expected_param(enum event_type type, enum event_param param);
 
@@ -237,9 +263,44 @@ EXPORTED int mboxevent_init(void)
     if (groups & IMAP_ENUM_EVENT_GROUPS_APPLEPUSHSERVICE)
         enabled_events |= APPLEPUSHSERVICE_EVENTS;
 
+    /* notifications are queued and flushed to notifyd in batches */
+    evqueue.batch = config_getint(IMAPOPT_EVENT_BATCH_SIZE);
+    if (evqueue.batch < 1) evqueue.batch = 1;
+    evqueue.coalesce = config_getswitch(IMAPOPT_EVENT_COALESCE);
+    if (!evqueue.ring) {
+        /* the ring can't be resized once it holds anything */
+        evqueue.size = config_getint(IMAPOPT_EVENT_QUEUE_SIZE);
+        if (evqueue.size) {
+            evqueue.ring =
+                xzmalloc(evqueue.size * sizeof(struct evqueue_entry));
+            atexit(evqueue_atexit);
+        }
+    }
+
     return enabled_events;
 }
 
+EXPORTED void mboxevent_set_sink(mboxevent_sink_t *sink, void *rock)
+{
+    evsink = sink;
+    evsink_rock = rock;
+}
+
+EXPORTED void mboxevent_defer(int defer)
+{
+    evqueue.defer = defer;
+    if (!defer) evqueue_flush(0);
+}
+
+EXPORTED void mboxevent_flush(void)
+{
+    /* send what notifyd will take right now, then wait for it to take
+     * the rest: the client already has its answer, and nothing must be
+     * left behind while this process sits idle (or in IDLE) */
+    evqueue_flush(1);
+    if (evqueue.count) evqueue_flush(0);
+}
+
 EXPORTED void mboxevent_setnamespace(struct namespace *n)
 {
     namespace = *n;
@@ -589,14 +650,233 @@ static int mboxevent_expected_param(enum event_type type, enum event_param param
     return type & (MESSAGE_EVENTS|FLAGS_EVENTS);
 }
 
+static int evqueue_default_sink(const char *method, int nmsg,
+                                const char **messages, int nonblock,
+                                void *rock __attribute__((unused)))
+{
+    return notify_batch(method, "EVENT", nmsg, messages, nonblock);
+}
+
+static void evqueue_log_dropped(void)
+{
+    if (evqueue.dropped != evqueue.logged_dropped) {
+        syslog(LOG_WARNING,
+               "mboxevent: dropped %lu notifications (%lu sent, %lu coalesced)",
+               evqueue.dropped - evqueue.logged_dropped,
+               evqueue.sent, evqueue.coalesced);
+        evqueue.logged_dropped = evqueue.dropped;
+    }
+}
+
+static void evqueue_drop_oldest(unsigned n)
+{
+    while (n-- && evqueue.count) {
+        json_decref(evqueue.ring[evqueue.head].msg);
+        evqueue.ring[evqueue.head].msg = NULL;
+        evqueue.head = (evqueue.head + 1) % evqueue.size;
+        evqueue.count--;
+        evqueue.dropped++;
+    }
+}
+
+/*
+ * Flush pending notifications to the sink, evqueue.batch at a time.
+ * With nonblock set, stop as soon as the sink pushes back and leave
+ * the rest queued for the next flush.
+ */
+static void evqueue_flush(int nonblock)
+{
+    mboxevent_sink_t *sink = evsink ? evsink : evqueue_default_sink;
+    const char **messages;
+    unsigned i, n;
+    int r;
+
+    if (!evqueue.count) return;
+
+    messages = xmalloc(evqueue.batch * sizeof(const char *));
+
+    while (evqueue.count) {
+        n = evqueue.count < evqueue.batch ? evqueue.count : evqueue.batch;
+
+        for (i = 0; i < n; i++) {
+            struct evqueue_entry *e =
+                &evqueue.ring[(evqueue.head + i) % evqueue.size];
+            messages[i] = json_dumps(e->msg, JSON_PRESERVE_ORDER|JSON_COMPACT);
+        }
+
+        r = sink(notifier, n, messages, nonblock, evsink_rock);
+
+        for (i = 0; i < n; i++) free((char *) messages[i]);
+
+        if (r < 0) {
+            /* the sink is unusable, don't keep piling up behind it */
+            evqueue_drop_oldest(n);
+            break;
+        }
+
+        evqueue.sent += r;
+        for (i = 0; i < (unsigned) r; i++) {
+            json_decref(evqueue.ring[evqueue.head].msg);
+            evqueue.ring[evqueue.head].msg = NULL;
+            evqueue.head = (evqueue.head + 1) % evqueue.size;
+            evqueue.count--;
+        }
+
+        /* backpressure: try again on the next flush */
+        if ((unsigned) r < n) break;
+    }
+
+    free(messages);
+
+    evqueue_log_dropped();
+}
+
+#define EVQUEUE_EXIT_TRIES  10
+#define EVQUEUE_EXIT_WAIT   100000  /* usec between tries at exit */
+
+/*
+ * Don't let a stuck notifyd hold up shutdown: retry without blocking
+ * for up to a second, then give up on whatever is left.
+ */
+static void evqueue_atexit(void)
+{
+    int tries;
+
+    for (tries = 0; evqueue.count && tries < EVQUEUE_EXIT_TRIES; tries++) {
+        if (tries) usleep(EVQUEUE_EXIT_WAIT);
+        evqueue_flush(1);
+    }
+
+    if (evqueue.count) {
+        evqueue_drop_oldest(evqueue.count);
+        evqueue_log_dropped();
+    }
+}
+
+/* parameters which may differ between two coalesced notifications */
+static int evqueue_mergeable_param(const char *name)
+{
+    static const char * const mergeable[] = {
+        "timestamp", "uidset", "vnd.cmu.midset", "modseq", "messages",
+        "vnd.cmu.unseenMessages", "uidnext", "vnd.fastmail.convExists",
+        "vnd.fastmail.convUnseen", "vnd.fastmail.counters", NULL
+    };
+    int i;
+
+    for (i = 0; mergeable[i]; i++) {
+        if (!strcmp(name, mergeable[i])) return 1;
+    }
+
+    return 0;
+}
+
+static int evqueue_same_params(json_t *a, json_t *b)
+{
+    const char *name;
+    json_t *val;
+
+    json_object_foreach(a, name, val) {
+        if (evqueue_mergeable_param(name)) continue;
+        if (!json_equal(val, json_object_get(b, name))) return 0;
+    }
+    json_object_foreach(b, name, val) {
+        if (evqueue_mergeable_param(name)) continue;
+        if (!json_object_get(a, name)) return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Fold msg into the most recently queued notification if both are
+ * message or flag events on the same mailbox which only differ by
+ * their set of UIDs.  The newest mailbox counters win.
+ */
+static int evqueue_coalesce(enum event_type type, json_t *msg)
+{
+    struct evqueue_entry *last;
+    struct seqset *uids;
+    const char *name;
+    json_t *val, *midset;
+    char *uidset;
+
+    if (!evqueue.coalesce || !evqueue.count) return 0;
+
+    if (!(type & (FLAGS_EVENTS|EVENT_MESSAGE_EXPUNGE|EVENT_MESSAGE_EXPIRE)))
+        return 0;
+
+    last = &evqueue.ring[(evqueue.head + evqueue.count - 1) % evqueue.size];
+    if (last->type != type) return 0;
+
+    if (!json_is_string(json_object_get(last->msg, "uidset")) ||
+        !json_is_string(json_object_get(msg, "uidset")))
+        return 0;
+
+    if (!evqueue_same_params(last->msg, msg)) return 0;
+
+    /* parsing the second set into the first one merges their ranges */
+    uids = seqset_parse(json_string_value(json_object_get(last->msg, "uidset")),
+                        NULL, 0);
+    seqset_parse(json_string_value(json_object_get(msg, "uidset")), uids, 0);
+    uidset = seqset_cstring(uids);
+    seqset_free(uids);
+
+    midset = json_object_get(last->msg, "vnd.cmu.midset");
+    if (json_is_array(midset))
+        json_array_extend(midset, json_object_get(msg, "vnd.cmu.midset"));
+
+    json_object_foreach(msg, name, val) {
+        if (!strcmp(name, "uidset") || !strcmp(name, "vnd.cmu.midset"))
+            continue;
+        json_object_set(last->msg, name, val);
+    }
+    json_object_set_new(last->msg, "uidset", json_string(uidset));
+    free(uidset);
+
+    /* RFC 5423: modseq only refers to one message */
+    json_object_del(last->msg, "modseq");
+
+    json_decref(msg);
+    evqueue.coalesced++;
+
+    return 1;
+}
+
+static void evqueue_push(enum event_type type, json_t *msg)
+{
+    struct evqueue_entry *e;
+
+    if (!evqueue.size) {
+        /* unbuffered: send it right away, as it always used to be */
+        char *formatted_message =
+            json_dumps(msg, JSON_PRESERVE_ORDER|JSON_COMPACT);
+        notify(notifier, "EVENT", NULL, NULL, NULL, 0, NULL,
+               formatted_message, NULL);
+        free(formatted_message);
+        json_decref(msg);
+        return;
+    }
+
+    if (evqueue_coalesce(type, msg)) return;
+
+    if (evqueue.count == evqueue.size) {
+        /* make room: wait for the sink, and drop if it still can't keep up */
+        evqueue_flush(0);
+        if (evqueue.count == evqueue.size) evqueue_drop_oldest(1);
+    }
+
+    e = &evqueue.ring[(evqueue.head + evqueue.count) % evqueue.size];
+    e->type = type;
+    e->msg = msg;
+    evqueue.count++;
+}
+
 #define TIMESTAMP_MAX 32
 EXPORTED void mboxevent_notify(struct mboxevent **mboxevents)
 {
     enum event_type type;
     struct mboxevent *event;
     char stimestamp[TIMESTAMP_MAX+1];
-    char *formatted_message;
-    const char *fname = NULL;
 
     /* nothing to notify */
     if (!*mboxevents)
@@ -705,14 +985,16 @@ EXPORTED void mboxevent_notify(struct mboxevent **mboxevents)
             assert(filled_params(type, event));
 
             /* notification is ready to send */
-            formatted_message = json_formatter(type, event->params);
-            notify(notifier, "EVENT", NULL, NULL, NULL, 0, NULL, formatted_message, fname);
-
-            free(formatted_message);
+            evqueue_push(type, json_formatter(type, event->params));
         }
         while (strarray_size(&event->flagnames) > 0);
     }
 
+    /* hand the notifications over now unless the caller flushes them
+     * itself once the client has been answered */
+    if (!evqueue.defer || evqueue.count >= evqueue.batch)
+        evqueue_flush(evqueue.defer);
+
     return;
 }
 
@@ -1355,10 +1637,10 @@ static const char *event_to_name(enum event_type type)
     return NULL;
 }
 
-static char *json_formatter(enum event_type type, struct event_parameter params[])
+static json_t *json_formatter(enum event_type type, struct event_parameter params[])
 {
     int param, ival;
-    char *val, *ptr, *result;
+    char *val, *ptr;
     json_t *event_json = json_object();
     json_t *jarray;
 
@@ -1422,11 +1704,7 @@ static char *json_formatter(enum event_type type, struct event_parameter params[
         }
     }
 
-    result = json_dumps(event_json, JSON_PRESERVE_ORDER|JSON_COMPACT);
-    json_decref(event_json);
-
-    return result;
-
+    return event_json;
 }
 
 #ifdef NDEBUG
@@ -1526,6 +1804,19 @@ EXPORTED void mboxevent_notify(struct mboxevent **mboxevents __attribute__((unus
 {
 }
 
+EXPORTED void mboxevent_set_sink(mboxevent_sink_t *sink __attribute__((unused)),
+                                 void *rock __attribute__((unused)))
+{
+}
+
+EXPORTED void mboxevent_defer(int defer __attribute__((unused)))
+{
+}
+
+EXPORTED void mboxevent_flush(void)
+{
+}
+
 void mboxevent_add_flags(struct mboxevent *event __attribute__((unused)),
                          char *flagnames[MAX_USER_FLAGS] __attribute__((unused)),
                          bit32 system_flags __attribute__((unused)),
@@ -244,6 +244,30 @@ struct mboxevent *mboxevent_enqueue(enum event_type type,
  */
 void mboxevent_notify(struct mboxevent **mboxevents);
 
+/*
+ * Destination of batched notifications.  Returns the number of messages
+ * consumed, fewer than nmsg to push back, or -1 if it is unusable.
+ */
+typedef int mboxevent_sink_t(const char *method, int nmsg,
+                             const char **messages, int nonblock, void *rock);
+
+/*
+ * Replace the notifyd sink for queued notifications (NULL to restore)
+ */
+void mboxevent_set_sink(mboxevent_sink_t *sink, void *rock);
+
+/*
+ * If set, queued notifications are only sent by mboxevent_flush() or
+ * once a full batch is pending, rather than at the end of mboxevent_notify()
+ */
+void mboxevent_defer(int defer);
+
+/*
+ * Send the queued notifications, first without waiting on a busy sink
+ * and then, for whatever it pushed back, waiting for it
+ */
+void mboxevent_flush(void);
+
 /*
  * Release any allocated resources of this given event
  */
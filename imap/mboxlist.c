@@ -2244,7 +2244,7 @@ mboxlist_sync_setacls(const char *name, const char *newacl)
 }
 
 struct find_rock {
-    ptrarray_t globs;
+    globset *globs;
     struct namespace *namespace;
     const char *userid;
     const char *domain;
@@ -2260,8 +2260,56 @@ struct find_rock {
     int matchlen;
     findall_cb *proc;
     void *procrock;
+    struct mpool *pool;     /* scratch for the current key, if set */
+    struct buf skip;        /* key prefix of a subtree the patterns can't reach */
+    int skip_done;          /* nothing more to learn from that subtree */
 };
 
+/* would the LIST code show this mailbox like any other?  remote and
+ * DAV mailboxes get proxied or filtered further up, so they can't
+ * stand in for the rest of a skipped subtree */
+static int find_isplain(struct find_rock *rock)
+{
+    const strarray_t *boxes;
+    const char *top;
+
+    if (rock->mbentry->mbtype & (MBTYPE_REMOTE | MBTYPES_NONIMAP)) return 0;
+
+    boxes = mbname_boxes(rock->mbname);
+    if (!strarray_size(boxes)) return 1;
+
+    top = strarray_nth(boxes, 0);
+    if (!strcmpsafe(top, config_getstring(IMAPOPT_CALENDARPREFIX))) return 0;
+    if (!strcmpsafe(top, config_getstring(IMAPOPT_ADDRESSBOOKPREFIX))) return 0;
+    if (!strcmpsafe(top, config_getstring(IMAPOPT_DAVDRIVEPREFIX))) return 0;
+    if (!strcmpsafe(top, config_getstring(IMAPOPT_DAVNOTIFICATIONSPREFIX))) return 0;
+
+    return 1;
+}
+
+/* can we decide for the whole subtree below this key from its name?
+ * only if the children's external names extend this one's, which
+ * isn't true for INBOX and the altnamespace INBOX folders, for
+ * DELETED names, or for names shown with a domain suffix */
+static int find_canprune(struct find_rock *rock)
+{
+    if (rock->issubs) return 0;
+
+    switch (rock->mb_category) {
+    case MBNAME_OWNER:
+    case MBNAME_OTHERUSER:
+    case MBNAME_SHARED:
+        break;
+    default:
+        return 0;
+    }
+
+    if (mbname_isdeleted(rock->mbname)) return 0;
+    if (strcmpsafe(rock->domain, mbname_domain(rock->mbname))) return 0;
+
+    return 1;
+}
+
 /* return non-zero if we like this one */
 static int find_p(void *rockp,
                   const char *key, size_t keylen,
@@ -2269,16 +2317,42 @@ static int find_p(void *rockp,
 {
     struct find_rock *rock = (struct find_rock *) rockp;
     char intname[MAX_MAILBOX_PATH+1];
-    int i;
+    int inskip = 0;
 
     /* skip any $RACL or future $ space keys */
     if (key[0] == '$') return 0;
 
+    /* the mailbox sort keeps a subtree together, so once we're past
+     * the end of the one we're skipping, forget about it */
+    if (rock->skip.len) {
+        if (keylen > rock->skip.len && !memcmp(key, rock->skip.s, rock->skip.len)) {
+            if (rock->skip_done) return 0;
+            inskip = 1;
+        }
+        else {
+            buf_reset(&rock->skip);
+        }
+    }
+
+    /* shared folders are never under user., so don't parse those */
+    if (rock->mb_category == MBNAME_SHARED) {
+        const char *p = memchr(key, '!', keylen);
+        size_t off = p ? (size_t)(p - key) + 1 : 0;
+        if (keylen - off >= 5 && !memcmp(key + off, "user.", 5)) return 0;
+    }
+
     memcpy(intname, key, keylen);
     intname[keylen] = 0;
 
     assert(!rock->mbname);
-    rock->mbname = mbname_from_intname(intname);
+    if (rock->pool) {
+        /* nothing from the previous key is still in use */
+        mpool_reset(rock->pool);
+        rock->mbname = mbname_from_intname_pool(rock->pool, intname);
+    }
+    else {
+        rock->mbname = mbname_from_intname(intname);
+    }
 
     if (!rock->isadmin && !config_getswitch(IMAPOPT_CROSSDOMAINS)) {
         /* don't list mailboxes outside of the default domain */
@@ -2296,11 +2370,17 @@ static int find_p(void *rockp,
     const char *extname = mbname_extname(rock->mbname, rock->namespace, rock->userid);
     if (!extname) goto nomatch;
 
-    int matchlen = 0;
-    for (i = 0; i < rock->globs.count; i++) {
-        glob *g = ptrarray_nth(&rock->globs, i);
-        int thismatch = glob_test(g, extname);
-        if (thismatch > matchlen) matchlen = thismatch;
+    int matchlen = globset_test(rock->globs, extname);
+
+    /* If no pattern can match below this name, every child can only
+     * partially match the same part of it that this name does.  Let
+     * one child through for \HasChildren and skip the rest, or skip
+     * them all if they can't match anything. */
+    if (!inskip && find_canprune(rock)
+        && !globset_can_descend(rock->globs, extname)) {
+        buf_setmap(&rock->skip, key, keylen);
+        buf_putc(&rock->skip, '.');
+        rock->skip_done = !matchlen;
     }
 
     /* If its not a match, skip it -- partial matches are ok. */
@@ -2330,6 +2410,9 @@ static int find_p(void *rockp,
     }
 
 good:
+    if (inskip && find_isplain(rock))
+        rock->skip_done = 1;
+
     return 1;
 
 nomatch:
@@ -2347,8 +2430,8 @@ static int find_cb(void *rockp,
 {
     struct find_rock *rock = (struct find_rock *) rockp;
     char *testname = NULL;
+    char *freeme = NULL;
     int r = 0;
-    int i;
 
     if (rock->checkmboxlist && !rock->mbentry) {
         r = mboxlist_lookup(mbname_intname(rock->mbname), &rock->mbentry, NULL);
@@ -2359,7 +2442,10 @@ static int find_cb(void *rockp,
     }
 
     const char *extname = mbname_extname(rock->mbname, rock->namespace, rock->userid);
-    testname = xstrndup(extname, rock->matchlen);
+    if (rock->pool)
+        testname = mpool_strndup(rock->pool, extname, rock->matchlen);
+    else
+        testname = freeme = xstrndup(extname, rock->matchlen);
 
     struct findall_data fdata = { testname, rock->mb_category, rock->mbentry, NULL };
 
@@ -2371,12 +2457,7 @@ static int find_cb(void *rockp,
             *p = '\0';
 
             /* only if this expression could fully match */
-            int matchlen = 0;
-            for (i = 0; i < rock->globs.count; i++) {
-                glob *g = ptrarray_nth(&rock->globs, i);
-                int thismatch = glob_test(g, testname);
-                if (thismatch > matchlen) matchlen = thismatch;
-            }
+            int matchlen = globset_test(rock->globs, testname);
 
             if (matchlen == (int)strlen(testname)) {
                 r = (*rock->proc)(&fdata, rock->procrock);
@@ -2395,7 +2476,7 @@ static int find_cb(void *rockp,
     r = (*rock->proc)(&fdata, rock->procrock);
 
  done:
-    free(testname);
+    free(freeme);
     mboxlist_entry_free(&rock->mbentry);
     mbname_free(&rock->mbname);
     return r;
@@ -2646,6 +2727,10 @@ EXPORTED int mboxlist_usermboxtree(const char *userid, mboxlist_cb *proc,
 static int mboxlist_find_category(struct find_rock *rock, const char *prefix, size_t len)
 {
     int r = 0;
+
+    /* anything we were skipping belonged to the last category */
+    buf_reset(&rock->skip);
+
     if (!rock->issubs && !rock->isadmin && !cyrusdb_fetch(rock->db, "$RACL", 5, NULL, NULL, NULL)) {
         /* we're using reverse ACLs */
         struct buf buf = BUF_INITIALIZER;
@@ -2704,10 +2789,11 @@ static int mboxlist_do_find(struct find_rock *rock, const strarray_t *patterns)
 
     if (patterns->count < 1) return 0; /* nothing to do */
 
-    for (i = 0; i < patterns->count; i++) {
-        glob *g = glob_init(strarray_nth(patterns, i), rock->namespace->hier_sep);
-        ptrarray_append(&rock->globs, g);
-    }
+    /* every key we look at is parsed into this, rather than the heap */
+    rock->pool = new_mpool(0);
+
+    rock->globs = globset_init((const char * const *) patterns->data,
+                               patterns->count, rock->namespace->hier_sep);
 
     if (config_virtdomains && userid && (p = strchr(userid, '@'))) {
         userlen = p - userid;
@@ -2798,6 +2884,7 @@ static int mboxlist_do_find(struct find_rock *rock, const strarray_t *patterns)
 
         /* iterate through all the mailboxes under the user's inbox */
         rock->mb_category = MBNAME_OWNER;
+        buf_reset(&rock->skip);
         r = cyrusdb_foreach(rock->db, inbox, inboxlen+1, &find_p, &find_cb, rock, NULL);
         if (r == CYRUSDB_DONE) r = 0;
         if (r) goto done;
@@ -2819,6 +2906,7 @@ static int mboxlist_do_find(struct find_rock *rock, const strarray_t *patterns)
 
             /* special case any other altprefix stuff */
             rock->mb_category = MBNAME_ALTPREFIX;
+            buf_reset(&rock->skip);
             r = cyrusdb_foreach(rock->db, inbox, inboxlen+1, &find_p, &find_cb, rock, NULL);
         skipalt: /* we got a done, so skip out of the foreach early */
             if (r == CYRUSDB_DONE) r = 0;
@@ -2887,11 +2975,11 @@ static int mboxlist_do_find(struct find_rock *rock, const strarray_t *patterns)
     r = (*rock->proc)(NULL, rock->procrock);
 
  done:
-    for (i = 0; i < rock->globs.count; i++) {
-        glob *g = ptrarray_nth(&rock->globs, i);
-        glob_free(&g);
-    }
-    ptrarray_fini(&rock->globs);
+    globset_free(&rock->globs);
+    buf_free(&rock->skip);
+
+    free_mpool(rock->pool);
+    rock->pool = NULL;
 
     return r;
 }
@@ -2965,15 +3053,13 @@ EXPORTED int mboxlist_findone(struct namespace *namespace,
     }
 
     mbname_t *mbname = mbname_from_intname(intname);
-    glob *g = glob_init(mbname_extname(mbname, namespace, userid),
-                        namespace->hier_sep);
-    ptrarray_append(&cbrock.globs, g);
+    const char *extname = mbname_extname(mbname, namespace, userid);
+    cbrock.globs = globset_init(&extname, 1, namespace->hier_sep);
     mbname_free(&mbname);
 
     r = cyrusdb_forone(cbrock.db, intname, strlen(intname), &find_p, &find_cb, &cbrock, NULL);
 
-    glob_free(&g);
-    ptrarray_fini(&cbrock.globs);
+    globset_free(&cbrock.globs);
 
     return r;
 }
@@ -96,6 +96,10 @@ struct mbname_parts {
     char *intname;
     char *extname;
     char *recipient;
+
+    /* set while the master data and intname live in a caller's mpool */
+    struct mpool *pool;
+    int inpool;             /* the struct itself always does */
 };
 
 #define XX 127
@@ -259,8 +263,23 @@ EXPORTED void mboxname_release(struct mboxlock **mboxlockptr)
 
 /******************** mbname stuff **********************/
 
+/* move pooled parts to the heap before they get modified or freed */
+static void _mbunpool(mbname_t *mbname)
+{
+    if (!mbname->pool) return;
+
+    if (mbname->boxes) mbname->boxes = strarray_dup(mbname->boxes);
+    mbname->localpart = xstrdupnull(mbname->localpart);
+    mbname->domain = xstrdupnull(mbname->domain);
+    mbname->intname = xstrdupnull(mbname->intname);
+
+    mbname->pool = NULL;
+}
+
 static void _mbdirty(mbname_t *mbname)
 {
+    _mbunpool(mbname);
+
     free(mbname->userid);
     free(mbname->intname);
     free(mbname->extname);
@@ -543,6 +562,86 @@ EXPORTED mbname_t *mbname_from_intname(const char *intname)
     return mbname;
 }
 
+/*
+ * Like mbname_from_intname(), but the parts are carved out of 'pool'
+ * instead of being allocated one by one, for callers like LIST that
+ * parse every key in mailboxes.db and throw each name away before the
+ * next.  The result must still go through mbname_free() (which releases
+ * any cached values) before the pool is reset or freed.
+ */
+EXPORTED mbname_t *mbname_from_intname_pool(struct mpool *pool, const char *intname)
+{
+    mbname_t *mbname;
+    strarray_t *boxes;
+    const char *dp;
+    const char *p;
+    int n = 1;
+
+    if (!intname || !*intname)
+        return mbname_from_intname(intname);
+
+    mbname = mpool_malloc(pool, sizeof(mbname_t));
+    memset(mbname, 0, sizeof(mbname_t));
+    mbname->pool = pool;
+    mbname->inpool = 1;
+
+    mbname->intname = mpool_strdup(pool, intname);
+
+    p = strchr(intname, '!');
+    if (p) {
+        size_t len = p - intname;
+        if (!config_defdomain || strlen(config_defdomain) != len ||
+            strncmp(intname, config_defdomain, len))
+            mbname->domain = mpool_strndup(pool, intname, len);
+        intname = p+1;
+    }
+
+    for (p = intname; *p; p++)
+        if (*p == '.') n++;
+
+    boxes = mpool_malloc(pool, sizeof(strarray_t));
+    memset(boxes, 0, sizeof(strarray_t));
+    boxes->data = mpool_malloc(pool, (n+1) * sizeof(char *));
+
+    /* same as splitting on '.': empty boxes are dropped */
+    for (p = intname; *p; ) {
+        const char *end = strchr(p, '.');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+
+        if (len) {
+            char *box = mpool_strndup(pool, p, len);
+            char *q;
+            for (q = box; *q; q++)
+                if (*q == '^') *q = '.';
+            boxes->data[boxes->count++] = box;
+        }
+
+        p += len;
+        if (*p) p++;
+    }
+    boxes->data[boxes->count] = NULL;
+    mbname->boxes = boxes;
+
+    dp = config_getstring(IMAPOPT_DELETEDPREFIX);
+
+    if (boxes->count > 2 && !strcmpsafe(boxes->data[0], dp)) {
+        mbname->is_deleted = strtoul(boxes->data[boxes->count-1], NULL, 16);
+        boxes->data++;
+        boxes->count -= 2;
+        boxes->data[boxes->count] = NULL;
+    }
+
+    if (boxes->count > 1 && !strcmpsafe(boxes->data[0], "user")) {
+        mbname->localpart = boxes->data[1];
+        boxes->data += 2;
+        boxes->count -= 2;
+    }
+
+    boxes->alloc = boxes->count;
+
+    return mbname;
+}
+
 EXPORTED mbname_t *mbname_from_extname(const char *extname, const struct namespace *ns, const char *userid)
 {
     int crossdomains = config_getswitch(IMAPOPT_CROSSDOMAINS) && !ns->isadmin;
@@ -741,19 +840,23 @@ EXPORTED void mbname_free(mbname_t **mbnamep)
 
     *mbnamep = NULL;
 
-    strarray_free(mbname->boxes);
-    free(mbname->localpart);
-    free(mbname->domain);
+    /* pooled parts go with the pool */
+    if (!mbname->pool) {
+        strarray_free(mbname->boxes);
+        free(mbname->localpart);
+        free(mbname->domain);
+        free(mbname->intname);
+    }
 
     /* cached values */
     free(mbname->userid);
-    free(mbname->intname);
     free(mbname->extname);
     free(mbname->extuserid);
     free(mbname->recipient);
 
     /* thing itself */
-    free(mbname);
+    if (!mbname->inpool)
+        free(mbname);
 }
 
 EXPORTED char *mboxname_to_userid(const char *intname)
@@ -901,7 +1004,12 @@ EXPORTED const char *mbname_recipient(const mbname_t *mbname, const struct names
     mbname_t *backdoor = (mbname_t *)mbname;
     free(backdoor->recipient);
     backdoor->recipient = buf_release(&buf);
-    backdoor->extns = ns;
+    if (backdoor->extns != ns) {
+        /* the cached extname shares extns */
+        free(backdoor->extname);
+        backdoor->extname = NULL;
+        backdoor->extns = ns;
+    }
 
     buf_free(&buf);
 
@@ -970,6 +1078,18 @@ EXPORTED const char *mbname_category_prefix(int category, const struct namespace
     return NULL;
 }
 
+/* the domain of 'userid' as mbname_from_userid() would record it,
+ * without building a whole mbname for every name we convert */
+static const char *_userid_domain(const char *userid)
+{
+    const char *p = userid ? strchr(userid, '@') : NULL;
+
+    if (!p || !strcmpsafe(p+1, config_defdomain))
+        return NULL;
+
+    return p+1;
+}
+
 EXPORTED const char *mbname_extname(const mbname_t *mbname, const struct namespace *ns, const char *userid)
 {
     int crossdomains = config_getswitch(IMAPOPT_CROSSDOMAINS) && !ns->isadmin;
@@ -985,15 +1105,22 @@ EXPORTED const char *mbname_extname(const mbname_t *mbname, const struct namespa
 
     /* have to zero out any existing value just in case we drop through */
     mbname_t *backdoor = (mbname_t *)mbname;
-    if (backdoor->extname) {
-        free(backdoor->extname);
-        backdoor->extname = NULL;
+    free(backdoor->extname);
+    backdoor->extname = NULL;
+
+    /* remember what it was built for, so the next call can reuse it;
+     * the cached recipient shares extns, so it has to go if that changes */
+    if (backdoor->extns != ns) {
+        free(backdoor->recipient);
+        backdoor->recipient = NULL;
         backdoor->extns = ns;
+    }
+    if (strcmpsafe(backdoor->extuserid, userid)) {
         free(backdoor->extuserid);
         backdoor->extuserid = xstrdupnull(userid);
     }
 
-    mbname_t *userparts = mbname_from_userid(userid);
+    const char *userdomain = _userid_domain(userid);
     strarray_t *boxes = strarray_dup(mbname_boxes(mbname));
 
     if (ns->isalt) {
@@ -1029,7 +1156,7 @@ EXPORTED const char *mbname_extname(const mbname_t *mbname, const struct namespa
             /* domains go on the top level folder */
             if (crossdomains) {
                 const char *domain = mbname_domain(mbname);
-                if (!cdother || strcmpsafe(domain, mbname_domain(userparts))) {
+                if (!cdother || strcmpsafe(domain, userdomain)) {
                     if (!domain) domain = config_defdomain;
                     buf_putc(&buf, '@');
                     _append_extbuf(ns, &buf, domain);
@@ -1050,7 +1177,7 @@ EXPORTED const char *mbname_extname(const mbname_t *mbname, const struct namespa
             _append_extbuf(ns, &buf, mbname_localpart(mbname));
             if (crossdomains) {
                 const char *domain = mbname_domain(mbname);
-                if (!cdother || strcmpsafe(domain, mbname_domain(userparts))) {
+                if (!cdother || strcmpsafe(domain, userdomain)) {
                     if (!domain) domain = config_defdomain;
                     buf_putc(&buf, '@');
                     _append_extbuf(ns, &buf, domain);
@@ -1112,7 +1239,7 @@ EXPORTED const char *mbname_extname(const mbname_t *mbname, const struct namespa
             goto done;
 
         /* shared folders can ONLY be in the same domain except for admin */
-        if (!admindomains && strcmpsafe(mbname_domain(mbname), mbname_domain(userparts)))
+        if (!admindomains && strcmpsafe(mbname_domain(mbname), userdomain))
             goto done;
 
         /* note "user" precisely appears here, but no need to special case it
@@ -1133,14 +1260,14 @@ EXPORTED const char *mbname_extname(const mbname_t *mbname, const struct namespa
         _append_extbuf(ns, &buf, mbname_localpart(mbname));
         if (crossdomains) {
             const char *domain = mbname_domain(mbname);
-            if (!cdother || strcmpsafe(domain, mbname_domain(userparts))) {
+            if (!cdother || strcmpsafe(domain, userdomain)) {
                 if (!domain) domain = config_defdomain;
                 buf_putc(&buf, '@');
                 _append_extbuf(ns, &buf, domain);
             }
         }
         /* shared folders can ONLY be in the same domain except for admin */
-        else if (!admindomains && strcmpsafe(mbname_domain(mbname), mbname_domain(userparts)))
+        else if (!admindomains && strcmpsafe(mbname_domain(mbname), userdomain))
             goto done;
         int i;
         for (i = 0; i < strarray_size(boxes); i++) {
@@ -1175,7 +1302,6 @@ EXPORTED const char *mbname_extname(const mbname_t *mbname, const struct namespa
  done:
 
     buf_free(&buf);
-    mbname_free(&userparts);
     strarray_free(boxes);
 
     return mbname->extname;
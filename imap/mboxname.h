@@ -44,6 +44,7 @@
 #define INCLUDED_MBOXNAME_H
 
 #include "auth.h"
+#include "mpool.h"
 #include "strarray.h"
 #include "util.h"
 
@@ -103,6 +104,7 @@ const char *mbname_recipient(const mbname_t *mbname, const struct namespace *ns)
 mbname_t *mbname_from_userid(const char *userid);
 mbname_t *mbname_from_localdom(const char *localpart, const char *domain);
 mbname_t *mbname_from_intname(const char *intname);
+mbname_t *mbname_from_intname_pool(struct mpool *pool, const char *intname);
 mbname_t *mbname_from_extname(const char *extname, const struct namespace *ns, const char *userid);
 mbname_t *mbname_from_extsub(const char *extsub, const struct namespace *ns, const char *userid);
 mbname_t *mbname_from_recipient(const char *recip, const struct namespace *ns);
@@ -82,6 +82,7 @@ static struct protocol_t mupdate_protocol =
         { { "AUTH", CAPA_AUTH },
           { "STARTTLS", CAPA_STARTTLS },
           { "COMPRESS=DEFLATE", CAPA_COMPRESS },
+          { "INCREMENTAL-UPDATE", CAPA_INCREMENTAL },
           { NULL, 0 } } },
       { "S01 STARTTLS", "S01 OK", "S01 NO", 1 },
       { "A01 AUTHENTICATE", USHRT_MAX, 1, "A01 OK", "A01 NO", "", "*", NULL, 0 },
@@ -744,6 +745,25 @@ EXPORTED int mupdate_scarf(mupdate_handle *handle,
                 break;
             }
             goto badcmd;
+        case 'S':
+            if (!strncmp(handle->cmd.s, "SEQ", 3)) {
+                /* Epoch */
+                ch = getstring(handle->conn->in, handle->conn->out, &(handle->arg1));
+                if (ch != ' ') {
+                    r = MUPDATE_PROTOCOL_ERROR;
+                    goto done;
+                }
+
+                /* Sequence number */
+                ch = getstring(handle->conn->in, handle->conn->out, &(handle->arg2));
+                CHECKNEWLINE(handle, ch);
+
+                /* Everything before this has been handled */
+                handle->seq_epoch = strtoul(handle->arg1.s, NULL, 10);
+                handle->seq = strtoul(handle->arg2.s, NULL, 10);
+                break;
+            }
+            goto badcmd;
 
         default:
         badcmd:
@@ -158,6 +158,44 @@ static int get_kick_fds(int kicksock,
 
 #define KICK_FDS_LEN 5
 
+/* Last SEQ marker from the master that our database reflects,
+ * so that a reconnect only needs the changes since then */
+static unsigned long synced_epoch = 0;
+static unsigned long synced_seq = 0;
+
+/* Updates from the master are committed in batches, once there are
+ * 'mupdate_batchsize' of them, once they add up to BATCH_MAX_BYTES,
+ * or 'mupdate_batchdelay' milliseconds after the first one arrived */
+#define BATCH_MAX_BYTES (1024 * 1024)
+
+/* Commit the current batch of updates, and remember how far we got */
+static int commit_batch(mupdate_handle *handle, struct mupdate_batch *batch)
+{
+    int r = mupdate_batch_commit(batch);
+
+    if (r) {
+        /* updates were lost, so only a full resync can fix things */
+        synced_epoch = 0;
+    }
+    else if (handle->seq_epoch) {
+        synced_epoch = handle->seq_epoch;
+        synced_seq = handle->seq;
+    }
+
+    return r;
+}
+
+/* Milliseconds left until the current batch is due to be committed */
+static long batch_due(struct mupdate_batch *batch, long delay)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+
+    return delay - ((now.tv_sec - batch->start.tv_sec) * 1000 +
+                    (now.tv_usec - batch->start.tv_usec) / 1000);
+}
+
 static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
 {
     int gotdata = 0;
@@ -170,9 +208,25 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
     struct mpool *pool;
     int r;
     enum mupdate_cmd_response response;
+    struct mupdate_batch batch;
+    unsigned batchsize = config_getint(IMAPOPT_MUPDATE_BATCHSIZE);
+    long batchdelay = config_getint(IMAPOPT_MUPDATE_BATCHDELAY);
 
     if (!handle || !handle->saslcompleted) return;
 
+    memset(&batch, 0, sizeof(batch));
+
+    if (synced_epoch && CAPA(handle->conn, CAPA_INCREMENTAL)) {
+        /* try to pick up where we left off */
+        r = mupdate_synchronize_since(handle, synced_epoch, synced_seq,
+                                      &batch);
+        if (commit_batch(handle, &batch)) return;
+        if (!r) goto streaming;
+        if (r != MUPDATE_NO) return;
+
+        syslog(LOG_NOTICE, "incremental resync refused, doing full resync");
+    }
+
     pool = new_mpool(131072); /* Arbitrary, but large (128k) */
 
     /* first get the list of remote mailboxes from the mupdate master */
@@ -191,11 +245,15 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
     free_mpool(pool);
     if (r) return;
 
+    /* nothing is batched yet, but note the position of the full list */
+    commit_batch(handle, &batch);
+
     mupdate_signal_db_synced();
 
     /* Okay, we're all set to go */
     mupdate_ready();
 
+  streaming:
     kicksock = open_kick_socket();
     highest_fd = ((kicksock > handle->conn->sock) ? kicksock : handle->conn->sock) + 1;
 
@@ -206,10 +264,26 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
     /* Now just listen to the rest of the updates */
     while (1) {
         struct timeval tv;
+        int batchwait = 0;
 
         tv.tv_sec = pingtimeout;
         tv.tv_usec = 0;
 
+        if (batch.pending.count) {
+            long due = batch_due(&batch, batchdelay);
+
+            if (due <= 0 || (unsigned) batch.pending.count >= batchsize ||
+                batch.bytes >= BATCH_MAX_BYTES) {
+                if (commit_batch(handle, &batch)) break;
+            }
+            else if (due < pingtimeout * 1000L) {
+                /* wake up in time to commit */
+                tv.tv_sec = due / 1000;
+                tv.tv_usec = (due % 1000) * 1000;
+                batchwait = 1;
+            }
+        }
+
         prot_flush(handle->conn->out);
 
         rset = read_set;
@@ -224,7 +298,7 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
             if (FD_ISSET(handle->conn->sock, &rset)) {
                 /* If there is a fatal error, die, other errors ignore */
                 response = MUPDATE_NONE;
-                if ((r = mupdate_scarf(handle, cmd_change, NULL,
+                if ((r = mupdate_scarf(handle, cmd_change, &batch,
                                   waiting_for_noop, &response)) != 0) {
                     syslog(LOG_ERR, "mupdate_scarf: %d", r);
                     break;
@@ -239,6 +313,9 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
                     }
                     waiting_for_noop = 0;
 
+                    /* whoever kicked us expects to see every update */
+                    if (commit_batch(handle, &batch)) break;
+
                     for (; num_kick_fds; num_kick_fds--) {
                         if (write(kick_fds[num_kick_fds-1], "ok", 2) < 0) {
                             syslog(LOG_WARNING,
@@ -265,6 +342,9 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
                 waiting_for_noop = 1;
             }
         } else /* (gotdata == 0) */ {
+            /* Just time to commit the batch */
+            if (batchwait) continue;
+
             /* Timeout, send a NOOP */
             if (!waiting_for_noop) {
                 prot_printf(handle->conn->out, "N%u NOOP\r\n", handle->tagn++);
@@ -281,6 +361,9 @@ static void mupdate_listen(mupdate_handle *handle, int pingtimeout)
         }
     } /* Loop */
 
+    /* Don't lose what we have */
+    commit_batch(handle, &batch);
+
     /* Don't leak the descriptors! */
     for (; num_kick_fds; num_kick_fds--) {
         (void)close(kick_fds[num_kick_fds-1]);
@@ -53,6 +53,7 @@
 #include <stdlib.h>
 #include <syslog.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include <netdb.h>
 #include <sys/socket.h>
@@ -77,11 +78,14 @@
 #include "assert.h"
 #include "exitcodes.h"
 #include "global.h"
+#include "hash.h"
 #include "mailbox.h"
 #include "mboxlist.h"
 #include "mpool.h"
 #include "nonblock.h"
 #include "prot.h"
+#include "retry.h"
+#include "strhash.h"
 #include "tls.h"
 #include "tls_th-lock.h"
 #include "util.h"
@@ -111,6 +115,7 @@ enum {
 
 struct pending {
     struct pending *next;
+    unsigned long seq;          /* changelog sequence of this update */
 
     char mailbox[MAX_MAILBOX_BUFFER];
 };
@@ -149,6 +154,7 @@ struct conn {
     /* UPDATE command handling */
     const char *streaming; /* tag */
     strarray_t *streaming_hosts; /* partial updates */
+    int streaming_seq; /* send SEQ markers (UPDATESINCE) */
 
     /* pending changes to send, in reverse order */
     pthread_mutex_t m;
@@ -220,6 +226,8 @@ static void cmd_find(struct conn *C, const char *tag, const char *mailbox,
 static void cmd_list(struct conn *C, const char *tag, const char *host_prefix);
 static void cmd_startupdate(struct conn *C, const char *tag,
                      strarray_t *partial);
+static void cmd_updatesince(struct conn *C, const char *tag,
+                     const char *epoch, const char *seq);
 static void cmd_starttls(struct conn *C, const char *tag);
 #ifdef HAVE_ZLIB
 static void cmd_compress(struct conn *C, const char *tag, const char *alg);
@@ -227,6 +235,12 @@ static void cmd_compress(struct conn *C, const char *tag, const char *alg);
 void shut_down(int code);
 static int reset_saslconn(struct conn *c);
 static void database_init(void);
+static void changelog_init(void);
+static void changelog_done(void);
+static int changelog_enabled(void);
+static void mbcache_init(void);
+static void mbcache_put(const char *name, const struct mbent *m);
+static void mbcache_clear(void);
 static void sendupdates(struct conn *C, int flushnow);
 
 extern int saslserver(sasl_conn_t *conn, const char *mech,
@@ -565,6 +579,7 @@ int service_init(int argc, char **argv,
     }
 
     database_init();
+    changelog_init();
 
 #ifdef HAVE_SSL
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
@@ -924,6 +939,16 @@ static mupdate_docmd_result_t docmd(struct conn *c)
 
             cmd_startupdate(c, c->tag.s, arg);
         }
+        else if (!strcmp(c->cmd.s, "Updatesince")) {
+            if (ch != ' ') goto missingargs;
+            ch = getstring(c->pin, c->pout, &(c->arg1));
+            if (ch != ' ') goto missingargs;
+            ch = getstring(c->pin, c->pout, &(c->arg2));
+            CHECKNEWLINE(c, ch);
+            if (c->streaming) goto notwhenstreaming;
+
+            cmd_updatesince(c, c->tag.s, c->arg1.s, c->arg2.s);
+        }
         else goto badcmd;
         break;
 
@@ -1076,6 +1101,10 @@ static void dobanner(struct conn *c)
 
     prot_printf(c->pout, "* PARTIAL-UPDATE\r\n");
 
+    if (changelog_enabled()) {
+        prot_printf(c->pout, "* INCREMENTAL-UPDATE\r\n");
+    }
+
     prot_printf(c->pout,
                 "* OK MUPDATE \"%s\" \"Cyrus IMAP\" \"%s\" \"%s\"\r\n",
                 config_servername,
@@ -1395,14 +1424,18 @@ static void database_init(void)
     mboxlist_init(0);
     mboxlist_open(NULL);
 
+    mbcache_init();
+
     pthread_mutex_unlock(&mailboxes_mutex); /* UNLOCK */
 }
 
-/* log change to database. database must be locked. */
-static void database_log(const struct mbent *mb, struct txn **mytid)
+/* log change to database. database must be locked.
+ * With 'mytid' the caller updates the read cache once it commits */
+static int database_log(const struct mbent *mb, struct txn **mytid)
 {
     char *c;
     mbentry_t *mbentry = NULL;
+    int r = 0;
 
     mbentry = mboxlist_entry_create();
     mbentry->name = xstrdupnull(mb->mailbox);
@@ -1420,16 +1453,16 @@ static void database_log(const struct mbent *mb, struct txn **mytid)
     switch (mb->t) {
     case SET_ACTIVE:
         mbentry->mbtype = 0;
-        mboxlist_insertremote(mbentry, mytid);
+        r = mboxlist_insertremote(mbentry, mytid);
         break;
 
     case SET_RESERVE:
         mbentry->mbtype = MBTYPE_RESERVE;
-        mboxlist_insertremote(mbentry, mytid);
+        r = mboxlist_insertremote(mbentry, mytid);
         break;
 
     case SET_DELETE:
-        mboxlist_deleteremote(mb->mailbox, mytid);
+        r = mboxlist_deleteremote(mb->mailbox, mytid);
         break;
 
     case SET_DEACTIVATE:
@@ -1439,6 +1472,16 @@ static void database_log(const struct mbent *mb, struct txn **mytid)
     }
 
     mboxlist_entry_free(&mbentry);
+
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: updating %s in mailboxes.db: %s",
+               mb->mailbox, error_message(r));
+    }
+    else if (!mytid) {
+        mbcache_put(mb->mailbox, mb->t == SET_DELETE ? NULL : mb);
+    }
+
+    return r;
 }
 
 /* lookup in database. database must be locked */
@@ -1495,6 +1538,427 @@ static struct mbent *database_lookup(const char *name, const mbentry_t *mbentry,
     return out;
 }
 
+/*
+ * Read cache of the mailbox table.
+ *
+ * Lookups for FIND and for the update fan-out to streaming clients are
+ * answered from here without taking mailboxes_mutex, so they no longer
+ * serialise behind each other or behind writers.  The cache is split
+ * into shards, each with a rwlock that writers only hold for as long as
+ * it takes to swap one entry.  Readers get their own copy of an entry.
+ *
+ * Entries are only added, replaced or removed while holding
+ * mailboxes_mutex, and only with committed data, so the cache always
+ * agrees with the database: database_log() updates it after every
+ * write that commits on its own, mupdate_batch_commit() once its
+ * transaction has committed, and a miss is filled from the database
+ * under the mutex.
+ *
+ * Each shard holds at most 'mupdate_cache_size' / MBCACHE_SHARDS
+ * entries.  Past that, a CLOCK sweep over the shard's entries evicts
+ * one which hasn't been looked up since the hand last passed it.
+ */
+#define MBCACHE_SHARDS 64
+
+struct mbcache_ent {
+    struct mbent *m;
+    unsigned slot;              /* index in the shard's ring */
+    unsigned char referenced;   /* looked up since the hand went by */
+};
+
+static struct mbcache_shard {
+    pthread_rwlock_t lock;
+    struct hash_table table;    /* name -> struct mbcache_ent */
+    struct mbcache_ent **ring;
+    unsigned count;             /* entries in the ring */
+    unsigned hand;
+} mbcache[MBCACHE_SHARDS];
+
+static unsigned mbcache_shard_max = 0;
+
+static struct mbent *mbent_dup(const struct mbent *m)
+{
+    struct mbent *out = xmalloc(sizeof(struct mbent) + strlen(m->acl));
+
+    out->mailbox = xstrdup(m->mailbox);
+    out->location = xstrdupnull(m->location);
+    out->t = m->t;
+    out->next = NULL;
+    strcpy(out->acl, m->acl);
+
+    return out;
+}
+
+static void mbcache_free_cb(void *data)
+{
+    struct mbcache_ent *e = (struct mbcache_ent *) data;
+
+    free_mbent(e->m);
+    free(e);
+}
+
+static void mbcache_init(void)
+{
+    int size = config_getint(IMAPOPT_MUPDATE_CACHE_SIZE);
+    int i;
+
+    if (size <= 0) return;
+    mbcache_shard_max = (size + MBCACHE_SHARDS - 1) / MBCACHE_SHARDS;
+
+    for (i = 0; i < MBCACHE_SHARDS; i++) {
+        pthread_rwlock_init(&mbcache[i].lock, NULL);
+        construct_hash_table(&mbcache[i].table, mbcache_shard_max, 0);
+        mbcache[i].ring =
+            xzmalloc(mbcache_shard_max * sizeof(struct mbcache_ent *));
+    }
+}
+
+static struct mbcache_shard *mbcache_shard(const char *name)
+{
+    return &mbcache[(strhash(name) >> 8) % MBCACHE_SHARDS];
+}
+
+/* return a (caller-owned) copy of the cached entry for 'name', or NULL */
+static struct mbent *mbcache_get(const char *name)
+{
+    struct mbcache_shard *shard;
+    struct mbcache_ent *e;
+    struct mbent *out = NULL;
+
+    if (!mbcache_shard_max) return NULL;
+
+    shard = mbcache_shard(name);
+    pthread_rwlock_rdlock(&shard->lock);
+    e = hash_lookup(name, &shard->table);
+    if (e) {
+        out = mbent_dup(e->m);
+        /* other readers may be setting it too */
+        __atomic_store_n(&e->referenced, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    return out;
+}
+
+/* take 'e' out of the shard, returning its mbent.
+ * caller MUST hold the shard write lock */
+static struct mbent *mbcache_remove(struct mbcache_shard *shard,
+                                    struct mbcache_ent *e)
+{
+    struct mbent *m = e->m;
+
+    hash_del(m->mailbox, &shard->table);
+
+    shard->ring[e->slot] = shard->ring[--shard->count];
+    shard->ring[e->slot]->slot = e->slot;
+    shard->ring[shard->count] = NULL;
+    if (shard->hand >= shard->count) shard->hand = 0;
+
+    free(e);
+    return m;
+}
+
+/* add 'm' to the shard, returning the mbent evicted to make room (if
+ * any).  caller MUST hold the shard write lock */
+static struct mbent *mbcache_add(struct mbcache_shard *shard, struct mbent *m)
+{
+    struct mbcache_ent *e;
+    struct mbent *old = NULL;
+
+    if (shard->count < mbcache_shard_max) {
+        e = xmalloc(sizeof(struct mbcache_ent));
+        e->slot = shard->count;
+        shard->ring[shard->count++] = e;
+    }
+    else {
+        /* sweep round to something that hasn't been used lately */
+        for (;;) {
+            e = shard->ring[shard->hand];
+            if (!e->referenced) break;
+            e->referenced = 0;
+            shard->hand = (shard->hand + 1) % shard->count;
+        }
+        shard->hand = (shard->hand + 1) % shard->count;
+
+        old = e->m;
+        hash_del(old->mailbox, &shard->table);
+    }
+
+    e->m = m;
+    e->referenced = 0;
+    hash_insert(m->mailbox, e, &shard->table);
+
+    return old;
+}
+
+/* set (or with a NULL 'm', remove) the entry for 'name'.  'm' MUST
+ * be committed to the database.  caller MUST hold mailboxes_mutex */
+static void mbcache_put(const char *name, const struct mbent *m)
+{
+    struct mbcache_shard *shard;
+    struct mbcache_ent *e;
+    struct mbent *new = NULL, *old = NULL;
+
+    if (!mbcache_shard_max) return;
+
+    if (m) {
+        new = mbent_dup(m);
+        /* reservations are looked up without an ACL */
+        if (new->t == SET_RESERVE) new->acl[0] = '\0';
+    }
+
+    shard = mbcache_shard(name);
+    pthread_rwlock_wrlock(&shard->lock);
+    e = hash_lookup(name, &shard->table);
+    if (e && new) {
+        old = e->m;
+        e->m = new;
+    }
+    else if (e) {
+        old = mbcache_remove(shard, e);
+    }
+    else if (new) {
+        old = mbcache_add(shard, new);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    free_mbent(old);
+}
+
+/* forget everything (after a bulk change to the database).
+ * caller MUST hold mailboxes_mutex */
+static void mbcache_clear(void)
+{
+    int i;
+
+    if (!mbcache_shard_max) return;
+
+    for (i = 0; i < MBCACHE_SHARDS; i++) {
+        pthread_rwlock_wrlock(&mbcache[i].lock);
+        free_hash_table(&mbcache[i].table, &mbcache_free_cb);
+        construct_hash_table(&mbcache[i].table, mbcache_shard_max, 0);
+        memset(mbcache[i].ring, 0,
+               mbcache_shard_max * sizeof(struct mbcache_ent *));
+        mbcache[i].count = 0;
+        mbcache[i].hand = 0;
+        pthread_rwlock_unlock(&mbcache[i].lock);
+    }
+}
+
+/*
+ * Change log (master only).
+ *
+ * Every update is given a sequence number and the name of the mailbox
+ * is kept in a ring of the last 'mupdate_changelog_size' updates, so a
+ * reconnecting slave can ask for just the mailboxes that changed since
+ * the last sequence number it saw.  The log is also appended to a file
+ * so that it survives a master restart; the file is rewritten from the
+ * ring once it grows to twice the ring size.  The epoch identifies the
+ * log, and changes whenever the log has to be started from scratch.
+ *
+ * Appends aren't fsync()ed, so after a crash the file can be missing
+ * updates which slaves have already seen, and reusing their sequence
+ * numbers would make those slaves skip updates.  A clean shutdown
+ * fsync()s the file and ends it with "END"; any other start begins a
+ * new epoch, so every slave does a full resync.
+ *
+ * All changelog state is protected by mailboxes_mutex.
+ */
+#define FNAME_MUPDATE_CHANGELOG "/mupdate.changelog"
+
+static struct {
+    unsigned long epoch;
+    unsigned long seq;          /* last sequence number assigned */
+    char **ring;                /* mailbox for 'seq' is at seq % size */
+    unsigned long size;
+    unsigned long count;        /* valid entries in ring */
+    unsigned long ondisk;       /* entries in the file */
+    char *fname;
+    int fd;
+} changelog = { 0, 0, NULL, 0, 0, 0, NULL, -1 };
+
+static int changelog_enabled(void)
+{
+    return changelog.size != 0;
+}
+
+/* write the header and the contents of the ring to a new log file */
+static void changelog_rewrite(void)
+{
+    struct buf buf = BUF_INITIALIZER;
+    char *tmpfname = strconcat(changelog.fname, ".NEW", (char *)NULL);
+    unsigned long seq;
+    int fd;
+
+    if (changelog.fd >= 0) close(changelog.fd);
+    changelog.fd = -1;
+
+    buf_printf(&buf, "EPOCH %lu\n", changelog.epoch);
+    for (seq = changelog.seq - changelog.count + 1;
+         seq <= changelog.seq && changelog.count; seq++) {
+        buf_printf(&buf, "%lu\t%s\n",
+                   seq, changelog.ring[seq % changelog.size]);
+    }
+
+    fd = open(tmpfname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd < 0 ||
+        retry_write(fd, buf.s, buf.len) != (ssize_t) buf.len ||
+        fsync(fd) || rename(tmpfname, changelog.fname)) {
+        syslog(LOG_ERR, "IOERROR: writing %s: %m", tmpfname);
+        if (fd >= 0) close(fd);
+        unlink(tmpfname);
+        /* incremental resync will not survive a restart */
+        unlink(changelog.fname);
+    }
+    else {
+        close(fd);
+        changelog.fd = open(changelog.fname, O_WRONLY|O_APPEND, 0600);
+        changelog.ondisk = changelog.count;
+    }
+
+    free(tmpfname);
+    buf_free(&buf);
+}
+
+static void changelog_init(void)
+{
+    char line[MAX_MAILBOX_BUFFER+32];
+    unsigned long lastseq = 0;
+    int clean = 0;
+    FILE *f;
+
+    changelog.size = config_getint(IMAPOPT_MUPDATE_CHANGELOG_SIZE);
+    if (!masterp || (long) changelog.size <= 0) {
+        changelog.size = 0;
+        return;
+    }
+
+    changelog.ring = xzmalloc(changelog.size * sizeof(char *));
+    changelog.fname = strconcat(config_dir, FNAME_MUPDATE_CHANGELOG,
+                                (char *)NULL);
+
+    f = fopen(changelog.fname, "r");
+    if (f && fgets(line, sizeof(line), f) &&
+        sscanf(line, "EPOCH %lu", &changelog.epoch) == 1) {
+        while (fgets(line, sizeof(line), f)) {
+            char *p = strchr(line, '\t'), *end;
+            size_t len = strlen(line);
+            unsigned long seq;
+
+            if (!strcmp(line, "END\n")) {
+                clean = 1;
+                continue;
+            }
+            clean = 0;
+
+            /* stop at a partial write */
+            if (!p || line[len-1] != '\n') break;
+            line[len-1] = '\0';
+
+            seq = strtoul(line, &end, 10);
+            if (end != p || (lastseq && seq != lastseq + 1)) break;
+
+            free(changelog.ring[seq % changelog.size]);
+            changelog.ring[seq % changelog.size] = xstrdup(p+1);
+            if (changelog.count < changelog.size) changelog.count++;
+            lastseq = seq;
+        }
+        changelog.seq = lastseq;
+
+        if (!clean) {
+            unsigned long epoch = changelog.epoch;
+            unsigned long seq;
+
+            syslog(LOG_NOTICE, "mupdate changelog epoch %lu was not closed "
+                   "cleanly, starting a new one", epoch);
+            for (seq = 0; seq < changelog.size; seq++) {
+                free(changelog.ring[seq]);
+                changelog.ring[seq] = NULL;
+            }
+            changelog.count = 0;
+            changelog.epoch = time(NULL);
+            if (changelog.epoch <= epoch) changelog.epoch = epoch + 1;
+        }
+    }
+    else {
+        /* no usable log, start a new one */
+        changelog.epoch = time(NULL);
+    }
+    if (f) fclose(f);
+
+    syslog(LOG_NOTICE, "mupdate changelog epoch %lu at seq %lu (%lu entries)",
+           changelog.epoch, changelog.seq, changelog.count);
+
+    changelog_rewrite();
+}
+
+/* make the log file durable and mark it as complete, at shutdown */
+static void changelog_done(void)
+{
+    if (changelog.fd < 0) return;
+
+    if (retry_write(changelog.fd, "END\n", 4) != 4 || fsync(changelog.fd)) {
+        syslog(LOG_ERR, "IOERROR: closing %s: %m", changelog.fname);
+    }
+    close(changelog.fd);
+    changelog.fd = -1;
+}
+
+/* record an update to 'mailbox'.  MUST be called before the update is
+ * written to the database, so that a crash never leaves an update
+ * without a sequence number */
+static void changelog_add(const char *mailbox)
+{
+    char **slot;
+
+    if (!changelog.size) return;
+
+    slot = &changelog.ring[++changelog.seq % changelog.size];
+    free(*slot);
+    *slot = xstrdup(mailbox);
+    if (changelog.count < changelog.size) changelog.count++;
+
+    if (changelog.fd >= 0) {
+        struct buf buf = BUF_INITIALIZER;
+
+        buf_printf(&buf, "%lu\t%s\n", changelog.seq, mailbox);
+        if (retry_write(changelog.fd, buf.s, buf.len) != (ssize_t) buf.len) {
+            syslog(LOG_ERR, "IOERROR: appending to %s: %m", changelog.fname);
+        }
+        buf_free(&buf);
+
+        if (++changelog.ondisk >= 2 * changelog.size) changelog_rewrite();
+    }
+}
+
+/* collect the (distinct) mailboxes changed after 'seq' of log 'epoch'.
+ * Returns -1 if the log no longer covers that range */
+static int changelog_since(unsigned long epoch, unsigned long seq,
+                           strarray_t *mailboxes)
+{
+    struct hash_table seen = HASH_TABLE_INITIALIZER;
+
+    if (!changelog.size || epoch != changelog.epoch ||
+        seq > changelog.seq || seq + changelog.count < changelog.seq) {
+        return -1;
+    }
+
+    construct_hash_table(&seen, changelog.seq - seq + 1, 0);
+
+    /* each mailbox is sent once, however often it changed */
+    for (; seq < changelog.seq; seq++) {
+        const char *mailbox = changelog.ring[(seq + 1) % changelog.size];
+
+        if (hash_lookup(mailbox, &seen)) continue;
+        hash_insert(mailbox, (void *) 1, &seen);
+        strarray_append(mailboxes, mailbox);
+    }
+
+    free_hash_table(&seen, NULL);
+
+    return 0;
+}
+
 static void cmd_authenticate(struct conn *C,
                       const char *tag, const char *mech,
                       const char *clientstart)
@@ -1576,6 +2040,7 @@ static void log_update(const char *mailbox,
         /* for each connection, add to pending list */
         struct pending *p = (struct pending *) xmalloc(sizeof(struct pending));
         p->next = NULL;
+        p->seq = changelog.seq;
         strlcpy(p->mailbox, mailbox, sizeof(p->mailbox));
 
         /* this might need to be inside the mutex, but I doubt it */
@@ -1711,6 +2176,7 @@ static void cmd_set(struct conn *C,
     }
 
     /* write to disk */
+    changelog_add(mailbox);
     if (m) database_log(m, NULL);
 
     if (oldlocation) {
@@ -1762,12 +2228,16 @@ static void cmd_find(struct conn *C, const char *tag, const char *mailbox,
 
     syslog(LOG_DEBUG, "cmd_find(fd:%d, %s)", C->fd, mailbox);
 
-    /* Only hold the mutex around database_lookup,
-     * since the mbent stays valid even if the database changes,
-     * and we don't want to block on network I/O */
-    pthread_mutex_lock(&mailboxes_mutex); /* LOCK */
-    m = database_lookup(mailbox, NULL, NULL);
-    pthread_mutex_unlock(&mailboxes_mutex); /* UNLOCK */
+    /* Try the read cache first.  Otherwise, only hold the mutex around
+     * database_lookup, since the mbent stays valid even if the database
+     * changes, and we don't want to block on network I/O */
+    m = mbcache_get(mailbox);
+    if (!m) {
+        pthread_mutex_lock(&mailboxes_mutex); /* LOCK */
+        m = database_lookup(mailbox, NULL, NULL);
+        if (m) mbcache_put(mailbox, m);
+        pthread_mutex_unlock(&mailboxes_mutex); /* UNLOCK */
+    }
 
     if (m && m->t == SET_ACTIVE) {
         prot_printf(C->pout,
@@ -1928,6 +2398,11 @@ static void cmd_startupdate(struct conn *C, const char *tag,
     /* dump initial list */
     mboxlist_allmbox("", sendupdate, (void*)C, /*incdel*/0);
 
+    if (C->streaming_seq) {
+        prot_printf(C->pout, "* SEQ \"%lu\" \"%lu\"\r\n",
+                    changelog.epoch, changelog.seq);
+    }
+
     pthread_mutex_unlock(&mailboxes_mutex); /* UNLOCK */
 
     prot_printf(C->pout, "%s OK \"streaming starts\"\r\n", tag);
@@ -1940,11 +2415,81 @@ static void cmd_startupdate(struct conn *C, const char *tag,
                               sendupdates_evt, C);
 }
 
+/* Like UPDATE, but with SEQ markers so that the client can resume from
+ * where it left off.  An epoch of "0" asks for the full mailbox list,
+ * otherwise only the mailboxes changed since 'seq' are sent (or NO, if
+ * the change log no longer goes back that far). */
+static void cmd_updatesince(struct conn *C, const char *tag,
+                     const char *epoch, const char *seq)
+{
+    strarray_t mailboxes = STRARRAY_INITIALIZER;
+    unsigned long since_epoch = strtoul(epoch, NULL, 10);
+    unsigned long since_seq = strtoul(seq, NULL, 10);
+    unsigned long cur_seq;
+    int i;
+
+    if (!changelog.size) {
+        prot_printf(C->pout, "%s BAD \"no change log\"\r\n", tag);
+        return;
+    }
+
+    C->streaming_seq = 1;
+
+    if (!since_epoch) {
+        cmd_startupdate(C, tag, NULL);
+        return;
+    }
+
+    pthread_mutex_lock(&mailboxes_mutex); /* LOCK */
+
+    if (changelog_since(since_epoch, since_seq, &mailboxes)) {
+        pthread_mutex_unlock(&mailboxes_mutex); /* UNLOCK */
+
+        syslog(LOG_NOTICE, "cannot resume %s from %lu/%lu: log truncated",
+               C->clienthost, since_epoch, since_seq);
+        C->streaming_seq = 0;
+        prot_printf(C->pout, "%s NO \"change log truncated\"\r\n", tag);
+        return;
+    }
+
+    /* indicate interest in updates.  Anything changed from here on
+     * is queued for sendupdates() */
+    C->updatelist_next = updatelist;
+    updatelist = C;
+    C->streaming = xstrdup(tag);
+    cur_seq = changelog.seq;
+
+    pthread_mutex_unlock(&mailboxes_mutex); /* UNLOCK */
+
+    syslog(LOG_NOTICE, "resuming %s from %lu/%lu: %d changed mailboxes",
+           C->clienthost, since_epoch, since_seq, mailboxes.count);
+
+    prot_NONBLOCK(C->pout);
+
+    /* send the current state of everything that changed */
+    for (i = 0; i < mailboxes.count; i++) {
+        cmd_find(C, C->streaming, strarray_nth(&mailboxes, i), 0, 1);
+    }
+    strarray_fini(&mailboxes);
+
+    prot_printf(C->pout, "* SEQ \"%lu\" \"%lu\"\r\n",
+                changelog.epoch, cur_seq);
+    prot_printf(C->pout, "%s OK \"streaming starts\"\r\n", tag);
+
+    prot_BLOCK(C->pout);
+    prot_flush(C->pout);
+
+    /* schedule our first update */
+    C->ev = prot_addwaitevent(C->pin, time(NULL) + update_wait,
+                              sendupdates_evt, C);
+}
+
 /* send out any pending updates.
    if 'flushnow' is set, flush the output buffer */
 static void sendupdates(struct conn *C, int flushnow)
 {
     struct pending *p, *q;
+    unsigned long seq = 0;
 
     pthread_mutex_lock(&C->m);
 
@@ -1963,9 +2508,16 @@ static void sendupdates(struct conn *C, int flushnow)
          * notifications */
         cmd_find(C, C->streaming, q->mailbox, 0, 1);
 
+        seq = q->seq;
         free(q);
     }
 
+    if (seq && C->streaming_seq) {
+        /* the client is now up to date as of 'seq' */
+        prot_printf(C->pout, "* SEQ \"%lu\" \"%lu\"\r\n",
+                    changelog.epoch, seq);
+    }
+
     /* reschedule event for 'update_wait' seconds */
     C->ev->mark = time(NULL) + update_wait;
 
@@ -2107,6 +2659,8 @@ void shut_down(int code)
 {
     in_shutdown = 1;
 
+    changelog_done();
+
     cyrus_done();
 
     exit(code);
@@ -2155,122 +2709,126 @@ static int reset_saslconn(struct conn *c)
     return SASL_OK;
 }
 
-int cmd_change(struct mupdate_mailboxdata *mdata,
-               const char *rock, void *context __attribute__((unused)))
+/* Turn an update from the master into a new mbent, or NULL if it's
+ * not one we understand */
+static struct mbent *mbent_from_update(struct mupdate_mailboxdata *mdata,
+                                       const char *cmd)
 {
-    struct mbent *m = NULL;
-    char *oldlocation = NULL;
-    char *thislocation = NULL;
-    char *tmp;
-    enum settype t = -1;
-    int ret = 0;
-
-    if (!mdata || !rock || !mdata->mailbox) return 1;
-
-    pthread_mutex_lock(&mailboxes_mutex); /* LOCK */
-
-    if (!strncmp(rock, "DELETE", 6)) {
-        m = database_lookup(mdata->mailbox, NULL, NULL);
-
-        if (!m) {
-            syslog(LOG_DEBUG, "attempt to delete unknown mailbox %s",
-                   mdata->mailbox);
-            /* Mailbox doesn't exist - this isn't as fatal as you might
-             * think. */
-            /* ret = -1; */
-            goto done;
-        }
-        m->t = t = SET_DELETE;
+    const char *acl = mdata->acl ? mdata->acl : "";
+    struct mbent *m;
+    enum settype t;
 
-        oldlocation = xstrdup(m->location);
+    if (!strncmp(cmd, "DELETE", 6)) {
+        t = SET_DELETE;
+    } else if (!strncmp(cmd, "MAILBOX", 6)) {
+        t = SET_ACTIVE;
+    } else if (!strncmp(cmd, "RESERVE", 7)) {
+        t = SET_RESERVE;
     } else {
-        m = database_lookup(mdata->mailbox, NULL, NULL);
-
-        if (m)
-            oldlocation = m->location;
-
-        if (m && (!mdata->acl || strlen(mdata->acl) < strlen(m->acl))) {
-            /* change what's already there */
-            /* old m->location freed when oldlocation is freed */
-            m->location = xstrdup(mdata->location);
+        syslog(LOG_DEBUG, "bad mupdate command in cmd_change: %s", cmd);
+        return NULL;
+    }
 
-            if (mdata->acl) strcpy(m->acl, mdata->acl);
-            else m->acl[0] = '\0';
+    m = xmalloc(sizeof(struct mbent) + strlen(acl));
+    m->mailbox = xstrdup(mdata->mailbox);
+    m->location = xstrdupnull(mdata->location);
+    m->t = t;
+    m->next = NULL;
+    strcpy(m->acl, acl);
 
-            if (!strncmp(rock, "MAILBOX", 6)) {
-                m->t = t = SET_ACTIVE;
-            } else if (!strncmp(rock, "RESERVE", 7)) {
-                m->t = t = SET_RESERVE;
-            } else {
-                syslog(LOG_DEBUG,
-                       "bad mupdate command in cmd_change: %s", rock);
-                ret = 1;
-                goto done;
-            }
-        } else {
-            struct mbent *newm;
+    return m;
+}
 
-            if (m) {
-                free(m->mailbox);
-                /* m->location freed when oldlocation freed */
-            }
+/* Write an update from the master to the database, in '*tid' if that's
+ * non-NULL.  Sets '*appliedp' if there was anything to write, and then
+ * '*oldlocp' to the location it replaced (if any), for change_post().
+ * caller MUST hold mailboxes_mutex */
+static int change_apply(const struct mbent *new, struct txn **tid,
+                        int *appliedp, char **oldlocp)
+{
+    struct mbent *m = database_lookup(new->mailbox, NULL, NULL);
 
-            /* allocate new mailbox */
-            if (mdata->acl) {
-                newm = xrealloc(m, sizeof(struct mbent) + strlen(mdata->acl));
-            } else {
-                newm = xrealloc(m, sizeof(struct mbent) + 1);
-            }
+    *appliedp = 0;
+    *oldlocp = NULL;
 
-            newm->mailbox = xstrdup(mdata->mailbox);
-            newm->location = xstrdup(mdata->location);
+    if (new->t == SET_DELETE && !m) {
+        /* Mailbox doesn't exist - this isn't as fatal as you might
+         * think. */
+        syslog(LOG_DEBUG, "attempt to delete unknown mailbox %s",
+               new->mailbox);
+        return 0;
+    }
 
-            if (mdata->acl) {
-                strcpy(newm->acl, mdata->acl);
-            } else {
-                newm->acl[0] = '\0';
-            }
+    if (m) {
+        *oldlocp = m->location;
+        m->location = NULL;
+        free_mbent(m);
+    }
 
-            if (!strncmp(rock, "MAILBOX", 6)) {
-                newm->t = t = SET_ACTIVE;
-            } else if (!strncmp(rock, "RESERVE", 7)) {
-                newm->t = t = SET_RESERVE;
-            } else {
-                syslog(LOG_DEBUG,
-                       "bad mupdate command in cmd_change: %s", rock);
-                ret = 1;
-                goto done;
-            }
+    *appliedp = 1;
+    changelog_add(new->mailbox);
 
-            /* Bring it back into scope */
-            m = newm;
-        }
-    }
+    return database_log(new, tid);
+}
 
-    /* write to disk */
-    database_log(m, NULL);
+/* Tell our own clients about an update which is now in the database.
+ * caller MUST hold mailboxes_mutex */
+static void change_post(const struct mbent *m, char *oldlocation)
+{
+    char *thislocation = NULL;
+    char *tmp;
 
     if (oldlocation) {
         tmp = strchr(oldlocation, '!');
         if (tmp) *tmp = '\0';
     }
 
-    if (mdata->location) {
-        thislocation = xstrdup(mdata->location);
+    if (m->t != SET_DELETE && m->location) {
+        thislocation = xstrdup(m->location);
         tmp = strchr(thislocation, '!');
         if (tmp) *tmp = '\0';
     }
 
     /* post pending changes to anyone we are talking to */
-    log_update(mdata->mailbox, oldlocation, thislocation);
+    log_update(m->mailbox, oldlocation, thislocation);
 
- done:
-    if (oldlocation) free(oldlocation);
-    if (thislocation) free(thislocation);
+    free(thislocation);
+}
+
+int cmd_change(struct mupdate_mailboxdata *mdata,
+               const char *rock, void *context)
+{
+    struct mupdate_batch *batch = (struct mupdate_batch *) context;
+    struct mbent *m;
+    char *oldlocation = NULL;
+    int applied = 0;
+    int ret;
+
+    if (!mdata || !rock || !mdata->mailbox) return 1;
+
+    m = mbent_from_update(mdata, rock);
+    if (!m) return 1;
+
+    if (batch) {
+        /* held back until mupdate_batch_commit(), so that the database
+         * isn't locked while we wait for more */
+        if (!batch->pending.count) gettimeofday(&batch->start, NULL);
+        batch->bytes += strlen(m->mailbox) + strlen(m->acl) +
+            (m->location ? strlen(m->location) : 0);
+        ptrarray_append(&batch->pending, m);
+        return 0;
+    }
+
+    pthread_mutex_lock(&mailboxes_mutex); /* LOCK */
+
+    ret = change_apply(m, NULL, &applied, &oldlocation);
+    if (applied && !ret) change_post(m, oldlocation);
 
-    free_mbent(m);
     pthread_mutex_unlock(&mailboxes_mutex); /* UNLOCK */
 
+    free(oldlocation);
+    free_mbent(m);
+
     return ret;
 }
 
@@ -2356,7 +2914,13 @@ int mupdate_synchronize_remote(mupdate_handle *handle,
     rock.pool = pool;
 
     /* ask mupdate master for updates and set nonblocking */
-    prot_printf(handle->conn->out, "U01 UPDATE\r\n");
+    if (CAPA(handle->conn, CAPA_INCREMENTAL)) {
+        /* full list, but with SEQ markers so we can resume later */
+        prot_printf(handle->conn->out, "U01 UPDATESINCE \"0\" \"0\"\r\n");
+    }
+    else {
+        prot_printf(handle->conn->out, "U01 UPDATE\r\n");
+    }
 
     syslog(LOG_NOTICE,
            "scarfing mailbox list from master mupdate server");
@@ -2382,6 +2946,33 @@ int mupdate_synchronize_remote(mupdate_handle *handle,
     return 0;
 }
 
+int mupdate_synchronize_since(mupdate_handle *handle,
+                              unsigned long epoch, unsigned long seq,
+                              struct mupdate_batch *batch)
+{
+    enum mupdate_cmd_response response = MUPDATE_NONE;
+    int r;
+
+    if (!handle || !handle->saslcompleted) return 1;
+
+    prot_printf(handle->conn->out, "U01 UPDATESINCE \"%lu\" \"%lu\"\r\n",
+                epoch, seq);
+
+    syslog(LOG_NOTICE,
+           "resuming mailbox list from master mupdate server at %lu/%lu",
+           epoch, seq);
+
+    /* changes are applied as they arrive, just like streamed updates */
+    r = mupdate_scarf(handle, cmd_change, batch, 1, &response);
+    if (r) return r;
+    if (response != MUPDATE_OK) return MUPDATE_NO;
+
+    /* Make socket nonblocking now */
+    prot_NONBLOCK(handle->conn->in);
+
+    return 0;
+}
+
 int mupdate_synchronize(struct mbent_queue *remote_boxes, struct mpool *pool)
 {
     struct mbent_queue local_boxes;
@@ -2401,6 +2992,9 @@ int mupdate_synchronize(struct mbent_queue *remote_boxes, struct mpool *pool)
     syslog(LOG_NOTICE,
            "synchronizing mailbox list with master mupdate server");
 
+    /* the database is about to be changed behind the read cache */
+    mbcache_clear();
+
     local_boxes.head = NULL;
     local_boxes.tail = &(local_boxes.head);
 
@@ -2545,6 +3139,63 @@ int mupdate_synchronize(struct mbent_queue *remote_boxes, struct mpool *pool)
     return ret;
 }
 
+int mupdate_batch_commit(struct mupdate_batch *batch)
+{
+    int count = batch->pending.count;
+    struct txn *tid = NULL;
+    char **oldlocs;
+    int *applied;
+    int i, r = 0;
+
+    if (!count) return 0;
+
+    oldlocs = xzmalloc(count * sizeof(char *));
+    applied = xzmalloc(count * sizeof(int));
+
+    pthread_mutex_lock(&mailboxes_mutex); /* LOCK */
+
+    /* the whole batch goes into the database in one transaction,
+     * which is only open for as long as it takes to write it */
+    for (i = 0; !r && i < count; i++) {
+        r = change_apply(ptrarray_nth(&batch->pending, i), &tid,
+                         &applied[i], &oldlocs[i]);
+    }
+    if (r) {
+        if (tid) mboxlist_abort(tid);
+    }
+    else if (tid) {
+        r = mboxlist_commit(tid);
+    }
+
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: failed to commit %d mailbox updates: %s",
+               count, cyrusdb_strerror(r));
+    }
+    else {
+        /* only now can readers and clients see the changes */
+        for (i = 0; i < count; i++) {
+            struct mbent *m = ptrarray_nth(&batch->pending, i);
+
+            if (!applied[i]) continue;
+            mbcache_put(m->mailbox, m->t == SET_DELETE ? NULL : m);
+            change_post(m, oldlocs[i]);
+        }
+    }
+
+    pthread_mutex_unlock(&mailboxes_mutex); /* UNLOCK */
+
+    for (i = 0; i < count; i++) {
+        free_mbent(ptrarray_nth(&batch->pending, i));
+        free(oldlocs[i]);
+    }
+    free(oldlocs);
+    free(applied);
+    ptrarray_fini(&batch->pending);
+    batch->bytes = 0;
+
+    return r;
+}
+
 void mupdate_signal_db_synced(void)
 {
     pthread_mutex_lock(&synced_mutex);
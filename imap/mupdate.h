@@ -52,9 +52,12 @@
  * mupdate-slave.c: Slave listener thread functions.
  */
 
+#include <sys/time.h>
+
 #include "backend.h"
 #include "mailbox.h"
 #include "mpool.h"
+#include "ptrarray.h"
 #include "mupdate-client.h"
 #include "global.h"
 
@@ -77,6 +80,15 @@ struct mupdate_handle_s {
     struct mupdate_mailboxdata mailboxdata_buf;
 
     int saslcompleted;
+
+    /* Last SEQ marker received (INCREMENTAL-UPDATE) */
+    unsigned long seq_epoch;
+    unsigned long seq;
+};
+
+/* protocol specific capabilities */
+enum {
+    CAPA_INCREMENTAL    = (1 << 3)
 };
 
 enum settype {
@@ -102,6 +114,14 @@ struct mbent_queue
     struct mbent **tail;
 };
 
+/* Updates from the master collected by cmd_change, to be written in a
+ * single mailboxes.db transaction (pass as the callback context) */
+struct mupdate_batch {
+    ptrarray_t pending;         /* struct mbent *, in arrival order */
+    size_t bytes;               /* ... and their size */
+    struct timeval start;       /* when the first arrived */
+};
+
 /* Used to free malloc'd mbent's */
 void free_mbent(struct mbent *p);
 
@@ -109,9 +129,17 @@ void free_mbent(struct mbent *p);
 int cmd_change(struct mupdate_mailboxdata *mdata,
                const char *cmd, void *context);
 
+/* Commit the batched updates, if any, and reset the batch */
+int mupdate_batch_commit(struct mupdate_batch *batch);
+
 int mupdate_synchronize_remote(mupdate_handle *handle,
                                struct mbent_queue *remote_boxes,
                                struct mpool *pool);
+/* Ask for the updates since the given SEQ marker, applying them with
+ * cmd_change.  Returns MUPDATE_NO if the master can't resume from there */
+int mupdate_synchronize_since(mupdate_handle *handle,
+                              unsigned long epoch, unsigned long seq,
+                              struct mupdate_batch *batch);
 /* Given an mbent_queue, will synchronize the local database to it */
 int mupdate_synchronize(struct mbent_queue *remote_boxes, struct mpool *pool);
 
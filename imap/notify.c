@@ -44,6 +44,7 @@
 #include <config.h>
 #endif
 
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <syslog.h>
@@ -225,6 +226,58 @@ done:
     return r;
 }
 
+static void notify_sockaddr(struct sockaddr_un *sun_data,
+                            const char *notify_sock)
+{
+    memset((char *)sun_data, 0, sizeof(*sun_data));
+    sun_data->sun_family = AF_UNIX;
+    if (notify_sock) {
+        strlcpy(sun_data->sun_path, notify_sock, sizeof(sun_data->sun_path));
+    }
+    else {
+        strlcpy(sun_data->sun_path, config_dir, sizeof(sun_data->sun_path));
+        strlcat(sun_data->sun_path,
+                FNAME_NOTIFY_SOCK, sizeof(sun_data->sun_path));
+    }
+}
+
+/*
+ * build request of the form:
+ *
+ * method NUL class NUL priority NUL user NUL mailbox NUL
+ *   nopt NUL N(option NUL) message NUL
+ */
+static int notify_datagram(char *buf, int *buflen, const char *method,
+                           const char *class, const char *priority,
+                           const char *user, const char *mailbox,
+                           int nopt, const char **options,
+                           const char *message, const char *fname)
+{
+    char noptstr[20];
+    int i, r = 0;
+
+    buf[0] = '\0';
+    *buflen = 0;
+
+    r = add_arg(buf, NOTIFY_MAXSIZE, method, buflen);
+    if (!r) r = add_arg(buf, NOTIFY_MAXSIZE, class, buflen);
+    if (!r) r = add_arg(buf, NOTIFY_MAXSIZE, priority, buflen);
+    if (!r) r = add_arg(buf, NOTIFY_MAXSIZE, user, buflen);
+    if (!r) r = add_arg(buf, NOTIFY_MAXSIZE, mailbox, buflen);
+
+    snprintf(noptstr, sizeof(noptstr), "%d", nopt);
+    if (!r) r = add_arg(buf, NOTIFY_MAXSIZE, noptstr, buflen);
+
+    for (i = 0; !r && i < nopt; i++) {
+        r = add_arg(buf, NOTIFY_MAXSIZE, options[i], buflen);
+    }
+
+    if (!r) r = add_arg(buf, NOTIFY_MAXSIZE, message, buflen);
+    if (!r && fname) r = add_arg(buf, NOTIFY_MAXSIZE, fname, buflen);
+
+    return r;
+}
+
 EXPORTED void notify(const char *method,
             const char *class, const char *priority,
             const char *user, const char *mailbox,
@@ -234,9 +287,9 @@ EXPORTED void notify(const char *method,
     const char *notify_sock = config_getstring(IMAPOPT_NOTIFYSOCKET);
     int soc = -1;
     struct sockaddr_un sun_data;
-    char buf[NOTIFY_MAXSIZE] = "", noptstr[20];
+    char buf[NOTIFY_MAXSIZE] = "";
     int buflen = 0;
-    int i, r = 0;
+    int r = 0;
 
     if (!strncmp(notify_sock, "dlist:", 6)) {
         notify_dlist(notify_sock+6, method, class, priority,
@@ -251,40 +304,10 @@ EXPORTED void notify(const char *method,
         goto out;
     }
 
-    memset((char *)&sun_data, 0, sizeof(sun_data));
-    sun_data.sun_family = AF_UNIX;
-    if (notify_sock) {
-        strlcpy(sun_data.sun_path, notify_sock, sizeof(sun_data.sun_path));
-    }
-    else {
-        strlcpy(sun_data.sun_path, config_dir, sizeof(sun_data.sun_path));
-        strlcat(sun_data.sun_path,
-                FNAME_NOTIFY_SOCK, sizeof(sun_data.sun_path));
-    }
-
-    /*
-     * build request of the form:
-     *
-     * method NUL class NUL priority NUL user NUL mailbox NUL
-     *   nopt NUL N(option NUL) message NUL
-     */
-
-    r = add_arg(buf, sizeof(buf), method, &buflen);
-    if (!r) r = add_arg(buf, sizeof(buf), class, &buflen);
-    if (!r) r = add_arg(buf, sizeof(buf), priority, &buflen);
-    if (!r) r = add_arg(buf, sizeof(buf), user, &buflen);
-    if (!r) r = add_arg(buf, sizeof(buf), mailbox, &buflen);
-
-    snprintf(noptstr, sizeof(noptstr), "%d", nopt);
-    if (!r) r = add_arg(buf, sizeof(buf), noptstr, &buflen);
-
-    for (i = 0; !r && i < nopt; i++) {
-        r = add_arg(buf, sizeof(buf), options[i], &buflen);
-    }
-
-    if (!r) r = add_arg(buf, sizeof(buf), message, &buflen);
-    if (!r && fname) r = add_arg(buf, sizeof(buf), fname, &buflen);
+    notify_sockaddr(&sun_data, notify_sock);
 
+    r = notify_datagram(buf, &buflen, method, class, priority,
+                        user, mailbox, nopt, options, message, fname);
     if (r) {
         syslog(LOG_ERR, "notify datagram too large, %s, %s",
                user, mailbox);
@@ -306,3 +329,67 @@ EXPORTED void notify(const char *method,
 out:
     xclose(soc);
 }
+
+/*
+ * Send a batch of messages for the same method and class over a single
+ * notify socket.  If nonblock is set, stop as soon as the socket would
+ * block so that the caller can retry the rest later.
+ *
+ * Returns the number of messages consumed (sent, or discarded because
+ * they could never be sent), or -1 if the socket is unusable.
+ */
+EXPORTED int notify_batch(const char *method, const char *class,
+                          int nmsg, const char **messages, int nonblock)
+{
+    const char *notify_sock = config_getstring(IMAPOPT_NOTIFYSOCKET);
+    int soc = -1;
+    struct sockaddr_un sun_data;
+    char buf[NOTIFY_MAXSIZE] = "";
+    int buflen = 0;
+    int n = 0, r;
+
+    if (!nmsg) return 0;
+
+    if (!strncmp(notify_sock, "dlist:", 6)) {
+        /* the dlist protocol is request/response, one at a time */
+        for (n = 0; n < nmsg; n++) {
+            notify_dlist(notify_sock+6, method, class, NULL, NULL, NULL,
+                         0, NULL, messages[n], NULL);
+        }
+        return n;
+    }
+
+    soc = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (soc == -1) {
+        syslog(LOG_ERR, "unable to create notify socket(): %m");
+        return -1;
+    }
+
+    notify_sockaddr(&sun_data, notify_sock);
+
+    for (n = 0; n < nmsg; n++) {
+        if (notify_datagram(buf, &buflen, method, class, NULL, NULL, NULL,
+                            0, NULL, messages[n], NULL)) {
+            syslog(LOG_ERR, "notify datagram too large, %s", method);
+            continue;
+        }
+
+        r = sendto(soc, buf, buflen, nonblock ? MSG_DONTWAIT : 0,
+                   (struct sockaddr *)&sun_data, sizeof(sun_data));
+
+        if (r < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+
+            syslog(LOG_ERR, "unable to sendto() notify socket: %m");
+            if (!n) n = -1;
+            break;
+        }
+        if (r < buflen) {
+            syslog(LOG_ERR, "short write to notify socket");
+        }
+    }
+
+    xclose(soc);
+
+    return n;
+}
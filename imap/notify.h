@@ -49,6 +49,11 @@ void notify(const char *method,
             int nopt, const char **options,
             const char *message, const char *fname);
 
+/* Send a batch of messages for the same method and class.  Returns the
+ * number of messages consumed, or -1 if the notify socket is unusable. */
+int notify_batch(const char *method, const char *class,
+                 int nmsg, const char **messages, int nonblock);
+
 int notify_at(time_t when, const char *method,
             const char *class, const char *priority,
             const char *user, const char *mboxname,
@@ -53,6 +53,7 @@
 #include <config.h>
 
 #define FNAME_QUOTADB "/quotas.db"
+#define FNAME_QUOTALEDGERDIR "/quotaledger"
 
 /* Define the proper quota type, which is 64 bit and signed */
 typedef long long int quota_t;
@@ -83,6 +84,9 @@ struct quota {
     /* information for scanning */
     char *scanmbox;
     quota_t scanuseds[QUOTA_NUMRESOURCES];
+
+    /* last quota ledger entry included in useds */
+    bit64 ledgerseq;
 };
 
 /* special value to indicate no limit applies */
@@ -45,11 +45,15 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/stat.h>
 
+#include "cyr_lock.h"
 #include "cyrusdb.h"
 #include "dlist.h"
 #include "exitcodes.h"
@@ -58,6 +62,7 @@
 #include "mboxname.h"
 #include "mboxevent.h"
 #include "quota.h"
+#include "retry.h"
 #include "util.h"
 #include "xmalloc.h"
 #include "xstrlcpy.h"
@@ -76,6 +81,9 @@ static struct mboxlock *qchangelock;
 
 static int quota_dbopen = 0;
 
+/* whether quota ledgers may exist; -1 until ledger_leftovers() looks */
+static int ledger_leftover = -1;
+
 /* keywords used when storing fields in the new quota db format */
 static const char * const quota_db_names[QUOTA_NUMRESOURCES] = {
     "S",        /* QUOTA_STORAGE */
@@ -151,6 +159,7 @@ EXPORTED void quota_free(struct quota *q)
 static int quota_parseval(const char *data, size_t datalen,
                           struct quota *quota, int iswrite)
 {
+    bit64 ledgerseq;
     strarray_t *fields = NULL;
     int r = IMAP_MAILBOX_BADFORMAT;
     int i = 0;
@@ -173,6 +182,9 @@ static int quota_parseval(const char *data, size_t datalen,
             if (val) quota->limits[res] = dlist_num(val);
         }
 
+        if (dlist_getnum64(dl, "LEDGER", &ledgerseq))
+            quota->ledgerseq = ledgerseq;
+
         /* only read the SCAN stuff if it's a write lock */
         if (iswrite) {
             struct dlist *scan = dlist_getchild(dl, "SCAN");
@@ -225,9 +237,11 @@ out:
 }
 
 /*
- * Read the quota entry 'quota'
+ * Read the quota entry 'quota' straight from the db, ignoring the ledger.
+ * The SCAN fields are only parsed if 'scan' is set.
  */
-EXPORTED int quota_read(struct quota *quota, struct txn **tid, int wrlock)
+static int quota_read_db(struct quota *quota, struct txn **tid,
+                         int wrlock, int scan)
 {
     int r;
     size_t qrlen;
@@ -248,7 +262,7 @@ EXPORTED int quota_read(struct quota *quota, struct txn **tid, int wrlock)
     switch (r) {
     case CYRUSDB_OK:
         if (!*data) return IMAP_QUOTAROOT_NONEXISTENT;
-        r = quota_parseval(data, datalen, quota, wrlock);
+        r = quota_parseval(data, datalen, quota, scan);
         if (r) {
             syslog(LOG_ERR, "DBERROR: error fetching quota "
                             "root=<%s> value=<%s>",
@@ -273,6 +287,440 @@ EXPORTED int quota_read(struct quota *quota, struct txn **tid, int wrlock)
     return 0;
 }
 
+/*
+ * Quota ledger.
+ *
+ * With quota_ledger enabled, usage changes are appended to a small
+ * per-quotaroot journal instead of rewriting the quota db record (and
+ * taking the db's global write lock) on every append and expunge.  The
+ * journal is folded into the db once it holds quota_ledger_maxentries
+ * entries or its oldest entry is quota_ledger_interval seconds old.
+ *
+ * Every entry carries a sequence number and the db record remembers the
+ * last one folded into it, so an entry is counted exactly once even if
+ * we crash between committing the db and truncating the journal.
+ * Readers add any newer entries to the stored usage, so quota checks
+ * still see the exact figure.
+ *
+ * The ledger is always locked before the quota db, never after.
+ */
+
+#define LEDGER_HEADER_LEN 21    /* "%020llu\n" */
+
+struct ledger_entry {
+    bit64 seq;
+    time_t stamp;
+    quota_t diff[QUOTA_NUMRESOURCES];
+    char *mboxname;
+};
+
+struct ledger {
+    int fd;
+    char *fname;
+    bit64 base;             /* everything up to here is in the db */
+    bit64 lastseq;
+    off_t goodlen;          /* end of the last complete entry, 0 if new */
+    int count;
+    int alloc;
+    struct ledger_entry *entries;
+};
+
+#define LEDGER_INITIALIZER { -1, NULL, 0, 0, 0, 0, 0, NULL }
+
+enum {
+    LEDGER_SHARED =     0,
+    LEDGER_EXCLUSIVE =  (1<<0),
+    LEDGER_NOLOCK =     (1<<1),
+    LEDGER_CREATE =     (1<<2)
+};
+
+static char *ledger_fname(const char *root)
+{
+    char basepath[MAX_MAILBOX_PATH+1];
+    char path[MAX_MAILBOX_PATH+1];
+
+    snprintf(basepath, MAX_MAILBOX_PATH, "%s%s",
+             config_dir, FNAME_QUOTALEDGERDIR);
+    mboxname_hash(path, MAX_MAILBOX_PATH, basepath, root);
+
+    return strconcat(path, ".ledger", (char *)NULL);
+}
+
+static void ledger_free_entries(struct ledger *l)
+{
+    int i;
+
+    for (i = 0; i < l->count; i++)
+        free(l->entries[i].mboxname);
+    free(l->entries);
+    l->entries = NULL;
+    l->count = l->alloc = 0;
+}
+
+static void ledger_push(struct ledger *l, const struct ledger_entry *e)
+{
+    if (l->count == l->alloc) {
+        l->alloc = l->alloc ? l->alloc * 2 : 16;
+        l->entries = xrealloc(l->entries, l->alloc * sizeof(*e));
+    }
+    l->entries[l->count++] = *e;
+    l->lastseq = e->seq;
+}
+
+/* parse entries up to the first incomplete or out of order line,
+ * which can only be the remains of an interrupted append */
+static void ledger_parse(struct ledger *l, const char *base, size_t len)
+{
+    const char *p = base + LEDGER_HEADER_LEN;
+    const char *end = base + len;
+
+    l->base = l->lastseq = strtoull(base, NULL, 10);
+    l->goodlen = LEDGER_HEADER_LEN;
+
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        struct ledger_entry e;
+        char *q;
+        int res;
+
+        if (!eol) break;
+
+        e.seq = strtoull(p, &q, 10);
+        e.stamp = strtol(q, &q, 10);
+        for (res = 0; res < QUOTA_NUMRESOURCES; res++)
+            e.diff[res] = strtoll(q, &q, 10);
+        if (q >= eol || *q != ' ' || e.seq <= l->lastseq) break;
+
+        e.mboxname = xstrndup(q + 1, eol - q - 1);
+        ledger_push(l, &e);
+
+        p = eol + 1;
+        l->goodlen = p - base;
+    }
+}
+
+static void ledger_close(struct ledger *l)
+{
+    ledger_free_entries(l);
+    if (l->fd != -1) {
+        /* a no-op if it was read with LEDGER_NOLOCK */
+        lock_unlock(l->fd, l->fname);
+        close(l->fd);
+    }
+    free(l->fname);
+    l->fname = NULL;
+    l->fd = -1;
+}
+
+/*
+ * Open and lock the ledger for 'root' and read its entries.
+ * Returns 0 on success, nonzero if there is no ledger.
+ *
+ * LEDGER_NOLOCK reads it without taking the lock, for readers already
+ * inside a quota db transaction.  That is safe as long as the db record
+ * is read afterwards: a flush only empties the ledger once its entries
+ * are committed to the db, the sequence numbers keep them from being
+ * counted twice, and ledger_parse() ignores a torn append.
+ */
+static int ledger_open(const char *root, int flags, struct ledger *l)
+{
+    int oflags = (flags & LEDGER_CREATE) ? O_RDWR | O_CREAT : O_RDWR;
+    struct stat sbuf, fbuf;
+    char *data = NULL;
+
+    l->fname = ledger_fname(root);
+
+    for (;;) {
+        l->fd = open(l->fname, oflags, 0666);
+        if (l->fd == -1 && errno == ENOENT && (flags & LEDGER_CREATE)) {
+            if (!cyrus_mkdir(l->fname, 0755))
+                l->fd = open(l->fname, oflags, 0666);
+        }
+        if (l->fd == -1) {
+            if (errno != ENOENT)
+                syslog(LOG_ERR, "IOERROR: opening quota ledger %s: %m",
+                       l->fname);
+            goto fail;
+        }
+
+        if (flags & LEDGER_NOLOCK) {
+            if (fstat(l->fd, &sbuf) == -1) {
+                syslog(LOG_ERR, "IOERROR: stating quota ledger %s: %m",
+                       l->fname);
+                goto fail;
+            }
+            break;
+        }
+
+        if (lock_setlock(l->fd, flags & LEDGER_EXCLUSIVE, 0, l->fname)) {
+            syslog(LOG_ERR, "IOERROR: locking quota ledger %s: %m", l->fname);
+            goto fail;
+        }
+
+        if (fstat(l->fd, &sbuf) == -1) {
+            syslog(LOG_ERR, "IOERROR: stating quota ledger %s: %m", l->fname);
+            goto fail;
+        }
+
+        /* make sure it wasn't unlinked by quota_deleteroot() while we
+         * waited for the lock */
+        if (stat(l->fname, &fbuf) == 0 && sbuf.st_ino == fbuf.st_ino)
+            break;
+
+        lock_unlock(l->fd, l->fname);
+        close(l->fd);
+        l->fd = -1;
+    }
+
+    if (sbuf.st_size < LEDGER_HEADER_LEN)
+        return 0;   /* new ledger, header written on first append */
+
+    data = xmalloc(sbuf.st_size + 1);
+    if (retry_read(l->fd, data, sbuf.st_size) != sbuf.st_size) {
+        syslog(LOG_ERR, "IOERROR: reading quota ledger %s: %m", l->fname);
+        goto fail;
+    }
+    data[sbuf.st_size] = '\0';
+
+    ledger_parse(l, data, sbuf.st_size);
+    free(data);
+
+    /* drop a torn entry left behind by a crash */
+    if ((flags & LEDGER_EXCLUSIVE) && !(flags & LEDGER_NOLOCK) &&
+        l->goodlen < sbuf.st_size) {
+        syslog(LOG_NOTICE, "quota ledger %s: discarding %lld trailing bytes",
+               l->fname, (long long)(sbuf.st_size - l->goodlen));
+        if (ftruncate(l->fd, l->goodlen) == -1) {
+            syslog(LOG_ERR, "IOERROR: truncating quota ledger %s: %m",
+                   l->fname);
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    free(data);
+    ledger_close(l);
+    return -1;
+}
+
+/* add the entries the db hasn't seen yet to 'q' */
+static void ledger_apply(const struct ledger *l, struct quota *q)
+{
+    int i, res;
+
+    for (i = 0; i < l->count; i++) {
+        const struct ledger_entry *e = &l->entries[i];
+        int cmp = 1;
+
+        if (e->seq <= q->ledgerseq) continue;
+
+        if (q->scanmbox) {
+            cmp = cyrusdb_compar(qdb, e->mboxname, strlen(e->mboxname),
+                                 q->scanmbox, strlen(q->scanmbox));
+        }
+        for (res = 0; res < QUOTA_NUMRESOURCES; res++) {
+            quota_use(q, res, e->diff[res]);
+            if (cmp <= 0)
+                q->scanuseds[res] += e->diff[res];
+        }
+        q->ledgerseq = e->seq;
+    }
+}
+
+static int ledger_append(struct ledger *l,
+                         const quota_t diff[QUOTA_NUMRESOURCES],
+                         const char *mboxname)
+{
+    struct buf buf = BUF_INITIALIZER;
+    struct ledger_entry e;
+    off_t offset = l->goodlen;
+    int res;
+    int r = 0;
+
+    if (!mboxname) mboxname = "";
+
+    if (!l->goodlen) {
+        buf_printf(&buf, "%020llu\n", (unsigned long long)l->base);
+        l->lastseq = l->base;
+    }
+
+    e.seq = l->lastseq + 1;
+    e.stamp = time(NULL);
+    buf_printf(&buf, "%llu %ld", (unsigned long long)e.seq, (long)e.stamp);
+    for (res = 0; res < QUOTA_NUMRESOURCES; res++) {
+        e.diff[res] = diff[res];
+        buf_printf(&buf, " " QUOTA_T_FMT, diff[res]);
+    }
+    buf_printf(&buf, " %s\n", mboxname);
+
+    if (lseek(l->fd, offset, SEEK_SET) == -1 ||
+        retry_write(l->fd, buf.s, buf.len) != (ssize_t)buf.len ||
+        fsync(l->fd) == -1) {
+        syslog(LOG_ERR, "IOERROR: appending to quota ledger %s: %m",
+               l->fname);
+        r = IMAP_IOERROR;
+        goto done;
+    }
+
+    e.mboxname = xstrdup(mboxname);
+    ledger_push(l, &e);
+    l->goodlen = offset + buf.len;
+
+done:
+    buf_free(&buf);
+    return r;
+}
+
+static int ledger_due(const struct ledger *l)
+{
+    if (!l->count) return 0;
+
+    if (l->count >= config_getint(IMAPOPT_QUOTA_LEDGER_MAXENTRIES))
+        return 1;
+
+    return time(NULL) - l->entries[0].stamp >=
+        config_getint(IMAPOPT_QUOTA_LEDGER_INTERVAL);
+}
+
+/* empty the ledger once everything up to 'seq' is safely in the db */
+static int ledger_reset(struct ledger *l, bit64 seq)
+{
+    char header[LEDGER_HEADER_LEN+1];
+
+    snprintf(header, sizeof(header), "%020llu\n", (unsigned long long)seq);
+
+    if (pwrite(l->fd, header, LEDGER_HEADER_LEN, 0) != LEDGER_HEADER_LEN ||
+        ftruncate(l->fd, LEDGER_HEADER_LEN) == -1 ||
+        fsync(l->fd) == -1) {
+        syslog(LOG_ERR, "IOERROR: truncating quota ledger %s: %m", l->fname);
+        return IMAP_IOERROR;
+    }
+
+    ledger_free_entries(l);
+    l->base = l->lastseq = seq;
+    l->goodlen = LEDGER_HEADER_LEN;
+
+    return 0;
+}
+
+/* fold the ledger into the db record; the ledger must be locked exclusively */
+static int ledger_flush(struct ledger *l, const char *root)
+{
+    struct quota q;
+    struct txn *tid = NULL;
+    int r;
+
+    if (!l->count) return 0;
+
+    quota_init(&q, root);
+
+    r = quota_read_db(&q, &tid, /*wrlock*/1, /*scan*/1);
+    if (r == IMAP_QUOTAROOT_NONEXISTENT) {
+        /* root went away, nothing left to account to */
+        quota_abort(&tid);
+        r = ledger_reset(l, l->lastseq);
+        goto done;
+    }
+    if (!r) {
+        ledger_apply(l, &q);
+        r = quota_write(&q, &tid);
+    }
+    if (r) {
+        quota_abort(&tid);
+        goto done;
+    }
+
+    /* the ledger may only be emptied if the commit really happened */
+    r = cyrusdb_commit(qdb, tid);
+    if (r) {
+        syslog(LOG_ERR, "IOERROR: committing quota: %s",
+               cyrusdb_strerror(r));
+        r = IMAP_IOERROR;
+        goto done;
+    }
+
+    r = ledger_reset(l, q.ledgerseq);
+
+done:
+    if (r) {
+        syslog(LOG_ERR, "IOERROR: flushing quota ledger for %s: %s",
+               root, error_message(r));
+    }
+    quota_free(&q);
+    return r;
+}
+
+/*
+ * Whether there may be ledgers left behind by an earlier run with
+ * quota_ledger enabled.  Nothing creates them while it's disabled, so
+ * one look at the directory each time the db is opened will do.
+ */
+static int ledger_leftovers(void)
+{
+    if (ledger_leftover == -1) {
+        char *dir = strconcat(config_dir, FNAME_QUOTALEDGERDIR, (char *)NULL);
+        struct stat sbuf;
+
+        ledger_leftover = (stat(dir, &sbuf) == 0);
+        free(dir);
+    }
+
+    return ledger_leftover;
+}
+
+/* fold a ledger left behind with quota_ledger disabled into the db and
+ * remove it, so its entries can't be counted again if it's re-enabled */
+static void ledger_retire(const char *root)
+{
+    struct ledger ledger = LEDGER_INITIALIZER;
+
+    if (ledger_open(root, LEDGER_EXCLUSIVE, &ledger))
+        return;
+
+    if (!ledger_flush(&ledger, root) && unlink(ledger.fname) == -1)
+        syslog(LOG_ERR, "IOERROR: unlinking quota ledger %s: %m",
+               ledger.fname);
+
+    ledger_close(&ledger);
+}
+
+/*
+ * Read the quota entry 'quota', including any usage still in the ledger
+ */
+EXPORTED int quota_read(struct quota *quota, struct txn **tid, int wrlock)
+{
+    struct ledger ledger = LEDGER_INITIALIZER;
+    int flags = LEDGER_SHARED;
+    int noledger = 1;
+    int r;
+
+    /* a ledger left over from before quota_ledger was disabled still
+     * counts until it's folded in, and a quota -f writing this record
+     * back covers its entries */
+    if (!config_getswitch(IMAPOPT_QUOTA_LEDGER) && !ledger_leftovers())
+        return quota_read_db(quota, tid, wrlock, wrlock);
+
+    /* if we're already inside a db transaction we can't wait for the
+     * ledger without risking a deadlock against a flush, so read it
+     * unlocked; the db record is read after it, either way */
+    if (tid && *tid)
+        flags |= LEDGER_NOLOCK;
+
+    /* the shared lock keeps the ledger from being flushed between
+     * reading the db and reading the entries */
+    if (quota->root && *quota->root)
+        noledger = ledger_open(quota->root, flags, &ledger);
+
+    r = quota_read_db(quota, tid, wrlock, wrlock);
+    if (!r && !noledger)
+        ledger_apply(&ledger, quota);
+
+    ledger_close(&ledger);
+    return r;
+}
+
 EXPORTED int quota_check(const struct quota *q,
                 enum quota_resource res, quota_t delta)
 {
@@ -421,6 +869,9 @@ EXPORTED int quota_write(struct quota *quota, struct txn **tid)
             dlist_setnum64(item, NULL, quota->limits[res]);
     }
 
+    if (quota->ledgerseq)
+        dlist_setnum64(dl, "LEDGER", quota->ledgerseq);
+
     if (quota->scanmbox) {
         struct dlist *scan = dlist_newkvlist(dl, "SCAN");
         dlist_setatom(scan, "MBOX", quota->scanmbox);
@@ -453,12 +904,41 @@ EXPORTED int quota_write(struct quota *quota, struct txn **tid)
     return r;
 }
 
+/* apply 'diff' to 'q', queueing QuotaWithin events for anything that
+ * drops back under its limit */
+static void quota_apply_useds(struct quota *q,
+                              const quota_t diff[QUOTA_NUMRESOURCES],
+                              const char *mboxname,
+                              struct mboxevent **mboxevents)
+{
+    int res;
+    int cmp = 1;
+
+    if (q->scanmbox) {
+        cmp = cyrusdb_compar(qdb, mboxname, strlen(mboxname),
+                             q->scanmbox, strlen(q->scanmbox));
+    }
+    for (res = 0; res < QUOTA_NUMRESOURCES; res++) {
+        int was_over = quota_is_overquota(q, res, NULL);
+        quota_use(q, res, diff[res]);
+        if (cmp <= 0)
+            q->scanuseds[res] += diff[res];
+
+        if (was_over && !quota_is_overquota(q, res, NULL)) {
+            struct mboxevent *mboxevent =
+                mboxevent_enqueue(EVENT_QUOTA_WITHIN, mboxevents);
+            mboxevent_extract_quota(mboxevent, q, res);
+        }
+    }
+}
+
 EXPORTED int quota_update_useds(const char *quotaroot,
                        const quota_t diff[QUOTA_NUMRESOURCES],
                        const char *mboxname)
 {
     struct quota q;
     struct txn *tid = NULL;
+    struct ledger ledger = LEDGER_INITIALIZER;
     int r = 0;
     struct mboxevent *mboxevents = NULL;
 
@@ -467,27 +947,45 @@ EXPORTED int quota_update_useds(const char *quotaroot,
 
     quota_init(&q, quotaroot);
 
-    r = quota_read(&q, &tid, 1);
+    if (config_getswitch(IMAPOPT_QUOTA_LEDGER) &&
+        !ledger_open(quotaroot, LEDGER_EXCLUSIVE|LEDGER_CREATE, &ledger)) {
+        r = quota_read_db(&q, NULL, /*wrlock*/0, /*scan*/1);
+        if (r) goto out;
 
-    if (!r) {
-        int res;
-        int cmp = 1;
-        if (q.scanmbox) {
-            cmp = cyrusdb_compar(qdb, mboxname, strlen(mboxname),
-                                 q.scanmbox, strlen(q.scanmbox));
-        }
-        for (res = 0; res < QUOTA_NUMRESOURCES; res++) {
-            int was_over = quota_is_overquota(&q, res, NULL);
-            quota_use(&q, res, diff[res]);
-            if (cmp <= 0)
-                q.scanuseds[res] += diff[res];
+        if (!q.scanmbox) {
+            if (!ledger.goodlen)
+                ledger.base = q.ledgerseq;
+            ledger_apply(&ledger, &q);
+            quota_apply_useds(&q, diff, mboxname, &mboxevents);
 
-            if (was_over && !quota_is_overquota(&q, res, NULL)) {
-                struct mboxevent *mboxevent =
-                    mboxevent_enqueue(EVENT_QUOTA_WITHIN, &mboxevents);
-                mboxevent_extract_quota(mboxevent, &q, res);
-            }
+            r = ledger_append(&ledger, diff, mboxname);
+            if (r) goto out;
+
+            /* a failed flush leaves the entries for next time */
+            if (ledger_due(&ledger))
+                ledger_flush(&ledger, quotaroot);
+
+            goto done;
         }
+
+        /* quota -f is scanning this root: it compares each change
+         * against its position, so write straight to the db */
+        r = ledger_flush(&ledger, quotaroot);
+        if (r) goto out;
+
+        quota_free(&q);
+        quota_init(&q, quotaroot);
+    }
+    else if (!config_getswitch(IMAPOPT_QUOTA_LEDGER) && ledger_leftovers()) {
+        ledger_retire(quotaroot);
+    }
+
+    /* the ledger is either off, empty or unusable here, so it's not
+     * read again; in the last case pending entries stay pending */
+    r = quota_read_db(&q, &tid, /*wrlock*/1, /*scan*/1);
+
+    if (!r) {
+        quota_apply_useds(&q, diff, mboxname, &mboxevents);
         r = quota_write(&q, &tid);
     }
 
@@ -497,9 +995,11 @@ EXPORTED int quota_update_useds(const char *quotaroot,
     }
     quota_commit(&tid);
 
+done:
     mboxevent_notify(&mboxevents);
 
 out:
+    ledger_close(&ledger);
     quota_free(&q);
     if (r) {
         syslog(LOG_ERR, "LOSTQUOTA: unable to record change of "
@@ -556,13 +1056,27 @@ done:
  */
 EXPORTED int quota_deleteroot(const char *quotaroot)
 {
+    struct ledger ledger = LEDGER_INITIALIZER;
+    int noledger;
     int r;
 
     if (!quotaroot || !*quotaroot)
         return IMAP_QUOTAROOT_NONEXISTENT;
 
+    /* keep appends and flushes out until the ledger is gone;
+     * the ledger is locked before the db, as always */
+    noledger = ledger_open(quotaroot, LEDGER_EXCLUSIVE, &ledger);
+
     r = cyrusdb_delete(qdb, quotaroot, strlen(quotaroot), NULL, 0);
 
+    if (!noledger && (!r || r == CYRUSDB_NOTFOUND)) {
+        /* pending usage dies with the root */
+        if (unlink(ledger.fname) == -1)
+            syslog(LOG_ERR, "IOERROR: unlinking quota ledger %s: %m",
+                   ledger.fname);
+    }
+    ledger_close(&ledger);
+
     switch (r) {
     case CYRUSDB_OK:
     case CYRUSDB_NOTFOUND:  /* shouldn't happen anyway */
@@ -644,6 +1158,7 @@ EXPORTED void quotadb_open(const char *fname)
 
     free(tofree);
 
+    ledger_leftover = -1;
     quota_dbopen = 1;
 }
 
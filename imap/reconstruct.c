@@ -54,6 +54,7 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #ifdef HAVE_ZLIB
 #include <zlib.h>
 #endif
@@ -81,6 +82,7 @@
 #ifdef WITH_DAV
 #include "caldav_db.h"
 #include "carddav_db.h"
+#include "dav_db.h"
 #include "webdav_db.h"
 #endif
 #include "crc32.h"
@@ -119,10 +121,17 @@ struct reconstruct_rock {
     hash_table visited;
 };
 
+/* mailboxes being reconstructed by child processes */
+struct reconstruct_job {
+    pid_t pid;
+    char *name;
+};
+
 /* forward declarations */
 static void do_mboxlist(void);
 static int do_reconstruct_p(const mbentry_t *mbentry, void *rock);
 static int do_reconstruct(struct findall_data *data, void *rock);
+static void reconstruct_wait(struct reconstruct_rock *rrock, int all);
 static void usage(void);
 
 extern cyrus_acl_canonproc_t mboxlist_ensureOwnerRights;
@@ -130,6 +139,11 @@ extern cyrus_acl_canonproc_t mboxlist_ensureOwnerRights;
 static int reconstruct_flags = RECONSTRUCT_MAKE_CHANGES | RECONSTRUCT_DO_STAT;
 static int setversion = 0;
 
+/* number of mailboxes to reconstruct at once, 0 for one at a time */
+static int jobs = 0;
+static struct reconstruct_job *running = NULL;
+static int nrunning = 0;
+
 int main(int argc, char **argv)
 {
     int opt, i, r;
@@ -138,6 +152,7 @@ int main(int argc, char **argv)
     int mflag = 0;
     int fflag = 0;
     int xflag = 0;
+    int parse_workers = 0;
     struct buf buf = BUF_INITIALIZER;
     char *alt_config = NULL;
     char *start_part = NULL;
@@ -149,7 +164,7 @@ int main(int argc, char **argv)
 
     construct_hash_table(&unqid_table, 2047, 1);
 
-    while ((opt = getopt(argc, argv, "C:kp:rmfsxgGqRUMoOnV:u")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:kp:rmfsxgGqRUMoOnV:uj:w:")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -230,6 +245,17 @@ int main(int argc, char **argv)
                 setversion = atoi(optarg);
             break;
 
+        case 'j':
+            jobs = atoi(optarg);
+            if (jobs < 1) usage();
+            if (jobs == 1) jobs = 0;
+            break;
+
+        case 'w':
+            parse_workers = atoi(optarg);
+            if (parse_workers < 1) usage();
+            break;
+
         default:
             usage();
         }
@@ -246,6 +272,10 @@ int main(int argc, char **argv)
 
     sync_log_init();
 
+    mailbox_reconstruct_set_workers(parse_workers);
+    if (jobs)
+        running = xzmalloc(jobs * sizeof(struct reconstruct_job));
+
     if (mflag) {
         if (rflag || fflag || optind != argc) {
             cyrus_done();
@@ -335,8 +365,30 @@ int main(int argc, char **argv)
 
     for (i = optind; i < argc; i++) {
         if (dousers) {
+#ifdef WITH_DAV
+            /* Group the per-mailbox DAV DB commits into larger
+               transactions, but don't create a DAV DB if we have none */
+            sqldb_t *userdb = NULL;
+            struct stat sbuf;
+
+            /* (not when the mailboxes are done by separate processes,
+               they'd be waiting on our transaction) */
+            dav_getpath_byuserid(&buf, argv[i]);
+            if (!jobs && !stat(buf_cstring(&buf), &sbuf)) {
+                userdb = dav_open_userid(argv[i]);
+                if (userdb && sqldb_batch_begin(userdb, 100)) {
+                    sqldb_close(&userdb);
+                }
+            }
+#endif
             mboxlist_usermboxtree(argv[i], do_reconstruct_p, &rrock,
                                   MBOXTREE_TOMBSTONES|MBOXTREE_DELETED);
+#ifdef WITH_DAV
+            if (userdb) {
+                sqldb_batch_end(userdb);
+                sqldb_close(&userdb);
+            }
+#endif
             continue;
         }
         char *domain = NULL;
@@ -365,6 +417,9 @@ int main(int argc, char **argv)
         }
     }
 
+    /* let any mailboxes still going finish, they may discover more */
+    reconstruct_wait(&rrock, 1);
+
     /* examine our list to see if we discovered anything */
     while (rrock.discovered && rrock.discovered->count) {
         char *name = strarray_shift(rrock.discovered);
@@ -384,12 +439,16 @@ int main(int argc, char **argv)
         /* may have added more things into our list */
 
         free(name);
+
+        if (!rrock.discovered->count)
+            reconstruct_wait(&rrock, 1);
     }
 
     if (rrock.discovered) strarray_free(rrock.discovered);
     free_hash_table(&rrock.visited, NULL);
 
     free_hash_table(&unqid_table, free);
+    free(running);
 
     buf_free(&buf);
 
@@ -416,7 +475,8 @@ int main(int argc, char **argv)
 static void usage(void)
 {
     fprintf(stderr,
-            "usage: reconstruct [-C <alt_config>] [-p partition] [-ksrfxu] mailbox...\n");
+            "usage: reconstruct [-C <alt_config>] [-p partition] [-ksrfxu]\n"
+            "                   [-j jobs] [-w workers] mailbox...\n");
     fprintf(stderr, "       reconstruct [-C <alt_config>] -m\n");
     exit(EC_USAGE);
 }
@@ -435,40 +495,35 @@ static int do_reconstruct_p(const mbentry_t *mbentry, void *rock)
     return 0;
 }
 
-/*
- * mboxlist_findall() callback function to reconstruct a mailbox
- */
-static int do_reconstruct(struct findall_data *data, void *rock)
+static int reconstruct_one(const char *name)
 {
-    if (!data) return 0;
-    struct reconstruct_rock *rrock = (struct reconstruct_rock *) rock;
     int r;
-    char *other;
-    struct mailbox *mailbox = NULL;
-    char outpath[MAX_MAILBOX_PATH];
-    const char *name = NULL;
-
-    /* ignore partial matches */
-    if (!data->mbname) return 0;
-
-    signals_poll();
-
-    name = mbname_intname(data->mbname);
-
-    /* don't repeat */
-    if (hash_lookup(name, &rrock->visited)) return 0;
 
     r = mailbox_reconstruct(name, reconstruct_flags);
     if (r) {
         com_err(name, r, "%s",
                 (r == IMAP_IOERROR) ? error_message(errno) : "Failed to reconstruct mailbox");
-        return 0;
     }
 
+    return r;
+}
+
+/*
+ * Everything after the reconstruct itself: uniqueid clashes, version
+ * upgrades and discovering unknown child mailboxes.  Always done by the
+ * parent, which has the tables for the whole run.
+ */
+static void reconstruct_finish(const char *name, struct reconstruct_rock *rrock)
+{
+    int r;
+    char *other;
+    struct mailbox *mailbox = NULL;
+    char outpath[MAX_MAILBOX_PATH];
+
     r = mailbox_open_iwl(name, &mailbox);
     if (r) {
         com_err(name, r, "Failed to open after reconstruct");
-        return 0;
+        return;
     }
 
     other = hash_lookup(mailbox->uniqueid, &unqid_table);
@@ -509,16 +564,16 @@ static int do_reconstruct(struct findall_data *data, void *rock)
         struct stat sbuf;
 
         ptr = strstr(outpath, "cyrus.header");
-        if (!ptr) return 0;
+        if (!ptr) return;
         *ptr = 0;
 
         r = chdir(outpath);
-        if (r) return 0;
+        if (r) return;
 
         /* we recurse down this directory to see if there's any mailboxes
            under this not in the mailboxes database */
         dirp = opendir(".");
-        if (!dirp) return 0;
+        if (!dirp) return;
 
         while ((dirent = readdir(dirp)) != NULL) {
             /* mailbox directories never have a dot in them */
@@ -557,6 +612,111 @@ static int do_reconstruct(struct findall_data *data, void *rock)
      * we don't care about the value, it just needs to be a non-NULL pointer
      */
     hash_insert(name, &rrock, &rrock->visited);
+}
+
+/*
+ * Reap finished children, passing the ones which succeeded on to
+ * reconstruct_finish().  Waits for a free slot, or for all of them.
+ */
+static void reconstruct_wait(struct reconstruct_rock *rrock, int all)
+{
+    while (nrunning && (all || nrunning >= jobs)) {
+        int status = 0;
+        pid_t pid;
+        char *name;
+        int i;
+
+        pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "waitpid: %m");
+            nrunning = 0;
+            break;
+        }
+
+        for (i = 0; i < nrunning; i++) {
+            if (running[i].pid == pid) break;
+        }
+        if (i == nrunning) continue;
+
+        name = running[i].name;
+        running[i] = running[--nrunning];
+
+        if (WIFEXITED(status) && !WEXITSTATUS(status))
+            reconstruct_finish(name, rrock);
+
+        free(name);
+    }
+}
+
+/* reconstruct name in a child process, once there's a slot for it */
+static void reconstruct_spawn(const char *name, struct reconstruct_rock *rrock)
+{
+    pid_t pid;
+
+    reconstruct_wait(rrock, 0);
+
+    /* don't let the child repeat anything we've buffered */
+    fflush(stdout);
+    fflush(stderr);
+
+    pid = fork();
+    if (pid < 0) {
+        syslog(LOG_ERR, "fork: %m");
+        if (!reconstruct_one(name))
+            reconstruct_finish(name, rrock);
+        return;
+    }
+
+    if (!pid) {
+        int r;
+
+        /* don't share the parent's database handles */
+        mboxlist_close();
+        mboxlist_open(NULL);
+        quotadb_close();
+        quotadb_open(NULL);
+
+        r = reconstruct_one(name);
+
+        quotadb_close();
+        mboxlist_close();
+        exit(r ? 1 : 0);
+    }
+
+    running[nrunning].pid = pid;
+    running[nrunning].name = xstrdup(name);
+    nrunning++;
+}
+
+/*
+ * mboxlist_findall() callback function to reconstruct a mailbox
+ */
+static int do_reconstruct(struct findall_data *data, void *rock)
+{
+    if (!data) return 0;
+    struct reconstruct_rock *rrock = (struct reconstruct_rock *) rock;
+    const char *name = NULL;
+
+    /* ignore partial matches */
+    if (!data->mbname) return 0;
+
+    signals_poll();
+
+    name = mbname_intname(data->mbname);
+
+    /* don't repeat */
+    if (hash_lookup(name, &rrock->visited)) return 0;
+
+    if (jobs) {
+        /* mark it now, so it isn't started twice */
+        hash_insert(name, &rrock, &rrock->visited);
+        reconstruct_spawn(name, rrock);
+        return 0;
+    }
+
+    if (!reconstruct_one(name))
+        reconstruct_finish(name, rrock);
 
     return 0;
 }
@@ -994,14 +994,19 @@ static int run(search_builder_t *bx, search_hit_cb_t proc, void *rock)
     if (r) goto out;
 
     /* add in the unindexed uids as false positives */
-    if ((bb->opts & SEARCH_UNINDEXED)) {
+    if ((bb->opts & SEARCH_UNINDEXED) && bb->mailbox->i.last_uid) {
+        struct seqset *all = seqset_parse("1:*", NULL, bb->mailbox->i.last_uid);
+        struct seqset *unindexed = seqset_diff(all, bb->indexed);
         uint32_t uid;
-        for (uid = seqset_firstnonmember(bb->indexed);
-             uid <= bb->mailbox->i.last_uid ; uid++) {
-            xstats_inc(SPHINX_UNINDEXED);
+
+        seqset_free(all);
+        xstats_add(SPHINX_UNINDEXED, seqset_count(unindexed));
+        while ((uid = seqset_getnext(unindexed))) {
             r = proc(bb->mailbox->name, bb->mailbox->i.uidvalidity, uid, rock);
-            if (r) goto out;
+            if (r) break;
         }
+        seqset_free(unindexed);
+        if (r) goto out;
     }
 
 out:
@@ -183,13 +183,19 @@ static void seqset_simplify(struct seqset *set)
     if (!set->len)
         return;
 
-    /* Sort the ranges using our special comparator */
-    qsort(set->set, set->len, sizeof(struct seq_range), comp_coalesce);
+    /* Sort the ranges using our special comparator, unless they
+     * are already in order, as they nearly always are */
+    for (i = 1; i < set->len; i++) {
+        if (set->set[i].low < set->set[i-1].low) break;
+    }
+    if (i < set->len)
+        qsort(set->set, set->len, sizeof(struct seq_range), comp_coalesce);
 
     /* Merge intersecting/adjacent ranges */
     for (i = 1; i < set->len; i++) {
-        if ((int)(set->set[i].low - set->set[out].high) <= 1) {
-            set->set[out].high = set->set[i].high;
+        if (set->set[out].high == UINT_MAX ||
+            set->set[i].low <= set->set[out].high + 1) {
+            set->set[out].high = MAX(set->set[out].high, set->set[i].high);
         } else {
             out++;
             set->set[out].low = set->set[i].low;
@@ -201,6 +207,26 @@ static void seqset_simplify(struct seqset *set)
     set->len = out+1;
 }
 
+/* Append the range low:high to a set whose ranges are built in
+ * increasing order, merging it into the last range if they touch */
+static void seqset_append(struct seqset *set, unsigned low, unsigned high)
+{
+    struct seq_range *last = set->len ? &set->set[set->len-1] : NULL;
+
+    if (last && (last->high == UINT_MAX || low <= last->high + 1)) {
+        last->high = MAX(last->high, high);
+        return;
+    }
+
+    if (set->len == set->alloc) {
+        set->alloc += SETGROWSIZE;
+        set->set = xrealloc(set->set, set->alloc * sizeof(struct seq_range));
+    }
+    set->set[set->len].low = low;
+    set->set[set->len].high = high;
+    set->len++;
+}
+
 static int read_num(const char **input, unsigned maxval, unsigned *res)
 {
     const char *ptr = *input;
@@ -273,15 +299,19 @@ EXPORTED struct seqset *seqset_parse(const char *sequence,
     return set;
 }
 
-/* Comparator function that checks if r1 is a subset of r2 */
-static int comp_subset(const void *v1, const void *v2)
+/* Return the index of the first range in [lo, hi) which ends at
+ * or after num, or hi if there is none */
+static size_t seqset_search(const struct seqset *seq, unsigned num,
+                            size_t lo, size_t hi)
 {
-    struct seq_range *r1 = (struct seq_range *) v1;
-    struct seq_range *r2 = (struct seq_range *) v2;
-
-    if (r1->low < r2->low) return -1;
-    if (r1->high > r2->high) return 1;
-    return 0;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (seq->set[mid].high < num)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
 }
 
 /*
@@ -289,13 +319,14 @@ static int comp_subset(const void *v1, const void *v2)
  */
 EXPORTED int seqset_ismember(struct seqset *seq, unsigned num)
 {
-    struct seq_range key = {num, num};
-    struct seq_range *found;
+    size_t found, step;
 
     /* Short circuit no list! */
     if (!seq) return 0;
     if (!seq->len) return 0;
 
+    if (seq->current >= seq->len) seq->current = 0;
+
     /* Short circuit if we're outside all ranges */
     if ((num < seq->set[0].low) || (num > seq->set[seq->len-1].high)) {
         return 0;
@@ -316,16 +347,25 @@ EXPORTED int seqset_ismember(struct seqset *seq, unsigned num)
         num <= seq->set[seq->current].high)
         return 1;
 
-    /* Fall back to full search */
-    found = bsearch(&key, seq->set, seq->len,
-                    sizeof(struct seq_range), comp_subset);
-    if (found) {
-        /* track the range we found ourselves in */
-        seq->current = found - seq->set;
-        return 1;
+    /* Fall back to a search: galloping forwards from the current
+     * range for the common case of increasing numbers, else a
+     * binary search of the ranges before it */
+    if (num > seq->set[seq->current].high) {
+        size_t lo = seq->current + 1, hi = lo;
+        for (step = 1; hi < seq->len && seq->set[hi].high < num; step *= 2) {
+            lo = hi + 1;
+            hi += step;
+        }
+        found = seqset_search(seq, num, lo, MIN(hi + 1, seq->len));
+    }
+    else {
+        found = seqset_search(seq, num, 0, seq->current);
     }
 
-    return 0;
+    /* track the range we found ourselves in */
+    if (found < seq->len) seq->current = found;
+
+    return (found < seq->len && num >= seq->set[found].low);
 }
 
 /*
@@ -391,21 +431,120 @@ EXPORTED unsigned seqset_getnext(struct seqset *seq)
 
 /*
  * Merge the numbers in seqset `b' into seqset `a'.
+ *
+ * Both sets are kept sorted, so this is a single linear merge.
  */
-/* NOTE - not sort safe! */
 EXPORTED void seqset_join(struct seqset *a, const struct seqset *b)
 {
-    if (a->len + b->len > a->alloc) {
-        a->alloc = a->len + b->len;
-        a->set =
-            xrealloc(a->set, a->alloc * sizeof(struct seq_range));
+    struct seq_range *old = a->set;
+    size_t oldlen = a->len;
+    size_t i = 0, j = 0;
+
+    if (!b || !b->len) return;
+
+    a->alloc = oldlen + b->len;
+    a->set = xmalloc(a->alloc * sizeof(struct seq_range));
+    a->len = 0;
+    a->current = 0;
+
+    while (i < oldlen || j < b->len) {
+        const struct seq_range *r;
+
+        if (j == b->len || (i < oldlen && old[i].low <= b->set[j].low))
+            r = &old[i++];
+        else
+            r = &b->set[j++];
+
+        seqset_append(a, r->low, r->high);
     }
-    /* call them char * so the maths works out right */
-    memcpy((char *)a->set + a->len * sizeof(struct seq_range),
-           (char *)b->set, b->len * sizeof(struct seq_range));
-    a->len += b->len;
 
-    seqset_simplify(a);
+    free(old);
+}
+
+/*
+ * Return a new seqset with the numbers which are in both `a' and `b'.
+ * Like a parsed seqset, it is ready for seqset_getnext().
+ */
+EXPORTED struct seqset *seqset_intersect(const struct seqset *a,
+                                         const struct seqset *b)
+{
+    struct seqset *res = seqset_init(a ? a->maxval : 0, SEQ_SPARSE);
+    size_t i = 0, j = 0;
+
+    if (!a || !b) return res;
+
+    while (i < a->len && j < b->len) {
+        unsigned low = MAX(a->set[i].low, b->set[j].low);
+        unsigned high = MIN(a->set[i].high, b->set[j].high);
+
+        if (low <= high)
+            seqset_append(res, low, high);
+
+        /* move past whichever range ends first */
+        if (a->set[i].high < b->set[j].high)
+            i++;
+        else
+            j++;
+    }
+
+    return res;
+}
+
+/*
+ * Return a new seqset with the numbers which are in `a' but not in `b'.
+ * Like a parsed seqset, it is ready for seqset_getnext().
+ */
+EXPORTED struct seqset *seqset_diff(const struct seqset *a,
+                                    const struct seqset *b)
+{
+    struct seqset *res = seqset_init(a ? a->maxval : 0, SEQ_SPARSE);
+    size_t i, j = 0;
+
+    if (!a) return res;
+
+    for (i = 0; i < a->len; i++) {
+        unsigned low = a->set[i].low;
+        unsigned high = a->set[i].high;
+        int covered = 0;
+
+        /* skip the ranges of b entirely below this one */
+        while (b && j < b->len && b->set[j].high < low)
+            j++;
+
+        /* punch out the ranges of b overlapping this one; the last of
+         * them may also overlap the next range of a, so keep it */
+        while (b && j < b->len && b->set[j].low <= high) {
+            if (b->set[j].low > low)
+                seqset_append(res, low, b->set[j].low - 1);
+            if (b->set[j].high >= high) {
+                covered = 1;
+                break;
+            }
+            low = b->set[j].high + 1;
+            j++;
+        }
+
+        if (!covered)
+            seqset_append(res, low, high);
+    }
+
+    return res;
+}
+
+/*
+ * Return the number of numbers in the seqset.
+ */
+EXPORTED uint64_t seqset_count(const struct seqset *seq)
+{
+    uint64_t count = 0;
+    size_t i;
+
+    if (!seq) return 0;
+
+    for (i = 0; i < seq->len; i++)
+        count += (uint64_t) seq->set[i].high - seq->set[i].low + 1;
+
+    return count;
 }
 
 static void format_num(struct buf *buf, unsigned i)
@@ -46,6 +46,8 @@
 #ifndef SEQUENCE_H
 #define SEQUENCE_H
 
+#include <stdint.h>
+
 struct seq_range {
     unsigned low;
     unsigned high;
@@ -74,6 +76,11 @@ extern struct seqset *seqset_parse(const char *sequence,
                                    struct seqset *set,
                                    unsigned maxval);
 extern void seqset_join(struct seqset *a, const struct seqset *b);
+extern struct seqset *seqset_intersect(const struct seqset *a,
+                                       const struct seqset *b);
+extern struct seqset *seqset_diff(const struct seqset *a,
+                                  const struct seqset *b);
+extern uint64_t seqset_count(const struct seqset *seq);
 extern int seqset_ismember(struct seqset *set, unsigned num);
 extern unsigned seqset_getnext(struct seqset *set);
 extern unsigned seqset_first(const struct seqset *set);
@@ -73,6 +73,11 @@ extern int status_lookup_mailbox(struct mailbox *mailbox, const char *userid,
 extern int statuscache_lookup(const char *mboxname, const char *userid,
                               unsigned statusitems, struct statusdata *sdata);
 
+/* read all of a user's packed statuscache entries in one go, to answer
+   the lookups for a LIST-STATUS; statuscache_prefetch_done() drops them */
+extern void statuscache_prefetch(const char *userid);
+extern void statuscache_prefetch_done(void);
+
 /* invalidate (delete) statuscache entry for the mailbox,
    optionally writing the data for one user in the same transaction */
 extern int statuscache_invalidate(const char *mboxname,
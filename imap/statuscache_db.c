@@ -58,6 +58,7 @@
 #include "cyrusdb.h"
 #include "imapd.h"
 #include "global.h"
+#include "hash.h"
 #include "mboxlist.h"
 #include "mailbox.h"
 #include "seen.h"
@@ -358,25 +359,129 @@ EXPORTED int status_lookup_mailbox(struct mailbox *mailbox, const char *userid,
 
 
 
-EXPORTED int statuscache_lookup(const char *mboxname, const char *userid,
-                       unsigned statusitems, struct statusdata *sdata)
+/*
+ * Packed layout (statuscache_packed): the status of every mailbox a user
+ * owns is kept under "%%<userid>%%<mboxname>", so that all of them sort
+ * together and a LIST-STATUS over the whole tree is a single prefix scan,
+ * while each mailbox's entry is still written or dropped on its own.
+ * Status for mailboxes the user doesn't own still uses the per-mailbox
+ * keys.
+ *
+ * A prefetched copy is a snapshot for the one command which asked for
+ * it: changes made by other processes after the scan are seen by the
+ * next command, our own changes straight away.
+ */
+
+static struct {
+    char *userid;
+    hash_table byname;          /* mboxname => copy of its entry */
+} prefetched;
+
+static int statuscache_packed_owner(const char *mboxname, const char *userid)
 {
-    size_t keylen, datalen;
-    int r = 0;
-    const char *data = NULL, *dend;
-    char *p, *key = statuscache_buildkey(mboxname, userid, &keylen);
-    unsigned version;
+    char *owner;
+    int r;
 
-    /* Don't access DB if it hasn't been opened */
-    if (!statuscache_dbopen)
-        return IMAP_NO_NOSUCHMSG;
+    if (!userid || !config_getswitch(IMAPOPT_STATUSCACHE_PACKED))
+        return 0;
 
-    /* Check if there is an entry in the database */
-    do {
-        r = cyrusdb_fetch(statuscachedb, key, keylen, &data, &datalen, NULL);
-    } while (r == CYRUSDB_AGAIN);
+    owner = mboxname_to_userid(mboxname);
+    r = owner && !strcmp(owner, userid);
+    free(owner);
+
+    return r;
+}
+
+/* with a NULL mboxname, returns the prefix of all of userid's keys */
+static char *statuscache_packed_buildkey(const char *userid,
+                                         const char *mboxname,
+                                         size_t *keylen)
+{
+    static char key[MAX_MAILBOX_BUFFER];
+    size_t len;
+
+    /* a mailbox key never starts with the separator */
+    key[0] = '%';
+    key[1] = '%';
+    len = 2 + strlcpy(key + 2, userid, sizeof(key) - 2);
+    key[len++] = '%';
+    key[len++] = '%';
+    if (mboxname)
+        len += strlcpy(key + len, mboxname, sizeof(key) - len);
 
-    if (r || !data || ((size_t) datalen < sizeof(unsigned))) {
+    *keylen = len;
+
+    return key;
+}
+
+static int prefetch_cb(void *rock,
+                       const char *key, size_t keylen,
+                       const char *data, size_t datalen)
+{
+    size_t prefixlen = *((size_t *) rock);
+    char *mboxname = xstrndup(key + prefixlen, keylen - prefixlen);
+
+    hash_insert(mboxname, xstrndup(data, datalen), &prefetched.byname);
+    free(mboxname);
+
+    return 0;
+}
+
+/*
+ * Read all of the packed entries for 'userid' in one go and answer
+ * statuscache_lookup() from memory until statuscache_prefetch_done().
+ */
+EXPORTED void statuscache_prefetch(const char *userid)
+{
+    size_t keylen;
+    char *key;
+    int r;
+
+    statuscache_prefetch_done();
+
+    if (!statuscache_dbopen || !userid ||
+        !config_getswitch(IMAPOPT_STATUSCACHE) ||
+        !config_getswitch(IMAPOPT_STATUSCACHE_PACKED))
+        return;
+
+    prefetched.userid = xstrdup(userid);
+    construct_hash_table(&prefetched.byname, 256, 0);
+
+    key = statuscache_packed_buildkey(userid, NULL, &keylen);
+    r = cyrusdb_foreach(statuscachedb, key, keylen, NULL, prefetch_cb,
+                        &keylen, NULL);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: error reading packed statuscache: %s (%s)",
+               userid, cyrusdb_strerror(r));
+        statuscache_prefetch_done();
+    }
+}
+
+EXPORTED void statuscache_prefetch_done(void)
+{
+    if (!prefetched.userid) return;
+
+    free_hash_table(&prefetched.byname, free);
+    free(prefetched.userid);
+    memset(&prefetched, 0, sizeof(prefetched));
+}
+
+/* our own write to a mailbox's entry supersedes the prefetched one */
+static void statuscache_prefetch_forget(const char *userid,
+                                        const char *mboxname)
+{
+    if (prefetched.userid && !strcmp(prefetched.userid, userid))
+        free(hash_del(mboxname, &prefetched.byname));
+}
+
+static int statuscache_parse(const char *data, size_t datalen,
+                             unsigned statusitems, struct statusdata *sdata)
+{
+    const char *dend;
+    char *p;
+    unsigned version;
+
+    if (!data || ((size_t) datalen < sizeof(unsigned))) {
         return IMAP_NO_NOSUCHMSG;
     }
 
@@ -409,19 +514,98 @@ EXPORTED int statuscache_lookup(const char *mboxname, const char *userid,
     return 0;
 }
 
+static int statuscache_packed_lookup(const char *mboxname, const char *userid,
+                                     unsigned statusitems,
+                                     struct statusdata *sdata)
+{
+    const char *data = NULL;
+    size_t keylen, datalen = 0;
+    char *key;
+    int r;
+
+    if (prefetched.userid && !strcmp(prefetched.userid, userid)) {
+        data = hash_lookup(mboxname, &prefetched.byname);
+        if (data)
+            return statuscache_parse(data, strlen(data), statusitems, sdata);
+    }
+
+    key = statuscache_packed_buildkey(userid, mboxname, &keylen);
+
+    do {
+        r = cyrusdb_fetch(statuscachedb, key, keylen, &data, &datalen, NULL);
+    } while (r == CYRUSDB_AGAIN);
+
+    if (r) return IMAP_NO_NOSUCHMSG;
+
+    return statuscache_parse(data, datalen, statusitems, sdata);
+}
+
+/* drop the owner's packed entry for a mailbox, to be refilled on the
+ * next lookup which misses */
+static int statuscache_packed_drop(const char *userid, const char *mboxname,
+                                   struct txn **tidptr)
+{
+    size_t keylen;
+    char *key = statuscache_packed_buildkey(userid, mboxname, &keylen);
+    int r;
+
+    r = cyrusdb_delete(statuscachedb, key, keylen, tidptr, /*force*/1);
+    if (r != CYRUSDB_OK) {
+        syslog(LOG_ERR, "DBERROR: error deleting from database: %s (%s)",
+               mboxname, cyrusdb_strerror(r));
+    }
+
+    statuscache_prefetch_forget(userid, mboxname);
+
+    return r;
+}
+
+EXPORTED int statuscache_lookup(const char *mboxname, const char *userid,
+                       unsigned statusitems, struct statusdata *sdata)
+{
+    size_t keylen, datalen;
+    int r = 0;
+    const char *data = NULL;
+    char *key = statuscache_buildkey(mboxname, userid, &keylen);
+
+    /* Don't access DB if it hasn't been opened */
+    if (!statuscache_dbopen)
+        return IMAP_NO_NOSUCHMSG;
+
+    if (statuscache_packed_owner(mboxname, userid))
+        return statuscache_packed_lookup(mboxname, userid, statusitems, sdata);
+
+    /* Check if there is an entry in the database */
+    do {
+        r = cyrusdb_fetch(statuscachedb, key, keylen, &data, &datalen, NULL);
+    } while (r == CYRUSDB_AGAIN);
+
+    if (r) return IMAP_NO_NOSUCHMSG;
+
+    return statuscache_parse(data, datalen, statusitems, sdata);
+}
+
 static int statuscache_store(const char *mboxname,
                              struct statusdata *sdata,
                              struct txn **tidptr)
 {
     char data[250];  /* enough room for 11*(UULONG + SP) */
     size_t keylen, datalen;
-    char *key = statuscache_buildkey(mboxname, sdata->userid, &keylen);
+    char *key;
     int r;
 
     /* Don't access DB if it hasn't been opened */
     if (!statuscache_dbopen)
         return 0;
 
+    if (statuscache_packed_owner(mboxname, sdata->userid)) {
+        key = statuscache_packed_buildkey(sdata->userid, mboxname, &keylen);
+        statuscache_prefetch_forget(sdata->userid, mboxname);
+    }
+    else {
+        key = statuscache_buildkey(mboxname, sdata->userid, &keylen);
+    }
+
     /* The trailing whitespace is necessary because we
      * use non-length-based functions to parse the values.
      * Any non-digit char would be fine, but whitespace
@@ -476,7 +660,8 @@ static int delete_cb(void *rockp,
     return 0;
 }
 
-HIDDEN int statuscache_invalidate(const char *mboxname, struct statusdata *sdata)
+EXPORTED int statuscache_invalidate(const char *mboxname,
+                                    struct statusdata *sdata)
 {
     size_t keylen;
     char *key;
@@ -507,6 +692,15 @@ HIDDEN int statuscache_invalidate(const char *mboxname, struct statusdata *sdata
                mboxname, cyrusdb_strerror(r));
     }
 
+    if (!r && config_getswitch(IMAPOPT_STATUSCACHE_PACKED)) {
+        /* the owner's entry is overwritten below if we have new data
+         * for them, otherwise drop it */
+        char *owner = mboxname_to_userid(mboxname);
+        if (owner && !(sdata && !strcmpsafe(sdata->userid, owner)))
+            r = statuscache_packed_drop(owner, mboxname, &drock.tid);
+        free(owner);
+    }
+
     if (!r && sdata) {
         r = statuscache_store(mboxname, sdata, &drock.tid);
     }
@@ -115,6 +115,20 @@ extern char *cyrus_acl_masktostr(int acl, char *str);
  */
 extern int cyrus_acl_myrights(const struct auth_state *auth_state, const char *acl);
 
+/*  cyrus_acl_cachedrights(auth_state, acl, rightsp)
+ * Return 1 and set '*rightsp' if the rights of 'auth_state' in 'acl' are
+ * remembered from an earlier cyrus_acl_myrights(), 0 otherwise.  For
+ * whitebox testing.
+ */
+extern int cyrus_acl_cachedrights(const struct auth_state *auth_state,
+                                  const char *acl, int *rightsp);
+
+/*  cyrus_acl_forgetstate(auth_state)
+ * Forget the rights remembered for 'auth_state'.  Called by
+ * auth_freestate().
+ */
+extern void cyrus_acl_forgetstate(const struct auth_state *auth_state);
+
 /*  cyrus_acl_set(acl, identifier, mode, access, canonproc, canonrock) Modify the
  * ACL pointed to by 'acl' to modify the rights granted to
  * 'identifier' as specified by 'mode' and the set specified in the
@@ -55,14 +55,56 @@
 
 #include "acl.h"
 #include "auth.h"
+#include "hash.h"
 #include "xmalloc.h"
 #include "strarray.h"
+#include "util.h"
 #include "libconfig.h"
 
-/*
- * Calculate the set of rights the user in 'auth_state' has in the ACL 'acl'.
- */
-EXPORTED int cyrus_acl_myrights(const struct auth_state *auth_state, const char *origacl)
+/* rights already worked out, by auth_state and ACL string.  LIST,
+ * STATUS, DAV and JMAP ask about the same handful of ACLs over and over
+ * again, and every miss costs an auth_memberof() per identifier.
+ * Each state gets its own table, which auth_freestate() drops before
+ * the pointer can be handed out again */
+#define RIGHTS_CACHE_SIZE 64
+#define RIGHTS_CACHE_STATES 256
+#define RIGHTS_CACHE_MAX 8192
+
+struct state_rights {
+    hash_table acls;
+};
+
+static struct {
+    int count;
+    hash_table states;
+    struct buf key;
+} rights_cache;
+
+static void state_rights_free(void *data)
+{
+    struct state_rights *sr = (struct state_rights *) data;
+
+    free_hash_table(&sr->acls, free);
+    free(sr);
+}
+
+static void rights_cache_reset(void)
+{
+    if (rights_cache.states.size)
+        free_hash_table(&rights_cache.states, state_rights_free);
+
+    construct_hash_table(&rights_cache.states, RIGHTS_CACHE_STATES, 1);
+    rights_cache.count = 0;
+}
+
+static const char *state_key(const struct auth_state *auth_state)
+{
+    buf_reset(&rights_cache.key);
+    buf_printf(&rights_cache.key, "%p", (const void *) auth_state);
+    return buf_cstring(&rights_cache.key);
+}
+
+static int acl_myrights(const struct auth_state *auth_state, const char *origacl)
 {
     char *acl = xstrdupsafe(origacl);
     char *thisid, *rights, *nextid;
@@ -101,6 +143,83 @@ EXPORTED int cyrus_acl_myrights(const struct auth_state *auth_state, const char
     return acl_positive & ~acl_negative;
 }
 
+/*
+ * Calculate the set of rights the user in 'auth_state' has in the ACL 'acl'.
+ */
+EXPORTED int cyrus_acl_myrights(const struct auth_state *auth_state, const char *acl)
+{
+    struct state_rights *sr;
+    const char *key;
+    int *rights;
+
+    if (!rights_cache.states.size
+        || rights_cache.count >= RIGHTS_CACHE_MAX) {
+        rights_cache_reset();
+    }
+
+    key = state_key(auth_state);
+    sr = hash_lookup(key, &rights_cache.states);
+    if (!sr) {
+        sr = xmalloc(sizeof(struct state_rights));
+        construct_hash_table(&sr->acls, RIGHTS_CACHE_SIZE, 1);
+        hash_insert(key, sr, &rights_cache.states);
+    }
+
+    if (!acl) acl = "";
+    rights = hash_lookup(acl, &sr->acls);
+    if (!rights) {
+        rights = xmalloc(sizeof(int));
+        *rights = acl_myrights(auth_state, acl);
+        hash_insert(acl, rights, &sr->acls);
+        rights_cache.count++;
+    }
+
+    return *rights;
+}
+
+/*
+ * Look up the rights remembered for 'auth_state' in 'acl', without
+ * working them out.  For whitebox testing.
+ */
+EXPORTED int cyrus_acl_cachedrights(const struct auth_state *auth_state,
+                                    const char *acl, int *rightsp)
+{
+    struct state_rights *sr;
+    int *rights;
+
+    if (!rights_cache.states.size)
+        return 0;
+
+    sr = hash_lookup(state_key(auth_state), &rights_cache.states);
+    if (!sr)
+        return 0;
+
+    rights = hash_lookup(acl ? acl : "", &sr->acls);
+    if (!rights)
+        return 0;
+
+    if (rightsp) *rightsp = *rights;
+    return 1;
+}
+
+/*
+ * Forget the rights remembered for 'auth_state', which is about to be
+ * freed: its pointer can come back for somebody else.
+ */
+EXPORTED void cyrus_acl_forgetstate(const struct auth_state *auth_state)
+{
+    struct state_rights *sr;
+
+    if (!rights_cache.states.size)
+        return;
+
+    sr = hash_del(state_key(auth_state), &rights_cache.states);
+    if (sr) {
+        rights_cache.count -= hash_numrecords(&sr->acls);
+        state_rights_free(sr);
+    }
+}
+
 /*
  * Modify the ACL pointed to by 'acl' to make the rights granted to
  * 'identifier' the set specified in the mask 'access'.  The pointer
@@ -46,14 +46,18 @@
 #include <string.h>
 #include <syslog.h>
 #include <errno.h>
+#include <time.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/uio.h>
 
 #include "auth_pts.h"
+#include "cyr_lock.h"
 #include "cyrusdb.h"
 #include "exitcodes.h"
 #include "libcyr_cfg.h"
@@ -324,6 +328,510 @@ static struct auth_state *mynewstate(const char *identifier)
     return output;
 }
 
+/*
+ * Shared-memory ptscache.
+ *
+ * ptloader keeps a fixed table of the auth states it has loaded in
+ * {configdirectory}/ptclient/ptscache.shm, and every service maps it.
+ * A slot is chosen by hashing the requested identifier, and it holds
+ * one entry, which may be negative ("ptloader couldn't load this").
+ * Each slot carries a sequence number.  The writer makes it odd while
+ * it copies the entry in and even again afterwards.  A reader copies
+ * the slot out and only trusts the copy if it saw the same even number
+ * before and after.  ptloaders lock the file against each other;
+ * readers never lock.
+ *
+ * The only thing a service writes is the slot's 'refreshing' stamp,
+ * with a compare-and-swap, to claim the background refresh of the
+ * entry (see ptshm_claim_refresh()).  ptloader's next store into the
+ * slot clears it.
+ */
+#define PTSHM_MAGIC "CYPTSHM2"
+#define PTSHM_SLOTSIZE 4096
+
+#define PTSHM_MISS      0
+#define PTSHM_FOUND     1
+#define PTSHM_NEGATIVE  2
+
+#define PTSHM_FLAG_NEGATIVE (1<<0)
+
+struct ptshm_header {
+    char magic[8];
+    uint32_t nslots;
+    uint32_t slotsize;
+};
+
+struct ptshm_slot {
+    uint32_t seq;
+    uint32_t flags;
+    int64_t mark;
+    uint32_t len;               /* bytes of data in use, 0 if empty */
+    uint32_t ngroups;
+    uint32_t refreshing;        /* when a refresh was asked for, 0 if not */
+    char data[PTSHM_SLOTSIZE - 28]; /* identifier, userid, groups, NUL separated */
+};
+
+struct ptshm_map {
+    char *base;
+    size_t size;
+    uint32_t nslots;
+    ino_t ino;
+    int writable;
+    int fd;                     /* writer only */
+};
+
+static struct ptshm_map ptshm_reader = { NULL, 0, 0, 0, 0, -1 };
+static struct ptshm_map ptshm_writer = { NULL, 0, 0, 0, 0, -1 };
+
+static char *ptshm_fname(void)
+{
+    return strconcat(libcyrus_config_getstring(CYRUSOPT_CONFIG_DIR),
+                     PTS_SHMFIL, (char *)NULL);
+}
+
+static struct ptshm_slot *ptshm_slot(struct ptshm_map *map,
+                                     const char *identifier)
+{
+    unsigned idx = strhash(identifier) % map->nslots;
+
+    return (struct ptshm_slot *)
+        (map->base + sizeof(struct ptshm_header) + idx * PTSHM_SLOTSIZE);
+}
+
+static void ptshm_unmap(struct ptshm_map *map)
+{
+    if (map->base) munmap(map->base, map->size);
+    if (map->fd != -1) close(map->fd);
+    map->base = NULL;
+    map->size = 0;
+    map->nslots = 0;
+    map->ino = 0;
+    map->writable = 0;
+    map->fd = -1;
+}
+
+/* map 'fd', returns 0 if it holds a table of 'nslots' slots.
+ * If 'check' is set, the header must already say so too */
+static int ptshm_map(struct ptshm_map *map, int fd, int writable,
+                     int check, uint32_t nslots)
+{
+    const struct ptshm_header *hdr;
+    struct stat sbuf;
+
+    if (fstat(fd, &sbuf) == -1) return -1;
+    if ((size_t) sbuf.st_size !=
+        sizeof(struct ptshm_header) + (size_t) nslots * PTSHM_SLOTSIZE)
+        return -1;
+
+    map->base = mmap(NULL, sbuf.st_size,
+                     writable ? PROT_READ|PROT_WRITE : PROT_READ,
+                     MAP_SHARED, fd, 0);
+    if (map->base == MAP_FAILED) {
+        map->base = NULL;
+        return -1;
+    }
+    map->size = sbuf.st_size;
+    map->ino = sbuf.st_ino;
+    map->nslots = nslots;
+    map->writable = writable;
+
+    hdr = (const struct ptshm_header *) map->base;
+    if (check &&
+        (memcmp(hdr->magic, PTSHM_MAGIC, sizeof(hdr->magic)) ||
+         hdr->nslots != nslots || hdr->slotsize != PTSHM_SLOTSIZE)) {
+        munmap(map->base, map->size);
+        map->base = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* the table as ptloader last created it, or NULL */
+static struct ptshm_map *ptshm_reader_open(void)
+{
+    int nslots = libcyrus_config_getint(CYRUSOPT_PTSCACHE_SHM_SLOTS);
+    struct stat sbuf;
+    char *fname;
+    int r, fd, writable;
+
+    if (nslots <= 0) return NULL;
+
+    fname = ptshm_fname();
+    r = stat(fname, &sbuf);
+    if (r == -1 || (ptshm_reader.base &&
+                    (sbuf.st_ino != ptshm_reader.ino ||
+                     ptshm_reader.nslots != (uint32_t) nslots)))
+        ptshm_unmap(&ptshm_reader);
+
+    if (!r && !ptshm_reader.base) {
+        /* writable only to claim refreshes, so make do without */
+        writable = 1;
+        fd = open(fname, O_RDWR, 0);
+        if (fd == -1) {
+            writable = 0;
+            fd = open(fname, O_RDONLY, 0);
+        }
+        if (fd != -1) {
+            /* the mapping outlives the descriptor */
+            if (ptshm_map(&ptshm_reader, fd, writable, 1, nslots))
+                ptshm_unmap(&ptshm_reader);
+            close(fd);
+        }
+    }
+    free(fname);
+
+    return ptshm_reader.base ? &ptshm_reader : NULL;
+}
+
+/* copy the slot for 'identifier' out of the table into 'copy'.
+ * returns nonzero if the copy is consistent and holds 'identifier' */
+static int ptshm_read(const struct ptshm_slot *slot, const char *identifier,
+                      struct ptshm_slot *copy)
+{
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+    /* being written right now */
+    if (seq & 1) return 0;
+
+    memcpy(copy, slot, sizeof(struct ptshm_slot));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) return 0;
+
+    /* nothing from the table is trusted until it's been checked */
+    if (!copy->len || copy->len > sizeof(copy->data)) return 0;
+    if (copy->data[copy->len - 1]) return 0;
+    if (strcmp(copy->data, identifier)) return 0;
+
+    return 1;
+}
+
+/* look 'identifier' up in the shared table.  On PTSHM_FOUND, '*state' is
+ * a new auth_state; on PTSHM_FOUND and PTSHM_NEGATIVE, '*mark' is when
+ * ptloader loaded it */
+static int ptshm_lookup(const char *identifier, struct auth_state **state,
+                        time_t *mark)
+{
+    struct ptshm_map *map = ptshm_reader_open();
+    struct ptshm_slot copy;
+    const char *p, *end;
+    size_t size;
+    uint32_t i;
+
+    if (!map) return PTSHM_MISS;
+    if (!ptshm_read(ptshm_slot(map, identifier), identifier, &copy))
+        return PTSHM_MISS;
+
+    *mark = copy.mark;
+    if (copy.flags & PTSHM_FLAG_NEGATIVE) return PTSHM_NEGATIVE;
+
+    /* count the names, they must be exactly the userid and the groups */
+    end = copy.data + copy.len;
+    p = copy.data + strlen(copy.data) + 1;
+    for (i = 0; p < end; i++) p += strlen(p) + 1;
+    if (i != copy.ngroups + 1) return PTSHM_MISS;
+
+    size = sizeof(struct auth_state);
+    if (copy.ngroups > 1)
+        size += (copy.ngroups - 1) * sizeof(struct auth_ident);
+    *state = xzmalloc(size);
+
+    p = copy.data + strlen(copy.data) + 1;
+    strlcpy((*state)->userid.id, p, sizeof((*state)->userid.id));
+    (*state)->userid.hash = strhash(p);
+    (*state)->mark = copy.mark;
+    (*state)->ngroups = copy.ngroups;
+
+    for (i = 0; i < copy.ngroups; i++) {
+        p += strlen(p) + 1;
+        strlcpy((*state)->groups[i].id, p, sizeof((*state)->groups[i].id));
+        (*state)->groups[i].hash = strhash(p);
+    }
+
+    return PTSHM_FOUND;
+}
+
+/* claim the background refresh of 'identifier' for this process.
+ * Returns nonzero if nobody else has asked ptloader for it within the
+ * last PT_TIMEOUT_SEC.  Without a table to claim it in, this only
+ * stops the same process asking again. */
+static int ptshm_claim_refresh(const char *identifier, time_t now)
+{
+    static char last_id[PTS_DB_KEYSIZE+1];
+    static time_t last_claim = 0;
+    struct ptshm_map *map = ptshm_reader_open();
+    struct ptshm_slot *slot;
+    uint32_t claimed;
+
+    if (!map || !map->writable) {
+        if (last_claim > now - PT_TIMEOUT_SEC && !strcmp(last_id, identifier))
+            return 0;
+        strlcpy(last_id, identifier, sizeof(last_id));
+        last_claim = now;
+        return 1;
+    }
+
+    /* an identifier sharing the slot may have to wait for its refresh,
+     * but it stays usable until it expires regardless */
+    slot = ptshm_slot(map, identifier);
+    claimed = __atomic_load_n(&slot->refreshing, __ATOMIC_RELAXED);
+    do {
+        if (claimed && (uint32_t) now - claimed < PT_TIMEOUT_SEC)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&slot->refreshing, &claimed,
+                                          (uint32_t) now, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return 1;
+}
+
+/* make sure ptloader has a table of the configured size mapped,
+ * replacing the file if its size is out of date */
+static struct ptshm_map *ptshm_writer_open(void)
+{
+    int nslots = libcyrus_config_getint(CYRUSOPT_PTSCACHE_SHM_SLOTS);
+    struct ptshm_header *hdr;
+    struct stat sbuf;
+    char *fname, *newfname = NULL;
+    int fd = -1;
+
+    if (nslots <= 0) return NULL;
+
+    fname = ptshm_fname();
+
+    /* another ptloader may have replaced the file under us */
+    if (ptshm_writer.base &&
+        (stat(fname, &sbuf) == -1 || sbuf.st_ino != ptshm_writer.ino ||
+         ptshm_writer.nslots != (uint32_t) nslots))
+        ptshm_unmap(&ptshm_writer);
+
+    if (ptshm_writer.base) goto done;
+
+    fd = open(fname, O_RDWR, 0);
+    if (fd != -1) {
+        if (!ptshm_map(&ptshm_writer, fd, 1, 0, nslots)) {
+            hdr = (struct ptshm_header *) ptshm_writer.base;
+            if (!memcmp(hdr->magic, PTSHM_MAGIC, sizeof(hdr->magic)) &&
+                hdr->nslots == (uint32_t) nslots &&
+                hdr->slotsize == PTSHM_SLOTSIZE) {
+                ptshm_writer.fd = fd;
+                goto done;
+            }
+            munmap(ptshm_writer.base, ptshm_writer.size);
+            ptshm_writer.base = NULL;
+        }
+        close(fd);
+    }
+
+    /* build a new table beside the old one and rename it into place,
+     * so nobody ever has the file shrink under their mapping */
+    newfname = strconcat(fname, ".NEW", (char *)NULL);
+    fd = open(newfname, O_RDWR|O_CREAT|O_TRUNC, 0600);
+    if (fd == -1) {
+        syslog(LOG_ERR, "IOERROR: creating %s: %m", newfname);
+        goto done;
+    }
+    if (ftruncate(fd, sizeof(struct ptshm_header) +
+                      (size_t) nslots * PTSHM_SLOTSIZE) == -1 ||
+        ptshm_map(&ptshm_writer, fd, 1, 0, nslots)) {
+        syslog(LOG_ERR, "IOERROR: sizing %s: %m", newfname);
+        close(fd);
+        unlink(newfname);
+        goto done;
+    }
+
+    hdr = (struct ptshm_header *) ptshm_writer.base;
+    hdr->nslots = nslots;
+    hdr->slotsize = PTSHM_SLOTSIZE;
+    memcpy(hdr->magic, PTSHM_MAGIC, sizeof(hdr->magic));
+
+    if (rename(newfname, fname) == -1) {
+        syslog(LOG_ERR, "IOERROR: renaming %s: %m", newfname);
+        ptshm_unmap(&ptshm_writer);
+        close(fd);
+        unlink(newfname);
+        goto done;
+    }
+    ptshm_writer.fd = fd;
+
+ done:
+    free(newfname);
+    free(fname);
+    return ptshm_writer.base ? &ptshm_writer : NULL;
+}
+
+/*
+ * Called by ptloader with the auth state it just loaded for 'identifier',
+ * or with NULL if it couldn't load one.
+ */
+EXPORTED void ptscache_shm_store(const char *identifier, size_t id_len,
+                                 const struct auth_state *state)
+{
+    struct ptshm_map *map = ptshm_writer_open();
+    struct ptshm_slot *slot, entry;
+    char key[PTS_DB_KEYSIZE+1];
+    struct buf data = BUF_INITIALIZER;
+    time_t now = time(NULL);
+    int i;
+
+    if (!map || id_len > PTS_DB_KEYSIZE) return;
+
+    memcpy(key, identifier, id_len);
+    key[id_len] = '\0';
+
+    memset(&entry, 0, sizeof(struct ptshm_slot));
+    buf_appendmap(&data, key, id_len + 1);
+    if (state) {
+        entry.mark = state->mark;
+        entry.ngroups = state->ngroups;
+        buf_appendmap(&data, state->userid.id, strlen(state->userid.id) + 1);
+        for (i = 0; i < state->ngroups; i++) {
+            buf_appendmap(&data, state->groups[i].id,
+                          strlen(state->groups[i].id) + 1);
+        }
+    }
+    else {
+        entry.mark = now;
+        entry.flags = PTSHM_FLAG_NEGATIVE;
+    }
+
+    /* too many groups for a slot: empty it, so readers use the db */
+    if (data.len <= sizeof(entry.data)) {
+        entry.len = data.len;
+        memcpy(entry.data, data.s, data.len);
+    }
+    else {
+        syslog(LOG_DEBUG, "ptscache_shm_store: %s doesn't fit in a slot",
+               key);
+        entry.len = 0;
+    }
+    buf_free(&data);
+
+    if (lock_setlock(map->fd, 1, 0, PTS_SHMFIL)) {
+        syslog(LOG_ERR, "IOERROR: locking %s: %m", PTS_SHMFIL);
+        return;
+    }
+
+    slot = ptshm_slot(map, key);
+
+    /* a failed reload shouldn't throw away a state that's still usable */
+    if (!state && slot->len && !(slot->flags & PTSHM_FLAG_NEGATIVE) &&
+        !strncmp(slot->data, key, sizeof(slot->data)) &&
+        slot->mark > now - libcyrus_config_getint(CYRUSOPT_PTS_CACHE_TIMEOUT)
+                         - libcyrus_config_getint(CYRUSOPT_PTSCACHE_REFRESH)) {
+        lock_unlock(map->fd, PTS_SHMFIL);
+        return;
+    }
+
+    entry.seq = slot->seq + 2;
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char *) slot + sizeof(entry.seq),
+           (char *) &entry + sizeof(entry.seq),
+           sizeof(struct ptshm_slot) - sizeof(entry.seq));
+    __atomic_store_n(&slot->seq, entry.seq, __ATOMIC_RELEASE);
+
+    lock_unlock(map->fd, PTS_SHMFIL);
+}
+
+static void ptloader_addr(struct sockaddr_un *srvaddr)
+{
+    const char *config_dir =
+        libcyrus_config_getstring(CYRUSOPT_CONFIG_DIR);
+    const char *fname;
+    char *tofree = NULL;
+
+    fname = libcyrus_config_getstring(CYRUSOPT_PTLOADER_SOCK);
+    if (!fname) {
+        tofree = strconcat(config_dir, PTS_DBSOCKET, (char *)NULL);
+        fname = tofree;
+    }
+
+    memset((char *)srvaddr, 0, sizeof(*srvaddr));
+    srvaddr->sun_family = AF_UNIX;
+    strcpy(srvaddr->sun_path, fname);
+    free(tofree);
+}
+
+/* open a connection to ptloader and send it 'identifier' */
+static int ptloader_send(const char *identifier, size_t id_len)
+{
+    struct sockaddr_un srvaddr;
+    struct iovec iov[10];
+    int niov;
+    int s, r;
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1) {
+        syslog(LOG_ERR,
+               "ptload(): unable to create socket for ptloader: %m");
+        return -1;
+    }
+
+    ptloader_addr(&srvaddr);
+    r = nb_connect(s, (struct sockaddr *)&srvaddr, sizeof(srvaddr), PT_TIMEOUT_SEC);
+
+    if (r == -1) {
+        syslog(LOG_ERR, "ptload(): can't connect to ptloader server: %m");
+        close(s);
+        return -1;
+    }
+
+    syslog(LOG_DEBUG, "ptload(): connected");
+    niov = 0;
+    WRITEV_ADD_TO_IOVEC(iov, niov, (char *) &id_len, sizeof(id_len));
+    WRITEV_ADD_TO_IOVEC(iov, niov, (char *) identifier, id_len);
+
+    if (timeout_select(s, TS_WRITE, PT_TIMEOUT_SEC) < 0) {
+      syslog(LOG_ERR, "timeoutselect: writing to ptloader %m");
+      close(s);
+      return -1;
+    }
+    retry_writev(s, iov, niov);
+    syslog(LOG_DEBUG, "ptload sent data");
+
+    return s;
+}
+
+/* ask ptloader to reload 'identifier' without waiting on it at all;
+ * it updates the ptscache db and shared table for the next lookup.
+ * If ptloader is too busy to take the request right now, the entry
+ * is still usable and the next claim after PT_TIMEOUT_SEC tries again */
+static void ptloader_refresh(const char *identifier, size_t id_len,
+                             time_t now)
+{
+    struct sockaddr_un srvaddr;
+    struct iovec iov[2];
+    int niov = 0;
+    int s;
+
+    if (!ptshm_claim_refresh(identifier, now)) return;
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1) {
+        syslog(LOG_ERR,
+               "ptload(): unable to create socket for ptloader: %m");
+        return;
+    }
+
+    ptloader_addr(&srvaddr);
+    WRITEV_ADD_TO_IOVEC(iov, niov, (char *) &id_len, sizeof(id_len));
+    WRITEV_ADD_TO_IOVEC(iov, niov, (char *) identifier, id_len);
+
+    /* the request fits in the socket buffer, so nothing here blocks */
+    if (fcntl(s, F_SETFL, O_NONBLOCK) == -1 ||
+        connect(s, (struct sockaddr *)&srvaddr, sizeof(srvaddr)) == -1 ||
+        writev(s, iov, niov) != (ssize_t) (sizeof(id_len) + id_len)) {
+        syslog(LOG_WARNING, "ptload(): can't ask ptloader to refresh %s: %m",
+               identifier);
+    }
+    else {
+        syslog(LOG_DEBUG, "ptload(): refreshing %s in the background",
+               identifier);
+    }
+    close(s);
+}
+
 static const char *the_ptscache_db = NULL;
 
 /* Returns 0 on success */
@@ -337,14 +845,17 @@ static int ptload(const char *identifier, struct auth_state **state)
     char *tofree = NULL;
     struct db *ptdb;
     int s;
-    struct sockaddr_un srvaddr;
     int r, rc=0;
     static char response[1024];
-    struct iovec iov[10];
-    int niov, n;
+    int n;
     unsigned int start;
     const char *config_dir =
         libcyrus_config_getstring(CYRUSOPT_CONFIG_DIR);
+    int timeout = libcyrus_config_getint(CYRUSOPT_PTS_CACHE_TIMEOUT);
+    int refresh = libcyrus_config_getint(CYRUSOPT_PTSCACHE_REFRESH);
+    time_t now = time(NULL);
+    time_t mark;
+    int negative = 0;
 
     /* xxx this sucks, but it seems to be the only way to satisfy the linker */
     if(the_ptscache_db == NULL) {
@@ -355,6 +866,29 @@ static int ptload(const char *identifier, struct auth_state **state)
         fatal("bad state pointer passed to ptload()", EC_TEMPFAIL);
     }
 
+    /* the shared table saves us the db, and usually ptloader too */
+    switch (ptshm_lookup(identifier, state, &mark)) {
+    case PTSHM_FOUND:
+        if (mark > now - timeout - refresh) {
+            if (mark <= now - timeout + refresh)
+                ptloader_refresh(identifier, strlen(identifier), now);
+            syslog(LOG_DEBUG, "ptload(): using shared cache for %s",
+                   identifier);
+            return 0;
+        }
+        free(*state);
+        *state = NULL;
+        break;
+
+    case PTSHM_NEGATIVE:
+        /* don't ask ptloader again so soon, but whatever the db
+         * has is still better than no groups at all */
+        if (mark > now -
+            libcyrus_config_getint(CYRUSOPT_PTSCACHE_NEGATIVE_TIMEOUT))
+            negative = 1;
+        break;
+    }
+
     fname = libcyrus_config_getstring(CYRUSOPT_PTSCACHE_DB_PATH);
 
     if (!fname) {
@@ -395,66 +929,39 @@ static int ptload(const char *identifier, struct auth_state **state)
     fetched = (struct auth_state *) data;
 
     if(fetched) {
-        time_t now = time(NULL);
-        int timeout = libcyrus_config_getint(CYRUSOPT_PTS_CACHE_TIMEOUT);
-
         syslog(LOG_DEBUG,
                "ptload(): fetched cache record (%s)" \
                "(mark %ld, current %ld, limit %ld)", identifier,
                fetched->mark, now, now - timeout);
 
-        if (fetched->mark > (now - timeout)) {
-            /* not expired; let's return it */
+        if (fetched->mark > (now - timeout - refresh)) {
+            /* not expired; let's return it, but have ptloader fetch
+             * a new one if it's close to (or just past) expiry */
+            if (fetched->mark <= (now - timeout + refresh))
+                ptloader_refresh(identifier, id_len, now);
             goto done;
         }
     }
 
-    syslog(LOG_DEBUG, "ptload(): pinging ptloader");
-
-    s = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (s == -1) {
-        syslog(LOG_ERR,
-               "ptload(): unable to create socket for ptloader: %m");
+    if (negative) {
+        syslog(LOG_DEBUG, "ptload(): %s recently failed to load", identifier);
         rc = -1;
         goto done;
     }
 
-    fname = libcyrus_config_getstring(CYRUSOPT_PTLOADER_SOCK);
-    if (!fname) {
-        tofree = strconcat(config_dir, PTS_DBSOCKET, (char *)NULL);
-        fname = tofree;
-    }
-
-    memset((char *)&srvaddr, 0, sizeof(srvaddr));
-    srvaddr.sun_family = AF_UNIX;
-    strcpy(srvaddr.sun_path, fname);
-    r = nb_connect(s, (struct sockaddr *)&srvaddr, sizeof(srvaddr), PT_TIMEOUT_SEC);
-    free(tofree);
+    syslog(LOG_DEBUG, "ptload(): pinging ptloader");
 
-    if (r == -1) {
-        syslog(LOG_ERR, "ptload(): can't connect to ptloader server: %m");
-        close(s);
+    s = ptloader_send(identifier, id_len);
+    if (s == -1) {
         rc = -1;
         goto done;
     }
 
-    syslog(LOG_DEBUG, "ptload(): connected");
-    niov = 0;
-    WRITEV_ADD_TO_IOVEC(iov, niov, (char *) &id_len, sizeof(id_len));
-    WRITEV_ADD_TO_IOVEC(iov, niov, (char *) identifier, id_len);
-
-    if (timeout_select(s, TS_WRITE, PT_TIMEOUT_SEC) < 0) {
-      syslog(LOG_ERR, "timeoutselect: writing to ptloader %m");
-      rc = -1;
-      goto done;
-    }
-    retry_writev(s, iov, niov);
-    syslog(LOG_DEBUG, "ptload sent data");
-
     start = 0;
     while (start < sizeof(response) - 1) {
       if (timeout_select(s, TS_READ, PT_TIMEOUT_SEC) < 0) {
         syslog(LOG_ERR, "timeout_select: reading from ptloader: %m");
+        close(s);
         rc = -1;
         goto done;
       }
@@ -516,6 +1023,11 @@ static void myfreestate(struct auth_state *auth_state)
     free(auth_state);
 }
 
+EXPORTED struct auth_state *ptscache_newstate(const char *identifier)
+{
+    return mynewstate(identifier);
+}
+
 HIDDEN struct auth_mech auth_pts =
 {
     "pts",              /* name */
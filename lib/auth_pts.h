@@ -56,6 +56,7 @@
 
 #define PTS_DBFIL FNAME_PTSDB
 #define PTS_DBSOCKET "/ptclient/ptsock"
+#define PTS_SHMFIL "/ptclient/ptscache.shm"
 #define PTS_DB_KEYSIZE 512
 
 struct auth_ident {
@@ -70,4 +71,13 @@ struct auth_state {
     struct auth_ident groups[1]; /* variable sized */
 };
 
+/* called by ptloader to publish the state it loaded for 'identifier'
+ * (or NULL if it couldn't) in the shared-memory cache */
+extern void ptscache_shm_store(const char *identifier, size_t id_len,
+                               const struct auth_state *state);
+
+/* load the auth state for 'identifier' as the pts mechanism does,
+ * whatever auth_mech is set to.  Only useful for whitebox testing. */
+extern struct auth_state *ptscache_newstate(const char *identifier);
+
 #endif /* INCLUDED_AUTH_PTS_H */
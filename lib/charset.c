@@ -1128,7 +1128,7 @@ static int is_phrasing(char *tag)
     };
     static struct hash_table hash = HASH_TABLE_INITIALIZER;
 
-    if (hash.table == NULL) {
+    if (!hash_is_initialized(&hash)) {
         unsigned int i;
         construct_hash_table(&hash, VECTOR_SIZE(phrasing_tags), 0);
         for (i = 0 ; i < VECTOR_SIZE(phrasing_tags) ; i++)
@@ -144,3 +144,128 @@ EXPORTED int glob_test(glob *g, const char *str)
 
     return match[1].rm_eo;
 }
+
+EXPORTED globset *globset_init(const char * const *pats, int npats, char sep)
+{
+    globset *gs = xzmalloc(sizeof(globset));
+    size_t maxlen = 0;
+    int i;
+
+    gs->count = npats;
+    gs->sep = sep;
+    gs->globs = xmalloc(npats * sizeof(glob *));
+    gs->pats = xmalloc(npats * sizeof(char *));
+
+    for (i = 0; i < npats; i++) {
+        size_t len = strlen(pats[i]);
+        gs->globs[i] = glob_init(pats[i], sep);
+        gs->pats[i] = xstrdup(pats[i]);
+        if (len > maxlen) maxlen = len;
+    }
+
+    gs->states = xmalloc(2 * (maxlen + 1));
+
+    return gs;
+}
+
+EXPORTED void globset_free(globset **gsp)
+{
+    globset *gs = *gsp;
+    int i;
+
+    if (gs) {
+        for (i = 0; i < gs->count; i++) {
+            glob_free(&gs->globs[i]);
+            free(gs->pats[i]);
+        }
+        free(gs->globs);
+        free(gs->pats);
+        free(gs->states);
+        free(gs);
+    }
+    *gsp = NULL;
+}
+
+EXPORTED int globset_test(globset *gs, const char *str)
+{
+    int matchlen = 0;
+    int i;
+
+    for (i = 0; i < gs->count; i++) {
+        int thismatch = glob_test(gs->globs[i], str);
+        if (thismatch > matchlen) matchlen = thismatch;
+    }
+
+    return matchlen;
+}
+
+/* follow the wildcards, which may all match nothing */
+static void glob_closure(const char *pat, size_t len, unsigned char *states)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (states[i] && (pat[i] == '*' || pat[i] == '%'))
+            states[i+1] = 1;
+    }
+}
+
+/* Run the pattern as an NFA over 'str' + sep: a state is a position in
+ * the pattern.  If any position short of the end is still alive, the
+ * rest of the pattern can match a child name. */
+static int glob_can_descend(const char *pat, const char *str, char sep,
+                            unsigned char *cur, unsigned char *next)
+{
+    size_t len = strlen(pat);
+    const char *p;
+    size_t i;
+
+    memset(cur, 0, len + 1);
+    cur[0] = 1;
+    glob_closure(pat, len, cur);
+
+    for (p = str; ; p++) {
+        char c = *p ? *p : sep;
+        int alive = 0;
+
+        memset(next, 0, len + 1);
+        for (i = 0; i < len; i++) {
+            if (!cur[i]) continue;
+            if (pat[i] == '*')
+                next[i] = 1;
+            else if (pat[i] == '%') {
+                if (c != sep) next[i] = 1;
+            }
+            else if (pat[i] == c)
+                next[i+1] = 1;
+        }
+        glob_closure(pat, len, next);
+
+        for (i = 0; i <= len; i++)
+            alive |= next[i];
+        if (!alive) return 0;
+
+        memcpy(cur, next, len + 1);
+        if (!*p) break;
+    }
+
+    for (i = 0; i < len; i++) {
+        if (cur[i]) return 1;
+    }
+
+    return 0;
+}
+
+EXPORTED int globset_can_descend(globset *gs, const char *str)
+{
+    int i;
+
+    for (i = 0; i < gs->count; i++) {
+        size_t len = strlen(gs->pats[i]);
+        if (glob_can_descend(gs->pats[i], str, gs->sep,
+                             gs->states, gs->states + len + 1))
+            return 1;
+    }
+
+    return 0;
+}
@@ -73,6 +73,36 @@ extern void glob_free(glob **gp);
  */
 extern int glob_test(glob *g, const char *str);
 
+/* a set of patterns (e.g. from LIST-EXTENDED) compiled together,
+ * which can also tell a sorted walk of names when to skip a subtree
+ */
+typedef struct globset {
+    int count;
+    glob **globs;
+    char **pats;
+    char sep;
+    unsigned char *states;      /* scratch for globset_can_descend */
+} globset;
+
+/* compile the 'npats' patterns in 'pats' for hierarchy separator 'sep'
+ */
+extern globset *globset_init(const char * const *pats, int npats, char sep);
+
+/* free a globset structure
+ */
+extern void globset_free(globset **gsp);
+
+/* returns the longest glob_test() result of any pattern in the set,
+ * or 0 if none of them match
+ */
+extern int globset_test(globset *gs, const char *str);
+
+/* returns nonzero if some pattern could match a longer name that
+ * starts with 'str' followed by the separator, i.e. if it's worth
+ * looking at the children of 'str' at all
+ */
+extern int globset_can_descend(globset *gs, const char *str);
+
 /* MACROS */
 #define GLOB_MATCH(g, str) ((int)strlen(str) == glob_test((g), (str)))
 
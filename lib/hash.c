@@ -3,13 +3,17 @@
 #include <config.h>
 #endif
 
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "assert.h"
 #include "hash.h"
 #include "mpool.h"
-#include "strhash.h"
 #include "xmalloc.h"
 
 /*
@@ -30,36 +34,200 @@
 **  - sort the buckets for faster searching
 **  - actually, we'll just use a memory pool for this sucker
 **    (atleast, in the cases where it is advantageous to do so)
+**
+** Rewritten as an open-addressed table, after Google's "Swiss tables".
+**  - slots live in one flat array, no allocation per entry
+**  - a control byte per slot holds 7 bits of the hash, so a group of 16
+**    slots is checked with a couple of SSE2 instructions (or a loop)
+**    and keys are only compared when those bits match
+**  - deleted slots are marked rather than moved, so deleting from
+**    inside hash_enumerate() is still fine
+*/
+
+#define CTRL_EMPTY      0x80
+#define CTRL_DELETED    0xfe
+#define CTRL_ISFULL(c)  (!((c) & 0x80))
+
+#define GROUP_WIDTH 16
+
+/* resize once more than 7/8 of the slots are in use */
+#define MAX_USED(size) ((size) - (size) / 8)
+
+/* strhash() only keeps the tail of a long key and its low bit is always
+ * clear, which is fine modulo a prime but not for masking, so use
+ * FNV-1a with a final mix instead */
+static uint64_t hash_key(const char *key)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*key) {
+        h ^= (unsigned char) *key++;
+        h *= 0x100000001b3ULL;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+#define H1(h) ((size_t) ((h) >> 7))
+#define H2(h) ((unsigned char) ((h) & 0x7f))
+
+/* bit i is set for each control byte in the group that equals 'c' */
+static unsigned group_match(const unsigned char *ctrl, unsigned char c)
+{
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char) c)));
+#else
+    unsigned mask = 0;
+    int i;
+
+    for (i = 0; i < GROUP_WIDTH; i++) {
+        if (ctrl[i] == c) mask |= 1U << i;
+    }
+    return mask;
+#endif
+}
+
+/* bit i is set for each empty or deleted control byte in the group */
+static unsigned group_match_free(const unsigned char *ctrl)
+{
+#ifdef __SSE2__
+    /* those are exactly the bytes with the top bit set */
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) ctrl));
+#else
+    unsigned mask = 0;
+    int i;
+
+    for (i = 0; i < GROUP_WIDTH; i++) {
+        if (!CTRL_ISFULL(ctrl[i])) mask |= 1U << i;
+    }
+    return mask;
+#endif
+}
+
+static int ctz(unsigned mask)
+{
+#ifdef __GNUC__
+    return __builtin_ctz(mask);
+#else
+    int i = 0;
+    while (!(mask & 1)) { mask >>= 1; i++; }
+    return i;
+#endif
+}
+
+static void alloc_slots(hash_table *table, size_t size)
+{
+    table->size = size;
+    table->count = 0;
+    table->used = 0;
+    table->slots = xzmalloc(size * sizeof(struct hash_slot));
+    table->ctrl = xmalloc(size);
+    memset(table->ctrl, CTRL_EMPTY, size);
+}
+
+/* Find 'key', returning its slot index or -1.  If 'freep' is set and the
+** key isn't there, it gets the first free slot on the key's probe path.
+** Groups are probed in triangular order, which visits every group once
+** because the number of groups is a power of two.
 */
+static ssize_t find_slot(const hash_table *table, const char *key,
+                         uint64_t h, ssize_t *freep)
+{
+    size_t ngroups = table->size / GROUP_WIDTH;
+    size_t g = H1(h) & (ngroups - 1);
+    unsigned char h2 = H2(h);
+    size_t i;
+
+    if (freep) *freep = -1;
+
+    for (i = 1; i <= ngroups; i++) {
+        const unsigned char *ctrl = table->ctrl + g * GROUP_WIDTH;
+        unsigned mask = group_match(ctrl, h2);
+
+        while (mask) {
+            size_t pos = g * GROUP_WIDTH + ctz(mask);
+            if (!strcmp(key, table->slots[pos].key))
+                return pos;
+            mask &= mask - 1;
+        }
+
+        mask = group_match_free(ctrl);
+        if (freep && *freep < 0 && mask)
+            *freep = g * GROUP_WIDTH + ctz(mask);
+
+        /* an empty slot ends the probe: nothing was ever pushed past it */
+        if (group_match(ctrl, CTRL_EMPTY))
+            return -1;
+
+        g = (g + i) & (ngroups - 1);
+    }
+
+    return -1;
+}
+
+/* move every entry into a table of 'size' slots, which also drops the
+** deleted markers */
+static void resize_table(hash_table *table, size_t size)
+{
+    struct hash_slot *oldslots = table->slots;
+    unsigned char *oldctrl = table->ctrl;
+    size_t oldsize = table->size;
+    size_t count = table->count;
+    size_t i;
+
+    alloc_slots(table, size);
+
+    for (i = 0; i < oldsize; i++) {
+        ssize_t pos;
+        uint64_t h;
+
+        if (!CTRL_ISFULL(oldctrl[i])) continue;
+
+        h = hash_key(oldslots[i].key);
+        find_slot(table, oldslots[i].key, h, &pos);
+        table->slots[pos] = oldslots[i];
+        table->ctrl[pos] = H2(h);
+    }
+    table->count = table->used = count;
+
+    free(oldslots);
+    free(oldctrl);
+}
 
-/* Initialize the hash_table to the size asked for.  Allocates space
-** for the correct number of pointers and sets them to NULL.  If it
-** can't allocate sufficient memory, signals error by setting the size
-** of the table to 0.
+/* Initialize the hash_table to hold about 'size' entries.  The number
+** of slots is a power of two and at least one group, with room for
+** 'size' entries before the first resize -- up to a point, since lots
+** of callers guess big and the table can always grow.
 */
 
+#define MAX_INITIAL_SLOTS 4096
+
 EXPORTED hash_table *construct_hash_table(hash_table *table, size_t size, int use_mpool)
 {
+      size_t slots = GROUP_WIDTH;
+
       assert(table);
       assert(size);
 
-      table->size  = size;
+      while (slots < MAX_INITIAL_SLOTS && MAX_USED(slots) < size) slots *= 2;
 
-      /* Allocate the table -- different for using memory pools and not */
+      /* The memory pool only holds the keys: the slot arrays get
+       * reallocated as the table grows */
       if(use_mpool) {
-          /* Allocate an initial memory pool for 32 byte keys + the hash table
-           * + the buckets themselves */
-          table->pool =
-              new_mpool(size * (32 + sizeof(bucket*) + sizeof(bucket)));
-          table->table =
-              (bucket **)mpool_malloc(table->pool,sizeof(bucket *) * size);
+          /* Allocate an initial memory pool for 32 byte keys */
+          table->pool = new_mpool(size * 32);
       } else {
           table->pool = NULL;
-          table->table = xmalloc(sizeof(bucket *) * size);
       }
 
-      /* Allocate the table and initilize it */
-      memset(table->table, 0, sizeof(bucket *) * size);
+      alloc_slots(table, slots);
+      table->enumerating = 0;
+      table->overflow = NULL;
 
       return table;
 }
@@ -72,76 +240,58 @@ EXPORTED hash_table *construct_hash_table(hash_table *table, size_t size, int us
 
 EXPORTED void *hash_insert(const char *key, void *data, hash_table *table)
 {
-      unsigned val = strhash(key) % table->size;
-      bucket *ptr, *newptr;
-      bucket **prev;
+      uint64_t h = hash_key(key);
+      ssize_t pos, freepos;
+
+      pos = find_slot(table, key, h, &freepos);
+      if (pos >= 0) {
+          /* Match! Replace this value and return the old */
+          void *old_data = table->slots[pos].data;
+          table->slots[pos].data = data;
+          return old_data;
+      }
 
-      /*
-      ** NULL means this bucket hasn't been used yet.  We'll simply
-      ** allocate space for our new bucket and put our data there, with
-      ** the table pointing at it.
-      */
-      if (!((table->table)[val]))
-      {
-          if(table->pool) {
-              (table->table)[val] =
-                  (bucket *)mpool_malloc(table->pool, sizeof(bucket));
-              (table->table)[val] -> key = mpool_strdup(table->pool, key);
-          } else {
-              (table->table)[val] = (bucket *)xmalloc(sizeof(bucket));
-              (table->table)[val] -> key = xstrdup(key);
-          }
-          (table->table)[val] -> next = NULL;
-          (table->table)[val] -> data = data;
-          return (table->table)[val] -> data;
+      /* once there's an overflow table, new keys all go there until
+       * hash_enumerate() finishes, so a key is never in both */
+      if (table->overflow) {
+          size_t before = table->overflow->count;
+          void *ret = hash_insert(key, data, table->overflow);
+          table->count += table->overflow->count - before;
+          return ret;
       }
 
       /*
-      ** This spot in the table is already in use.  See if the current string
-      ** has already been inserted, and if so, increment its count.
+      ** Taking an empty slot (rather than reusing a deleted one) may push
+      ** us over the load limit, in which case grow -- or just clean out
+      ** the deleted markers, if that's where the space went.
       */
-      for (prev = &((table->table)[val]), ptr=(table->table)[val];
-           ptr;
-           prev=&(ptr->next),ptr=ptr->next) {
-          int cmpresult = strcmp(key,ptr->key);
-          if (!cmpresult) {
-              /* Match! Replace this value and return the old */
-              void *old_data;
-
-              old_data = ptr->data;
-              ptr -> data = data;
-              return old_data;
-          } else if (cmpresult < 0) {
-              /* The new key is smaller than the current key--
-               * insert a node and return this data */
-              if(table->pool) {
-                  newptr = (bucket *)mpool_malloc(table->pool, sizeof(bucket));
-                  newptr->key = mpool_strdup(table->pool, key);
-              } else {
-                  newptr = (bucket *)xmalloc(sizeof(bucket));
-                  newptr->key = xstrdup(key);
-              }
-              newptr->data = data;
-              newptr->next = ptr;
-              *prev = newptr;
-              return data;
+      if (freepos < 0 ||
+          (table->ctrl[freepos] == CTRL_EMPTY &&
+           table->used + 1 > MAX_USED(table->size))) {
+          size_t size = table->size;
+
+          if (table->enumerating) {
+              /* moving the entries would make hash_enumerate() skip
+               * some or see them twice, so park this one until it's
+               * done */
+              table->overflow = xmalloc(sizeof(hash_table));
+              construct_hash_table(table->overflow, GROUP_WIDTH, 0);
+              table->count++;
+              return hash_insert(key, data, table->overflow);
           }
-      }
 
-      /*
-      ** This key is the largest one so far.  Add it to the end
-      ** of the list (*prev should be correct)
-      */
-      if(table->pool) {
-          newptr=(bucket *)mpool_malloc(table->pool,sizeof(bucket));
-          newptr->key = mpool_strdup(table->pool,key);
-      } else {
-          newptr=(bucket *)xmalloc(sizeof(bucket));
-          newptr->key = xstrdup(key);
+          if (table->count + 1 > MAX_USED(size) / 2) size *= 2;
+          resize_table(table, size);
+          find_slot(table, key, h, &freepos);
       }
-      newptr->data = data;
-      newptr->next = NULL;
-      *prev = newptr;
+
+      if (table->ctrl[freepos] == CTRL_EMPTY) table->used++;
+      table->count++;
+      table->ctrl[freepos] = H2(h);
+      table->slots[freepos].key =
+          table->pool ? mpool_strdup(table->pool, key) : xstrdup(key);
+      table->slots[freepos].data = data;
+
       return data;
 }
 
@@ -153,21 +303,16 @@ EXPORTED void *hash_insert(const char *key, void *data, hash_table *table)
 
 EXPORTED void *hash_lookup(const char *key, hash_table *table)
 {
-      unsigned val = strhash(key) % table->size;
-      bucket *ptr;
+      ssize_t pos;
 
-      if (!(table->table)[val])
+      if (!table->count)
             return NULL;
 
-      for ( ptr = (table->table)[val];NULL != ptr; ptr = ptr->next )
-      {
-          int cmpresult = strcmp(key, ptr->key);
-          if (!cmpresult)
-              return ptr->data;
-          else if(cmpresult < 0) /* key < ptr->key -- we passed it */
-              return NULL;
-      }
-      return NULL;
+      pos = find_slot(table, key, hash_key(key), NULL);
+      if (pos >= 0)
+            return table->slots[pos].data;
+
+      return table->overflow ? hash_lookup(key, table->overflow) : NULL;
 }
 
 /*
@@ -178,68 +323,47 @@ EXPORTED void *hash_lookup(const char *key, hash_table *table)
  * since it will leak memory until you get rid of the entire hash table */
 EXPORTED void *hash_del(const char *key, hash_table *table)
 {
-      unsigned val = strhash(key) % table->size;
+      size_t group;
+      ssize_t pos;
       void *data;
-      bucket *ptr, *last = NULL;
 
-      if (!(table->table)[val])
+      if (!table->count)
             return NULL;
 
-      /*
-      ** Traverse the list, keeping track of the previous node in the list.
-      ** When we find the node to delete, we set the previous node's next
-      ** pointer to point to the node after ourself instead.  We then delete
-      ** the key from the present node, and return a pointer to the data it
-      ** contains.
-      */
-
-      for (last = NULL, ptr = (table->table)[val];
-            NULL != ptr;
-            last = ptr, ptr = ptr->next)
-      {
-          int cmpresult = strcmp(key, ptr->key);
-          if (!cmpresult)
-          {
-              if (last != NULL )
-              {
-                  data = ptr -> data;
-                  last -> next = ptr -> next;
-                  if(!table->pool) {
-                      free(ptr->key);
-                      free(ptr);
-                  }
+      pos = find_slot(table, key, hash_key(key), NULL);
+      if (pos < 0) {
+            if (table->overflow) {
+                  size_t before = table->overflow->count;
+                  data = hash_del(key, table->overflow);
+                  table->count -= before - table->overflow->count;
                   return data;
-              }
-
-              /*
-              ** If 'last' still equals NULL, it means that we need to
-              ** delete the first node in the list. This simply consists
-              ** of putting our own 'next' pointer in the array holding
-              ** the head of the list.  We then dispose of the current
-              ** node as above.
-              */
-
-              else
-              {
-                  data = ptr->data;
-                  (table->table)[val] = ptr->next;
-                  if(!table->pool) {
-                      free(ptr->key);
-                      free(ptr);
-                  }
-                  return data;
-              }
-          } else if (cmpresult < 0) {
-              /* its not here! */
-              return NULL;
-          }
+            }
+            return NULL;
       }
 
+      data = table->slots[pos].data;
+      if (!table->pool)
+            free(table->slots[pos].key);
+      table->slots[pos].key = NULL;
+      table->slots[pos].data = NULL;
+      table->count--;
+
       /*
-      ** If we get here, it means we didn't find the item in the table.
-      ** Signal this by returning NULL.
+      ** A probe stops at the first group with an empty slot, so if this
+      ** group already has one, no probe goes through it and the slot
+      ** can be empty again.  Otherwise leave a marker, so that probes
+      ** for keys further along keep going.
       */
-      return NULL;
+      group = pos - pos % GROUP_WIDTH;
+      if (group_match(table->ctrl + group, CTRL_EMPTY)) {
+            table->ctrl[pos] = CTRL_EMPTY;
+            table->used--;
+      }
+      else {
+            table->ctrl[pos] = CTRL_DELETED;
+      }
+
+      return data;
 }
 
 /*
@@ -252,39 +376,39 @@ EXPORTED void *hash_del(const char *key, hash_table *table)
 
 EXPORTED void free_hash_table(hash_table *table, void (*func)(void *))
 {
-      unsigned i;
-      bucket *ptr, *temp;
+      size_t i;
 
       /* If we have a function to free the data, apply it everywhere */
       /* We also need to traverse this anyway if we aren't using a memory
        * pool */
       if(func || !table->pool) {
-          for (i=0;i<table->size; i++)
-          {
-              ptr = (table->table)[i];
-              while (ptr)
-              {
-                  temp = ptr;
-                  ptr = ptr->next;
-                  if (func)
-                      func(temp->data);
-                  if(!table->pool) {
-                      free(temp->key);
-                      free(temp);
-                  }
-              }
+          for (i = 0; i < table->size; i++) {
+              if (!CTRL_ISFULL(table->ctrl[i])) continue;
+              if (func)
+                  func(table->slots[i].data);
+              if (!table->pool)
+                  free(table->slots[i].key);
           }
       }
 
+      if (table->overflow) {
+          free_hash_table(table->overflow, func);
+          free(table->overflow);
+          table->overflow = NULL;
+      }
+
       /* Free the main structures */
       if(table->pool) {
           free_mpool(table->pool);
           table->pool = NULL;
-      } else {
-          free(table->table);
       }
-      table->table = NULL;
+      free(table->slots);
+      free(table->ctrl);
+      table->slots = NULL;
+      table->ctrl = NULL;
       table->size = 0;
+      table->count = 0;
+      table->used = 0;
 }
 
 /*
@@ -295,37 +419,46 @@ EXPORTED void free_hash_table(hash_table *table, void (*func)(void *))
 EXPORTED void hash_enumerate(hash_table *table, void (*func)(const char *, void *, void *),
                     void *rock)
 {
-      unsigned i;
-      bucket *temp, *temp_next;
-
-      for (i=0;i<table->size; i++)
-      {
-            if ((table->table)[i] != NULL)
-            {
-                  for (temp = (table->table)[i];
-                        NULL != temp;
-                        temp = temp_next)
-                  {
-                        temp_next = temp->next;
-                        func(temp -> key, temp->data, rock);
-                  }
+      size_t i;
+
+      table->enumerating++;
+
+      /* the table doesn't grow while we're in here, see hash_insert() */
+      for (i = 0; i < table->size; i++) {
+            if (CTRL_ISFULL(table->ctrl[i]))
+                  func(table->slots[i].key, table->slots[i].data, rock);
+      }
+
+      if (!--table->enumerating && table->overflow) {
+            hash_table *overflow = table->overflow;
+
+            table->overflow = NULL;
+            table->count -= overflow->count;
+            for (i = 0; i < overflow->size; i++) {
+                  if (CTRL_ISFULL(overflow->ctrl[i]))
+                        hash_insert(overflow->slots[i].key,
+                                    overflow->slots[i].data, table);
             }
+            free_hash_table(overflow, NULL);
+            free(overflow);
       }
 }
 
 EXPORTED strarray_t *hash_keys(hash_table *table)
 {
-    unsigned i;
-    bucket *temp;
+    size_t i;
 
     strarray_t *sa = strarray_new();
 
     for (i = 0; i < table->size; i++) {
-        temp = (table->table)[i];
-        while (temp) {
-            strarray_append(sa, temp->key);
-            temp = temp->next;
-        }
+        if (CTRL_ISFULL(table->ctrl[i]))
+            strarray_append(sa, table->slots[i].key);
+    }
+
+    if (table->overflow) {
+        strarray_t *more = hash_keys(table->overflow);
+        strarray_cat(sa, more);
+        strarray_free(more);
     }
 
     return sa;
@@ -333,17 +466,5 @@ EXPORTED strarray_t *hash_keys(hash_table *table)
 
 EXPORTED int hash_numrecords(hash_table *table)
 {
-    unsigned i;
-    bucket *temp;
-    int count = 0;
-
-    for (i = 0; i < table->size; i++) {
-        temp = (table->table)[i];
-        while (temp) {
-            count++;
-            temp = temp->next;
-        }
-    }
-
-    return count;
+    return table->count;
 }
@@ -6,34 +6,40 @@
 #include "mpool.h"
 #include "strarray.h"
 
-#define HASH_TABLE_INITIALIZER {0, NULL, NULL}
+#define HASH_TABLE_INITIALIZER {0, 0, 0, NULL, NULL, NULL, 0, NULL}
 
 /*
-** A hash table consists of an array of these buckets.  Each bucket
-** holds a copy of the key, a pointer to the data associated with the
-** key, and a pointer to the next bucket that collided with this one,
-** if there was one.
+** The table is open addressed: every entry lives in a flat array of
+** slots, each holding a copy of the key and a pointer to the data
+** associated with it.  A parallel array holds one control byte per
+** slot, which is either free or a few bits of the key's hash, and
+** lookups scan the control bytes a group at a time before comparing
+** any keys.
 */
 
-typedef struct bucket {
+struct hash_slot {
     char *key;
     void *data;
-    struct bucket *next;
-} bucket;
+};
 
 /*
 ** This is what you actually declare an instance of to create a table.
 ** You then call 'construct_table' with the address of this structure,
-** and a guess at the size of the table.  Note that more nodes than this
-** can be inserted in the table, but performance degrades as this
-** happens.  Performance should still be quite adequate until 2 or 3
-** times as many nodes have been inserted as the table was created with.
+** and a guess at the size of the table.  The table grows as needed, so
+** more nodes than this can be inserted, but it saves a resize or two
+** if the guess is about right.
 */
 
 typedef struct hash_table {
-    size_t size;
-    bucket **table;
-    struct mpool *pool;
+    size_t size;                /* number of slots, 0 until constructed */
+    size_t count;               /* entries in the table */
+    size_t used;                /* entries plus deleted markers */
+    unsigned char *ctrl;
+    struct hash_slot *slots;
+    struct mpool *pool;         /* for the keys, if set */
+    int enumerating;
+    struct hash_table *overflow; /* inserts made while enumerating a
+                                    full table, merged in afterwards */
 } hash_table;
 
 /*
@@ -72,7 +78,8 @@ void *hash_del(const char *key,hash_table *table);
 ** Goes through a hash table and calls the function passed to it
 ** for each node that has been inserted.  The function is passed
 ** a pointer to the key, a pointer to the data associated
-** with it and 'rock'.
+** with it and 'rock'.  The function may delete entries; it may also
+** insert them, but they may or may not be visited.
 */
 
 void hash_enumerate(hash_table *table,void (*func)(const char *,void *,void *),
@@ -81,6 +88,9 @@ void hash_enumerate(hash_table *table,void (*func)(const char *,void *,void *),
 /* gets all the keys from the hashtable */
 strarray_t *hash_keys(hash_table *table);
 
+/* has construct_hash_table() been called (and not free_hash_table())? */
+#define hash_is_initialized(table) ((table)->size != 0)
+
 /* counts the number of nodes in the hash table */
 
 int hash_numrecords(hash_table *table);
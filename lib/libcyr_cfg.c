@@ -145,6 +145,26 @@ static struct cyrusopt_s cyrus_options[] = {
       CFGVAL(long, 1),
       CYRUS_OPT_SWITCH },
 
+    { CYRUSOPT_SQLDB_JOURNAL_MODE,
+      CFGVAL(const char *, "delete"),
+      CYRUS_OPT_STRING },
+
+    { CYRUSOPT_SQLDB_SYNCHRONOUS,
+      CFGVAL(const char *, "full"),
+      CYRUS_OPT_STRING },
+
+    { CYRUSOPT_PTSCACHE_SHM_SLOTS,
+      CFGVAL(long, 0),
+      CYRUS_OPT_INT },
+
+    { CYRUSOPT_PTSCACHE_REFRESH,
+      CFGVAL(long, 0),
+      CYRUS_OPT_INT },
+
+    { CYRUSOPT_PTSCACHE_NEGATIVE_TIMEOUT,
+      CFGVAL(long, 60),
+      CYRUS_OPT_INT },
+
     { CYRUSOPT_LAST, { NULL }, CYRUS_OPT_NOTOPT }
 };
 
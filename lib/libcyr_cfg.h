@@ -105,6 +105,16 @@ enum cyrus_opt {
     CYRUSOPT_SQL_USESSL,
     /* Checkpoint after every recovery (OFF) */
     CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
+    /* SQLite journal mode for sqldb databases ("delete") */
+    CYRUSOPT_SQLDB_JOURNAL_MODE,
+    /* SQLite synchronous mode for sqldb databases ("full") */
+    CYRUSOPT_SQLDB_SYNCHRONOUS,
+    /* Slots in the shared-memory ptscache (0, disabled) */
+    CYRUSOPT_PTSCACHE_SHM_SLOTS,
+    /* Seconds either side of ptscache expiry to refresh in the background (0) */
+    CYRUSOPT_PTSCACHE_REFRESH,
+    /* Seconds to remember that ptloader failed to load an identifier (60) */
+    CYRUSOPT_PTSCACHE_NEGATIVE_TIMEOUT,
 
     CYRUSOPT_LAST
 
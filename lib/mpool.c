@@ -114,6 +114,31 @@ EXPORTED void free_mpool(struct mpool *pool)
     free(pool);
 }
 
+/* Release everything allocated from a pool.  Only the newest (and so
+ * largest) blob is kept, ready to be handed out again */
+EXPORTED void mpool_reset(struct mpool *pool)
+{
+    struct mpool_blob *p, *p_next;
+
+    if (!pool) return;
+    if (!pool->blob) {
+        fatal("memory pool without a blob", EC_TEMPFAIL);
+        return;
+    }
+
+    p = pool->blob->next;
+
+    while(p) {
+        p_next = p->next;
+        free(p->base);
+        free(p);
+        p = p_next;
+    }
+
+    pool->blob->next = NULL;
+    pool->blob->ptr = pool->blob->base;
+}
+
 #ifdef ROUNDUP
 #undef ROUNDUP
 #endif
@@ -63,6 +63,9 @@ struct mpool *new_mpool(size_t size);
 /* Free a pool */
 void free_mpool(struct mpool *pool);
 
+/* Release everything allocated from a pool, but keep its memory */
+void mpool_reset(struct mpool *pool);
+
 /* Allocate from a pool */
 void *mpool_malloc(struct mpool *pool, size_t size);
 char *mpool_strdup(struct mpool *pool, const char *str);
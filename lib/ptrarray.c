@@ -45,6 +45,7 @@
 
 #include "ptrarray.h"
 #include <memory.h>
+#include "util.h"
 #include "xmalloc.h"
 
 EXPORTED ptrarray_t *ptrarray_new(void)
@@ -52,15 +53,28 @@ EXPORTED ptrarray_t *ptrarray_new(void)
     return xzmalloc(sizeof(ptrarray_t));
 }
 
+/*
+ * Initialise an empty array whose data[] is allocated from the
+ * per-command memory context (see cmdpool_reset()).  The array must
+ * not outlive the current command.
+ */
+EXPORTED void ptrarray_init_pool(ptrarray_t *pa)
+{
+    ptrarray_init(pa);
+    pa->pool = 1;
+}
+
 EXPORTED void ptrarray_fini(ptrarray_t *pa)
 {
     if (!pa)
         return;
     memset(pa->data, 0, sizeof(void *) * pa->count);
-    free(pa->data);
+    if (!pa->pool)
+        free(pa->data);
     pa->data = NULL;
     pa->count = 0;
     pa->alloc = 0;
+    pa->pool = 0;
 }
 
 EXPORTED void ptrarray_free(ptrarray_t *pa)
@@ -86,7 +100,24 @@ static void ensure_alloc(ptrarray_t *pa, int newalloc)
     if (newalloc <= pa->alloc)
         return;
     newalloc = ((newalloc + QUANTUM-1) / QUANTUM) * QUANTUM;
-    pa->data = xrealloc(pa->data, sizeof(void *) * newalloc);
+    if (pa->pool) {
+        /* pool memory can't be realloc()ed, so at least double the size
+         * each time, and move to the heap once it gets too big */
+        void **data;
+        if (newalloc < 2 * pa->alloc)
+            newalloc = 2 * pa->alloc;
+        data = cmdpool_malloc(sizeof(void *) * newalloc);
+        if (!data) {
+            data = xmalloc(sizeof(void *) * newalloc);
+            pa->pool = 0;
+        }
+        if (pa->alloc)
+            memcpy(data, pa->data, sizeof(void *) * pa->alloc);
+        pa->data = data;
+    }
+    else {
+        pa->data = xrealloc(pa->data, sizeof(void *) * newalloc);
+    }
     memset(pa->data+pa->alloc, 0, sizeof(void *) * (newalloc-pa->alloc));
     pa->alloc = newalloc;
 }
@@ -189,6 +220,9 @@ EXPORTED void *ptrarray_nth(const ptrarray_t *pa, int idx)
 EXPORTED void **ptrarray_takevf(ptrarray_t *pa)
 {
     void **d = pa->data;
+    /* the caller will free() this, so it can't be pool memory */
+    if (pa->pool && d)
+        d = xmemdup(d, sizeof(void *) * pa->alloc);
     pa->data = NULL;
     pa->count = pa->alloc = 0;
     ptrarray_free(pa);
@@ -54,10 +54,13 @@ typedef struct
     int count;
     int alloc;
     void **data;
+    int pool;       /* data[] comes from the command pool */
 } ptrarray_t;
 
-#define PTRARRAY_INITIALIZER    { 0, 0, NULL }
+#define PTRARRAY_INITIALIZER    { 0, 0, NULL, 0 }
+#define PTRARRAY_POOL_INITIALIZER { 0, 0, NULL, 1 }
 #define ptrarray_init(pa)   (memset((pa), 0, sizeof(ptrarray_t)))
+void ptrarray_init_pool(ptrarray_t *);
 void ptrarray_fini(ptrarray_t *);
 
 ptrarray_t *ptrarray_new(void);
@@ -55,6 +55,7 @@
 #include <sys/wait.h>
 
 #include "assert.h"
+#include "libcyr_cfg.h"
 #include "sqldb.h"
 #include "util.h"
 #include "xmalloc.h"
@@ -63,6 +64,33 @@ static int sqldb_active = 0;
 
 static sqldb_t *open_sqldbs;
 
+/* databases with no remaining users, kept open for reuse (MRU first) */
+static sqldb_t *idle_sqldbs;
+static int idle_max = 0;
+
+static int _free_open(sqldb_t *open);
+
+/* close idle databases beyond the first 'max' */
+static void _trim_idle(int max)
+{
+    sqldb_t *open, **prevp = &idle_sqldbs;
+
+    while ((open = *prevp)) {
+        if (max-- > 0) {
+            prevp = &open->next;
+            continue;
+        }
+        *prevp = open->next;
+        _free_open(open);
+    }
+}
+
+EXPORTED void sqldb_keepopen(int max)
+{
+    idle_max = max > 0 ? max : 0;
+    _trim_idle(idle_max);
+}
+
 EXPORTED int sqldb_init(void)
 {
     if (!sqldb_active++) {
@@ -76,6 +104,7 @@ EXPORTED int sqldb_init(void)
 EXPORTED int sqldb_done(void)
 {
     if (!--sqldb_active) {
+        _trim_idle(0);
         sqlite3_shutdown();
         /* XXX - report the problems? */
         assert(!open_sqldbs);
@@ -84,13 +113,48 @@ EXPORTED int sqldb_done(void)
     return 0;
 }
 
+/* find an idle database for 'fname', as long as the file hasn't been
+   replaced (e.g. by dav_reconstruct) since it was opened */
+static sqldb_t *_reuse_idle(const char *fname)
+{
+    sqldb_t *open, **prevp;
+    struct stat sbuf;
+
+    for (prevp = &idle_sqldbs; (open = *prevp); prevp = &open->next) {
+        if (!strcmp(open->fname, fname)) break;
+    }
+    if (!open) return NULL;
+
+    *prevp = open->next;
+
+    if (stat(fname, &sbuf) || sbuf.st_dev != open->dev ||
+        sbuf.st_ino != open->ino) {
+        _free_open(open);
+        return NULL;
+    }
+
+    open->refcount = 1;
+    open->next = open_sqldbs;
+    open_sqldbs = open;
+
+    return open;
+}
+
 static void _debug(void *fname, const char *sql)
 {
     syslog(LOG_DEBUG, "sqldb_exec(%s): %s", (const char *) fname, sql);
 }
 
+static void _finalize_stmt(void *stmt)
+{
+    sqlite3_finalize((sqlite3_stmt *) stmt);
+}
+
 static int _free_open(sqldb_t *open)
 {
+    if (open->stmts.size) free_hash_table(&open->stmts, &_finalize_stmt);
+    strarray_fini(&open->trans);
+
     int rc = sqlite3_close(open->db);
     free(open->fname);
     free(open);
@@ -114,6 +178,8 @@ EXPORTED sqldb_t *sqldb_open(const char *fname, const char *initsql,
 {
     int rc = SQLITE_OK;
     struct stat sbuf;
+    struct buf buf = BUF_INITIALIZER;
+    const char *mode;
     sqldb_t *open;
     int i;
 
@@ -125,6 +191,8 @@ EXPORTED sqldb_t *sqldb_open(const char *fname, const char *initsql,
         }
     }
 
+    if ((open = _reuse_idle(fname))) return open;
+
     open = xzmalloc(sizeof(sqldb_t));
     open->fname = xstrdup(fname);
 
@@ -142,6 +210,11 @@ EXPORTED sqldb_t *sqldb_open(const char *fname, const char *initsql,
         return NULL;
     }
 
+    if (!stat(open->fname, &sbuf)) {
+        open->dev = sbuf.st_dev;
+        open->ino = sbuf.st_ino;
+    }
+
     sqlite3_extended_result_codes(open->db, 1);
     sqlite3_trace(open->db, _debug, open->fname);
 
@@ -167,6 +240,32 @@ EXPORTED sqldb_t *sqldb_open(const char *fname, const char *initsql,
         return NULL;
     }
 
+    /* journal mode is persistent in the database file, so only change
+     * it if asked to, and carry on in the current mode if we can't */
+    if ((mode = libcyrus_config_getstring(CYRUSOPT_SQLDB_JOURNAL_MODE)) &&
+        strcasecmp(mode, "delete")) {
+        buf_printf(&buf, "PRAGMA journal_mode = %s;", mode);
+        rc = sqlite3_exec(open->db, buf_cstring(&buf), NULL, NULL, NULL);
+        if (rc != SQLITE_OK) {
+            syslog(LOG_WARNING, "sqldb_open(%s) set journal_mode %s: %s",
+                   open->fname, mode, sqlite3_errmsg(open->db));
+        }
+        buf_free(&buf);
+    }
+
+    if ((mode = libcyrus_config_getstring(CYRUSOPT_SQLDB_SYNCHRONOUS)) &&
+        strcasecmp(mode, "full")) {
+        buf_printf(&buf, "PRAGMA synchronous = %s;", mode);
+        rc = sqlite3_exec(open->db, buf_cstring(&buf), NULL, NULL, NULL);
+        buf_free(&buf);
+        if (rc != SQLITE_OK) {
+            syslog(LOG_ERR, "DBERROR: sqldb_open(%s) set synchronous %s: %s",
+                   open->fname, mode, sqlite3_errmsg(open->db));
+            _free_open(open);
+            return NULL;
+        }
+    }
+
     rc = sqlite3_exec(open->db, "PRAGMA user_version;", _version_cb, &open->version, NULL);
     if (rc != SQLITE_OK) {
         syslog(LOG_ERR, "sqldb_open(%s) get user_version: %s",
@@ -246,7 +345,6 @@ EXPORTED sqldb_t *sqldb_open(const char *fname, const char *initsql,
         }
     }
 
-    struct buf buf = BUF_INITIALIZER;
     buf_printf(&buf, "PRAGMA user_version = %d;", version);
     rc = sqlite3_exec(open->db, buf_cstring(&buf), NULL, NULL, NULL);
     buf_free(&buf);
@@ -279,13 +377,13 @@ out:
 
 static sqlite3_stmt *_prepare_stmt(sqldb_t *open, const char *cmd)
 {
-    int i;
     sqlite3_stmt *stmt;
-    for (i = 0; i < open->stmts.count; i++) {
-        stmt = ptrarray_nth(&open->stmts, i);
-        if (!strcmp(cmd, sqlite3_sql(stmt)))
-            return stmt;
-    }
+
+    if (!open->stmts.size) construct_hash_table(&open->stmts, 64, 0);
+
+    stmt = hash_lookup(cmd, &open->stmts);
+    if (stmt) return stmt;
+
     /* prepare new statement */
     int rc = sqlite3_prepare_v2(open->db, cmd, -1, &stmt, NULL);
     if (rc != SQLITE_OK) {
@@ -293,21 +391,10 @@ static sqlite3_stmt *_prepare_stmt(sqldb_t *open, const char *cmd)
                open->fname, cmd, sqlite3_errmsg(open->db));
         return NULL;
     }
-    ptrarray_append(&open->stmts, stmt);
+    hash_insert(cmd, stmt, &open->stmts);
     return stmt;
 }
 
-static void _finish_stmt(sqldb_t *open)
-{
-    int i;
-    sqlite3_stmt *stmt;
-    for (i = 0; i < open->stmts.count; i++) {
-        stmt = ptrarray_nth(&open->stmts, i);
-        sqlite3_finalize(stmt);
-    }
-    ptrarray_fini(&open->stmts);
-}
-
 EXPORTED int sqldb_exec(sqldb_t *open, const char *cmd, struct sqldb_bindval bval[],
                         int (*cb)(sqlite3_stmt *stmt, void *rock), void *rock)
 {
@@ -371,6 +458,20 @@ EXPORTED int sqldb_commit(sqldb_t *open, const char *name)
     int r = _onecmd(open, "RELEASE SAVEPOINT", prev);
     if (r) strarray_push(&open->trans, prev);
     free(prev);
+
+    /* only the batch itself left open?  flush it if it's big enough */
+    if (!r && open->batch_maxops && open->trans.count == 1 &&
+        ++open->batch_ops >= open->batch_maxops) {
+        r = _onecmd(open, "RELEASE SAVEPOINT", "sqldb_batch");
+        if (!r) r = _onecmd(open, "SAVEPOINT", "sqldb_batch");
+        if (r) {
+            /* the batch is gone, leave it to sqldb_batch_end() to say so */
+            open->batch_maxops = 0;
+            strarray_truncate(&open->trans, 0);
+        }
+        open->batch_ops = 0;
+    }
+
     return r;
 }
 
@@ -385,6 +486,25 @@ EXPORTED int sqldb_rollback(sqldb_t *open, const char *name)
     return r;
 }
 
+EXPORTED int sqldb_batch_begin(sqldb_t *open, unsigned maxops)
+{
+    assert(!open->batch_maxops);
+    assert(!open->trans.count);
+    int r = sqldb_begin(open, "sqldb_batch");
+    if (!r) {
+        open->batch_maxops = maxops ? maxops : 1;
+        open->batch_ops = 0;
+    }
+    return r;
+}
+
+EXPORTED int sqldb_batch_end(sqldb_t *open)
+{
+    if (!open->batch_maxops) return -1;
+    open->batch_maxops = 0;
+    return sqldb_commit(open, "sqldb_batch");
+}
+
 EXPORTED int sqldb_writelock(sqldb_t *open)
 {
     assert (!open->writelock);
@@ -444,10 +564,15 @@ EXPORTED int sqldb_close(sqldb_t **dbp)
     assert(open);
     assert(!open->trans.count);
 
-    strarray_fini(&open->trans);
-    _finish_stmt(open);
-
     *dbp = NULL;
 
+    if (idle_max && sqlite3_get_autocommit(open->db)) {
+        /* keep it, and its prepared statements, for the next user */
+        open->next = idle_sqldbs;
+        idle_sqldbs = open;
+        _trim_idle(idle_max);
+        return 0;
+    }
+
     return _free_open(open);
 }
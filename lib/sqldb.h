@@ -44,7 +44,9 @@
 #ifndef SQLDB_H
 #define SQLDB_H
 
+#include <sys/types.h>
 #include <sqlite3.h>
+#include "hash.h"
 #include "ptrarray.h"
 #include "strarray.h"
 
@@ -62,11 +64,15 @@ struct sqldb_bindval {
 struct sqldb {
     sqlite3 *db;
     char *fname;
+    dev_t dev;
+    ino_t ino;
     int version;
     int refcount;
     int writelock;
     strarray_t trans;
-    ptrarray_t stmts;
+    hash_table stmts;           /* prepared statements, keyed by SQL text */
+    unsigned batch_maxops;      /* commits per batch, 0 if not batching */
+    unsigned batch_ops;         /* commits since the batch last flushed */
     struct sqldb *next;
 };
 
@@ -84,6 +90,11 @@ int sqldb_init(void);
 /* done with all SQL operations for this process */
 int sqldb_done(void);
 
+/* keep up to 'max' databases open after their last sqldb_close(),
+   so that long-lived processes can reuse the connection and its
+   prepared statements on the next sqldb_open() */
+void sqldb_keepopen(int max);
+
 sqldb_t *sqldb_open(const char *fname, const char *initsql,
                    int version, const struct sqldb_upgrade *upgradesql);
 
@@ -96,6 +107,12 @@ int sqldb_begin(sqldb_t *open, const char *name);
 int sqldb_commit(sqldb_t *open, const char *name);
 int sqldb_rollback(sqldb_t *open, const char *name);
 
+/* group the nested begin/commit pairs of bulk writes into larger
+   transactions, which are committed every 'maxops' commits and
+   at sqldb_batch_end() */
+int sqldb_batch_begin(sqldb_t *open, unsigned maxops);
+int sqldb_batch_end(sqldb_t *open);
+
 int sqldb_writelock(sqldb_t *open);
 int sqldb_writecommit(sqldb_t *open);
 int sqldb_writeabort(sqldb_t *open);
@@ -53,6 +53,19 @@ EXPORTED strarray_t *strarray_new(void)
     return xzmalloc(sizeof(strarray_t));
 }
 
+/*
+ * Initialise an empty array whose data[] is allocated from the
+ * per-command memory context (see cmdpool_reset()).  The array must
+ * not outlive the current command.  The strings themselves are still
+ * individually malloc()ed, as callers expect to free() what
+ * strarray_remove() gives them.
+ */
+EXPORTED void strarray_init_pool(strarray_t *sa)
+{
+    strarray_init(sa);
+    sa->pool = 1;
+}
+
 EXPORTED void strarray_fini(strarray_t *sa)
 {
     int i;
@@ -63,10 +76,12 @@ EXPORTED void strarray_fini(strarray_t *sa)
         free(sa->data[i]);
         sa->data[i] = NULL;
     }
-    free(sa->data);
+    if (!sa->pool)
+        free(sa->data);
     sa->data = NULL;
     sa->count = 0;
     sa->alloc = 0;
+    sa->pool = 0;
 }
 
 EXPORTED void strarray_free(strarray_t *sa)
@@ -90,7 +105,24 @@ static void ensure_alloc(strarray_t *sa, int newalloc)
     if (newalloc < sa->alloc)
         return;
     newalloc = ((newalloc + QUANTUM) / QUANTUM) * QUANTUM;
-    sa->data = xrealloc(sa->data, sizeof(char *) * newalloc);
+    if (sa->pool) {
+        /* pool memory can't be realloc()ed, so at least double the size
+         * each time, and move to the heap once it gets too big */
+        char **data;
+        if (newalloc < 2 * sa->alloc)
+            newalloc = 2 * sa->alloc;
+        data = cmdpool_malloc(sizeof(char *) * newalloc);
+        if (!data) {
+            data = xmalloc(sizeof(char *) * newalloc);
+            sa->pool = 0;
+        }
+        if (sa->alloc)
+            memcpy(data, sa->data, sizeof(char *) * sa->alloc);
+        sa->data = data;
+    }
+    else {
+        sa->data = xrealloc(sa->data, sizeof(char *) * newalloc);
+    }
     memset(sa->data+sa->alloc, 0, sizeof(char *) * (newalloc-sa->alloc));
     sa->alloc = newalloc;
 }
@@ -375,6 +407,9 @@ EXPORTED strarray_t *strarray_nsplit(const char *buf, size_t len, const char *se
 EXPORTED char **strarray_takevf(strarray_t *sa)
 {
     char **d = sa->data;
+    /* the caller will free() this, so it can't be pool memory */
+    if (sa->pool && d)
+        d = xmemdup(d, sizeof(char *) * sa->alloc);
     sa->data = NULL;
     sa->count = sa->alloc = 0;
     strarray_free(sa);
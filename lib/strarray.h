@@ -55,10 +55,13 @@ typedef struct
     int count;
     int alloc;
     char **data;
+    int pool;       /* data[] comes from the command pool */
 } strarray_t;
 
-#define STRARRAY_INITIALIZER    { 0, 0, NULL }
+#define STRARRAY_INITIALIZER    { 0, 0, NULL, 0 }
+#define STRARRAY_POOL_INITIALIZER { 0, 0, NULL, 1 }
 #define strarray_init(sa)   (memset((sa), 0, sizeof(strarray_t)))
+void strarray_init_pool(strarray_t *);
 void strarray_fini(strarray_t *);
 
 strarray_t *strarray_new(void);
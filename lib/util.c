@@ -72,6 +72,7 @@
 #include "exitcodes.h"
 #include "libconfig.h"
 #include "map.h"
+#include "mpool.h"
 #include "retry.h"
 #include "util.h"
 #include "assert.h"
@@ -736,6 +737,34 @@ EXPORTED void cmdtime_netend(void)
     nettime += timesub(&nettime_start, &nettime_end);
 }
 
+/*
+ * Per-command memory context.  Bufs, strarrays and ptrarrays set up
+ * with buf_init_pool() and friends take their storage from here rather
+ * than the heap, and all of it is dropped at once when the command loop
+ * calls cmdpool_reset() before reading the next command.  Nothing is
+ * handed out until the first cmdpool_reset(), so processes which don't
+ * have a command loop quietly get plain heap allocation instead.
+ */
+static struct mpool *cmdpool = NULL;
+
+EXPORTED void cmdpool_reset(void)
+{
+    if (cmdpool)
+        mpool_reset(cmdpool);
+    else
+        cmdpool = new_mpool(0);
+}
+
+/* Returns NULL if there is no command context, or if the allocation
+ * is too large to be worth keeping around until the end of the command.
+ * The caller falls back to the heap in either case. */
+EXPORTED void *cmdpool_malloc(size_t size)
+{
+    if (!cmdpool || size > CMDPOOL_MAXALLOC)
+        return NULL;
+    return mpool_malloc(cmdpool, size);
+}
+
 /*
  * Like the system clock() but works in system time
  * rather than process virtual time.  Would be more
@@ -890,6 +919,28 @@ EXPORTED void _buf_ensure(struct buf *buf, size_t n)
     if (buf->alloc >= newlen)
         return;
 
+    if (buf->flags & BUF_POOL) {
+        /* pool memory can't be realloc()ed, so at least double the size
+         * each time to keep the copying linear.  Once the buffer gets
+         * too big for the pool it moves to the heap for good */
+        size_t alloc = roundup(newlen);
+        if (alloc < 2 * buf->alloc)
+            alloc = 2 * buf->alloc;
+
+        s = cmdpool_malloc(alloc);
+        if (!s) {
+            s = xmalloc(alloc);
+            buf->flags &= ~BUF_POOL;
+        }
+        if (buf->len) {
+            assert(buf->s);
+            memcpy(s, buf->s, buf->len);
+        }
+        buf->s = s;
+        buf->alloc = alloc;
+        return;
+    }
+
     if (buf->alloc) {
         buf->alloc = roundup(newlen);
         buf->s = xrealloc(buf->s, buf->alloc);
@@ -931,8 +982,20 @@ EXPORTED char *buf_newcstring(struct buf *buf)
     return ret;
 }
 
+/* the caller will free() what it gets back, so a pooled buf hands out
+ * a heap copy and keeps its own storage for reuse */
+static char *_buf_release_pool(struct buf *buf)
+{
+    char *ret = xmemdup(buf_cstring(buf), buf->len + 1);
+    buf->len = 0;
+    return ret;
+}
+
 EXPORTED char *buf_release(struct buf *buf)
 {
+    if (buf->flags & BUF_POOL)
+        return _buf_release_pool(buf);
+
     char *ret = (char *)buf_cstring(buf);
     buf_init(buf);
     return ret;
@@ -946,6 +1009,9 @@ EXPORTED const char *buf_cstringnull(const struct buf *buf)
 
 EXPORTED char *buf_releasenull(struct buf *buf)
 {
+    if ((buf->flags & BUF_POOL) && buf->s)
+        return _buf_release_pool(buf);
+
     char *ret = (char *)buf_cstringnull(buf);
     buf_init(buf);
     return ret;
@@ -1000,7 +1066,7 @@ EXPORTED void buf_reset(struct buf *buf)
     if (buf->flags & BUF_MMAP)
         map_free((const char **)&buf->s, &buf->len);
     buf->len = 0;
-    buf->flags = 0;
+    buf->flags &= BUF_POOL;
 }
 
 EXPORTED void buf_truncate(struct buf *buf, ssize_t len)
@@ -1318,6 +1384,18 @@ EXPORTED void buf_init(struct buf *buf)
     buf->s = NULL;
 }
 
+/*
+ * Initialise an empty struct buf which allocates from the per-command
+ * memory context (see cmdpool_reset()).  The buf must not outlive the
+ * current command.  buf_free() is still safe to call, and buf_release()
+ * returns a heap copy as usual.
+ */
+EXPORTED void buf_init_pool(struct buf *buf)
+{
+    buf_init(buf);
+    buf->flags = BUF_POOL;
+}
+
 /*
  * Initialise a struct buf to point to read-only data.  The key here is
  * setting buf->alloc=0 which indicates CoW is in effect, i.e. the data
@@ -1369,6 +1447,8 @@ EXPORTED void buf_init_mmap(struct buf *buf, int onceonly, int fd,
 
 static void _buf_free_data(struct buf *buf)
 {
+    if (buf->flags & BUF_POOL)
+        return; /* goes when the command pool is reset */
     if (buf->alloc)
         free(buf->s);
     else if (buf->flags & BUF_MMAP)
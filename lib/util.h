@@ -237,7 +237,13 @@ extern double timesub(const struct timeval *start, const struct timeval *end);
 
 extern clock_t sclock(void);
 
+/* per-command memory context */
+#define CMDPOOL_MAXALLOC (16*1024)
+extern void cmdpool_reset(void);
+extern void *cmdpool_malloc(size_t size);
+
 #define BUF_MMAP    (1<<1)
+#define BUF_POOL    (1<<2)  /* storage comes from the command pool */
 
 struct buf {
     char *s;
@@ -246,6 +252,7 @@ struct buf {
     unsigned flags;
 };
 #define BUF_INITIALIZER { NULL, 0, 0, 0 }
+#define BUF_POOL_INITIALIZER { NULL, 0, 0, BUF_POOL }
 
 #define buf_new() ((struct buf *) xzmalloc(sizeof(struct buf)))
 #define buf_destroy(b) do { buf_free((b)); free((b)); } while (0)
@@ -294,6 +301,7 @@ int buf_cmp(const struct buf *, const struct buf *);
 int buf_findchar(const struct buf *, unsigned int off, int c);
 int buf_findline(const struct buf *buf, const char *line);
 void buf_init(struct buf *buf);
+void buf_init_pool(struct buf *buf);
 void buf_init_ro(struct buf *buf, const char *base, size_t len);
 void buf_initm(struct buf *buf, char *base, int len);
 void buf_init_ro_cstr(struct buf *buf, const char *str);
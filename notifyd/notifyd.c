@@ -57,8 +57,11 @@
 #endif
 #include <signal.h>
 #include <string.h>
+#include <sys/time.h>
+#include <time.h>
 
 #include "notifyd.h"
+#include "nqueue.h"
 
 #include "exitcodes.h"
 #include "imap/global.h"
@@ -74,6 +77,9 @@ static int soc = 0; /* master has handed us the port as stdin */
 
 static notifymethod_t *default_method;  /* default method daemon is using */
 
+static int max_workers;                 /* 0 = deliver inline */
+static int nmethods;
+
 
 /* Cleanly shut down and exit */
 void shut_down(int code) __attribute__ ((noreturn));
@@ -96,94 +102,209 @@ static char *fetch_arg(char *head, char* tail)
 }
 
 #define NOTIFY_MAXSIZE 8192
+#define STATS_INTERVAL 60
 
-static int do_notify(void)
+/*
+ * parse request of the form:
+ *
+ * method NUL class NUL priority NUL user NUL mailbox NUL
+ *   nopt NUL N(option NUL) message NUL
+ *
+ * Returns the method to use, or NULL if the request is malformed.
+ */
+static notifymethod_t *parse_request(struct nrequest *req, int len)
+{
+    char *cp, *tail = req->buf + len - 1;
+    const char *method;
+    long nopt = 0;
+    int i;
+
+    method = (cp = req->buf);
+
+    if (cp) req->class = (cp = fetch_arg(cp, tail));
+    if (cp) req->priority = (cp = fetch_arg(cp, tail));
+    if (cp) req->user = (cp = fetch_arg(cp, tail));
+    if (cp) req->mailbox = (cp = fetch_arg(cp, tail));
+
+    if (cp) cp = fetch_arg(cp, tail); /* skip to nopt */
+    errno = 0;
+    if (cp) nopt = strtol(cp, NULL, 10);
+    if (nopt < 0 || errno == ERANGE) cp = NULL;
+
+    for (i = 0; cp && i < nopt; i++)
+        strarray_append(&req->options, cp = fetch_arg(cp, tail));
+
+    if (cp) req->message = (cp = fetch_arg(cp, tail));
+    if (cp) req->fname = (cp = fetch_arg(cp, tail));
+
+    if (!req->message) {
+        syslog(LOG_ERR, "malformed notify request");
+        return NULL;
+    }
+
+    if (!*method)
+        return default_method;
+
+    notifymethod_t *nmethod = methods;
+    while (nmethod->name) {
+        if (!strcasecmp(nmethod->name, method)) break;
+        nmethod++;
+    }
+
+    syslog(LOG_DEBUG, "do_notify using method '%s'",
+           nmethod->name ? nmethod->name: "unknown");
+
+    return nmethod->name ? nmethod : NULL;
+}
+
+static void run_request(notifymethod_t *nmethod, struct nrequest *req)
 {
-    struct sockaddr_un sun_data;
-    socklen_t sunlen = sizeof(sun_data);
-    char buf[NOTIFY_MAXSIZE+1], *cp, *tail;
-    int r, i;
-    char *method, *class, *priority, *user, *mailbox, *message;
-    strarray_t options = STRARRAY_INITIALIZER;
-    long nopt;
     char *reply;
-    char *fname;
-    notifymethod_t *nmethod;
 
-    while (1) {
-        method = class = priority = user = mailbox = message = reply = NULL;
-        nopt = 0;
+    reply = nmethod->notify(req->class, req->priority, req->user,
+                            req->mailbox, req->options.count,
+                            req->options.data, req->message, req->fname);
 
-        if (signals_poll() == SIGHUP) {
-            /* caught a SIGHUP, return */
-            return 0;
-        }
-        r = recvfrom(soc, buf, NOTIFY_MAXSIZE, 0,
-                     (struct sockaddr *) &sun_data, &sunlen);
-        if (r == -1) {
-            return (errno);
-        }
-        buf[r] = '\0';
+    /* we don't care about responses right now */
+    free(reply);
+}
+
+static void sigchld_handler(int sig __attribute__((unused)))
+{
+    /* nothing to do, we just want to interrupt the select() */
+}
+
+/* run in a forked worker */
+static void run_worker(int m, struct nrequest *req)
+{
+    close(soc);
+    run_request(&methods[m], req);
+}
+
+static void log_stats(void)
+{
+    int m;
+
+    for (m = 0; m < nmethods; m++) {
+        struct nqueue *q = nqueue_get(m);
 
-        tail = buf + r - 1;
+        if (!q->done && !q->depth && !q->running) continue;
 
-        /*
-         * parse request of the form:
-         *
-         * method NUL class NUL priority NUL user NUL mailbox NUL
-         *   nopt NUL N(option NUL) message NUL
-         */
-        method = (cp = buf);
+        syslog(LOG_INFO, "notifyd: method=%s queued=%d maxqueued=%d "
+               "running=%d done=%lu dropped=%lu timedout=%lu",
+               methods[m].name, q->depth, q->maxdepth, q->running,
+               q->done, q->dropped, q->timedout);
+        q->maxdepth = q->depth;
+    }
+}
 
-        if (cp) class = (cp = fetch_arg(cp, tail));
-        if (cp) priority = (cp = fetch_arg(cp, tail));
-        if (cp) user = (cp = fetch_arg(cp, tail));
-        if (cp) mailbox = (cp = fetch_arg(cp, tail));
+static void queue_request(notifymethod_t *nmethod, struct nrequest *req)
+{
+    int m = nmethod - methods;
 
-        if (cp) cp = fetch_arg(cp, tail); /* skip to nopt */
-        if (cp) nopt = strtol(cp, NULL, 10);
-        if (nopt < 0 || errno == ERANGE) cp = NULL;
+    if (nqueue_add(m, req) && nqueue_get(m)->dropped % 1000 == 1) {
+        syslog(LOG_WARNING, "notifyd: queue for method '%s' is full, "
+               "dropping notifications", nmethod->name);
+    }
+}
 
-        for (i = 0; cp && i < nopt; i++)
-            strarray_append(&options, cp = fetch_arg(cp, tail));
+/* Read all pending requests off the socket */
+static int read_requests(int flags)
+{
+    struct sockaddr_un sun_data;
+    socklen_t sunlen;
+    char buf[NOTIFY_MAXSIZE+1];
+    int r;
 
-        if (cp) message = (cp = fetch_arg(cp, tail));
-        if (cp) fname = (cp = fetch_arg(cp, tail));
+    for (;;) {
+        struct nrequest *req;
+        notifymethod_t *nmethod;
 
-        if (!message) {
-            syslog(LOG_ERR, "malformed notify request");
-            strarray_fini(&options);
-            return 0;
+        sunlen = sizeof(sun_data);
+        r = recvfrom(soc, buf, NOTIFY_MAXSIZE, flags,
+                     (struct sockaddr *) &sun_data, &sunlen);
+        if (r == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return 0;
+            return errno;
         }
+        buf[r] = '\0';
 
-        if (!*method)
-            nmethod = default_method;
+        req = xzmalloc(sizeof(struct nrequest));
+        req->buf = xmalloc(r + 1);
+        memcpy(req->buf, buf, r + 1);
+
+        nmethod = parse_request(req, r);
+        if (!nmethod) {
+            nrequest_free(req);
+        }
+        else if (!max_workers) {
+            run_request(nmethod, req);
+            nqueue_get(nmethod - methods)->done++;
+            nrequest_free(req);
+        }
         else {
-            nmethod = methods;
-            while (nmethod->name) {
-                if (!strcasecmp(nmethod->name, method)) break;
-                nmethod++;
+            queue_request(nmethod, req);
+        }
+
+        if (!(flags & MSG_DONTWAIT)) return 0;
+    }
+}
+
+static int do_notify(void)
+{
+    time_t laststats = time(NULL);
+    int stopping = 0;
+    int r;
+
+    if (!max_workers) {
+        /* serial delivery, one request at a time */
+        while (1) {
+            if (signals_poll() == SIGHUP) {
+                /* caught a SIGHUP, return */
+                return 0;
             }
+            r = read_requests(0);
+            if (r) return r;
         }
+    }
 
-        syslog(LOG_DEBUG, "do_notify using method '%s'",
-               nmethod->name ? nmethod->name: "unknown");
+    while (1) {
+        struct timeval tv = { 1, 0 };
+        fd_set rfds;
+        int pending, running;
 
-        if (nmethod->name) {
-            reply = nmethod->notify(class, priority, user, mailbox,
-                                    nopt, options.data, message, fname);
+        if (!stopping && signals_poll() == SIGHUP) {
+            /* caught a SIGHUP, finish what we have and return */
+            stopping = 1;
         }
-#if 0  /* we don't care about responses right now */
-        else {
-            reply = strdup("NO unknown notification method");
-            if (!reply) {
-                fatal("strdup failed", EC_OSERR);
-            }
+
+        nqueue_check();
+        nqueue_start();
+
+        pending = nqueue_pending();
+        running = nqueue_running();
+        if (stopping && !pending && !running) return 0;
+
+        if (time(NULL) - laststats >= STATS_INTERVAL) {
+            log_stats();
+            laststats = time(NULL);
         }
-#endif
 
-        free(reply);
-        strarray_fini(&options);
+        FD_ZERO(&rfds);
+        if (!stopping) FD_SET(soc, &rfds);
+
+        r = signals_select(soc + 1, &rfds, NULL, NULL,
+                           (running || pending || stopping) ? &tv : NULL);
+        if (r < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            return errno;
+        }
+
+        if (r > 0 && FD_ISSET(soc, &rfds)) {
+            r = read_requests(MSG_DONTWAIT);
+            if (r) return r;
+        }
     }
 
     /* never reached */
@@ -236,6 +357,26 @@ EXPORTED int service_init(int argc, char **argv, char **envp __attribute__((unus
 
     if (!default_method) fatal("unknown notification method %s", EC_USAGE);
 
+    max_workers = config_getint(IMAPOPT_NOTIFYD_WORKERS);
+    if (max_workers < 0) max_workers = 0;
+
+    for (nmethods = 0; methods[nmethods].name; nmethods++);
+    nqueue_init(nmethods, max_workers,
+                config_getint(IMAPOPT_NOTIFYD_METHOD_WORKERS),
+                config_getint(IMAPOPT_NOTIFYD_QUEUE_SIZE),
+                config_getint(IMAPOPT_NOTIFYD_TIMEOUT), &run_worker);
+
+    if (max_workers) {
+        struct sigaction action;
+
+        /* wake up from select() as soon as a worker exits */
+        memset(&action, 0, sizeof(action));
+        sigemptyset(&action.sa_mask);
+        action.sa_handler = sigchld_handler;
+        if (sigaction(SIGCHLD, &action, NULL) < 0)
+            fatal("unable to install signal handler for SIGCHLD", EC_TEMPFAIL);
+    }
+
     signals_set_shutdown(&shut_down);
 
     return 0;
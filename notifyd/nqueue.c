@@ -0,0 +1,232 @@
+/* nqueue.c -- notifyd request queues and worker processes
+ *
+ * Copyright (c) 1994-2017 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <syslog.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#include "nqueue.h"
+#include "xmalloc.h"
+
+/* a forked worker delivering one request */
+struct nworker {
+    pid_t pid;
+    struct nqueue *queue;
+    time_t started;
+};
+
+static struct nqueue *queues;
+static int nqueues;
+static struct nworker *workers;
+static int max_workers;
+static int max_queue_workers;
+static int max_queue;
+static int worker_timeout;
+static int nrunning;
+static nqueue_run_t *run_request;
+
+void nqueue_init(int num_queues, int num_workers, int queue_workers,
+                 int queue_size, int timeout, nqueue_run_t *run)
+{
+    nqueues = num_queues;
+    queues = xzmalloc(nqueues * sizeof(struct nqueue));
+    max_workers = num_workers;
+    workers = max_workers ? xzmalloc(max_workers * sizeof(struct nworker))
+                          : NULL;
+    max_queue_workers = queue_workers;
+    if (max_queue_workers < 1 || max_queue_workers > max_workers)
+        max_queue_workers = max_workers;
+    max_queue = queue_size;
+    worker_timeout = timeout;
+    nrunning = 0;
+    run_request = run;
+}
+
+void nqueue_done(void)
+{
+    int q;
+
+    for (q = 0; q < nqueues; q++) {
+        while (queues[q].head) {
+            struct nrequest *req = queues[q].head;
+
+            queues[q].head = req->next;
+            nrequest_free(req);
+        }
+    }
+
+    free(queues);
+    queues = NULL;
+    nqueues = 0;
+    free(workers);
+    workers = NULL;
+    max_workers = 0;
+    nrunning = 0;
+}
+
+struct nqueue *nqueue_get(int q)
+{
+    return &queues[q];
+}
+
+void nrequest_free(struct nrequest *req)
+{
+    strarray_fini(&req->options);
+    free(req->buf);
+    free(req);
+}
+
+int nqueue_add(int q, struct nrequest *req)
+{
+    struct nqueue *nq = &queues[q];
+
+    if (nq->depth >= max_queue) {
+        /* a slow method only loses its own notifications */
+        nq->dropped++;
+        nrequest_free(req);
+        return -1;
+    }
+
+    req->next = NULL;
+    if (nq->tail) nq->tail->next = req;
+    else nq->head = req;
+    nq->tail = req;
+
+    if (++nq->depth > nq->maxdepth) nq->maxdepth = nq->depth;
+
+    return 0;
+}
+
+void nqueue_start(void)
+{
+    int q, w;
+
+    for (q = 0; q < nqueues && nrunning < max_workers; q++) {
+        struct nqueue *nq = &queues[q];
+
+        while (nq->head && nq->running < max_queue_workers &&
+               nrunning < max_workers) {
+            struct nrequest *req = nq->head;
+            pid_t pid;
+
+            pid = fork();
+            if (pid < 0) {
+                syslog(LOG_ERR, "notifyd: fork failed: %m");
+                return;
+            }
+
+            if (!pid) {
+                /* the worker: own process group, so that a timeout
+                 * also takes care of anything it spawned */
+                setpgid(0, 0);
+                signal(SIGCHLD, SIG_DFL);
+                run_request(q, req);
+                _exit(0);
+            }
+
+            nq->head = req->next;
+            if (!nq->head) nq->tail = NULL;
+            nq->depth--;
+            nrequest_free(req);
+
+            for (w = 0; workers[w].pid; w++);
+            workers[w].pid = pid;
+            workers[w].queue = nq;
+            workers[w].started = time(NULL);
+            nq->running++;
+            nrunning++;
+        }
+    }
+}
+
+void nqueue_check(void)
+{
+    time_t now = time(NULL);
+    pid_t pid;
+    int status, w;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (w = 0; w < max_workers; w++) {
+            if (workers[w].pid != pid) continue;
+
+            workers[w].queue->running--;
+            workers[w].queue->done++;
+            workers[w].pid = 0;
+            nrunning--;
+            break;
+        }
+    }
+
+    for (w = 0; worker_timeout && w < max_workers; w++) {
+        if (!workers[w].pid || workers[w].started < 0) continue;
+        if (now - workers[w].started < worker_timeout) continue;
+
+        syslog(LOG_WARNING, "notifyd: worker %d timed out after %ds",
+               (int) workers[w].pid, worker_timeout);
+        kill(-workers[w].pid, SIGKILL);
+        kill(workers[w].pid, SIGKILL);
+        workers[w].queue->timedout++;
+        /* don't kill it again, it will be reaped shortly */
+        workers[w].started = -1;
+    }
+}
+
+int nqueue_pending(void)
+{
+    int q, pending = 0;
+
+    for (q = 0; q < nqueues; q++) pending += queues[q].depth;
+
+    return pending;
+}
+
+int nqueue_running(void)
+{
+    return nrunning;
+}
@@ -0,0 +1,98 @@
+/* nqueue.h -- notifyd request queues and worker processes
+ *
+ * Copyright (c) 1994-2017 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _NQUEUE_H_
+#define _NQUEUE_H_
+
+#include <sys/types.h>
+#include <time.h>
+
+#include "strarray.h"
+
+/* a parsed notification request, pointing into its own copy of the datagram */
+struct nrequest {
+    struct nrequest *next;
+    char *buf;
+    const char *class, *priority, *user, *mailbox, *message, *fname;
+    strarray_t options;
+};
+
+/* pending requests and running workers of one notification method */
+struct nqueue {
+    struct nrequest *head, *tail;
+    int depth;
+    int maxdepth;
+    int running;
+    unsigned long done;
+    unsigned long dropped;
+    unsigned long timedout;
+};
+
+/* delivers 'req' from queue number 'q', in a forked worker */
+typedef void nqueue_run_t(int q, struct nrequest *req);
+
+/* set up 'nqueues' queues, sharing 'workers' worker processes, at most
+ * 'queue_workers' of them per queue; a queue holds at most 'queue_size'
+ * requests, and a worker is killed after 'timeout' seconds (0 = never) */
+extern void nqueue_init(int nqueues, int workers, int queue_workers,
+                        int queue_size, int timeout, nqueue_run_t *run);
+extern void nqueue_done(void);
+
+extern struct nqueue *nqueue_get(int q);
+
+/* queue 'req' on queue 'q', which takes ownership of it.  Returns 0,
+ * or -1 if the queue is full and 'req' was dropped */
+extern int nqueue_add(int q, struct nrequest *req);
+
+/* start as many queued requests as the limits allow */
+extern void nqueue_start(void);
+
+/* reap finished workers and kill those which ran out of time */
+extern void nqueue_check(void);
+
+/* number of requests queued and of workers running, over all queues */
+extern int nqueue_pending(void);
+extern int nqueue_running(void);
+
+extern void nrequest_free(struct nrequest *req);
+
+#endif /* _NQUEUE_H_ */
@@ -42,6 +42,7 @@
 
 #include <config.h>
 
+#include <errno.h>
 #include <signal.h>
 #include <string.h>
 #include <stdio.h>
@@ -234,19 +235,29 @@ int service_main_fd(int c, int argc __attribute__((unused)),
         /* Success! */
         rc = cyrusdb_store(ptsdb, user, size, (void *)newstate, dsize, NULL);
         (void)rc;
+        ptscache_shm_store(user, size, newstate);
         free(newstate);
 
         /* and we're done */
         reply = "OK";
     } else {
         /* Failure */
+        const char *data = NULL;
+        size_t datalen = 0;
+
         if ( reply == NULL ) {
             reply = "Error making authstate";
         }
+
+        /* services fall back on a db record, even an old one, so
+         * don't tell them to stay away from it */
+        if (cyrusdb_fetch(ptsdb, user, size, &data, &datalen, NULL))
+            ptscache_shm_store(user, size, NULL);
     }
 
  sendreply:
-    if (retry_write(c, reply, strlen(reply) + 1) <0) {
+    /* background refreshes hang up without waiting for the reply */
+    if (retry_write(c, reply, strlen(reply) + 1) <0 && errno != EPIPE) {
         syslog(LOG_WARNING, "retry_write: %m");
     }
     close(c);